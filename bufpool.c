@@ -0,0 +1,555 @@
+/*
+ * bufpool - Pooled, recycled fixed-size buffers shared across
+ *           connections. Buffers are carved out of slabs that are
+ *           never returned to the allocator. Freed buffers go to a
+ *           per-thread freelist first and spill over to a lock-free
+ *           global stack (tagged to avoid ABA) when that fills up.
+ *           The freelist of a thread that exits is parked whole in a
+ *           depot, and the next thread to run dry takes it over, so
+ *           a thread per connection still allocates locally.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include "bufpool.h"
+
+#define HDR_SIZE sizeof(pool_hdr_t)
+
+/* A size class */
+struct pool_class
+{
+	size_t size;                    /* usable bytes per buffer */
+	size_t stride;                  /* bytes per slot, header included */
+	_Atomic uint64_t head;          /* tag << 32 | (index + 1) */
+	char* slabs[POOL_MAX_SLABS];
+	_Atomic int nslabs;
+	pthread_mutex_t grow_lock;
+
+	/* Parked freelists of exited threads */
+	pool_hdr_t* depot[POOL_DEPOT_MAX][POOL_LOCAL_MAX];
+	int depot_len[POOL_DEPOT_MAX];
+	_Atomic int ndepot;
+	pthread_mutex_t depot_lock;
+
+	/* Statistics */
+	_Atomic uint64_t requests;
+	_Atomic uint64_t local_hits;
+	_Atomic uint64_t global_hits;
+	_Atomic uint64_t adopted;
+	_Atomic uint64_t grows;
+	_Atomic int64_t in_use;
+	_Atomic int64_t high_water;
+};
+
+static struct pool_class classes[POOL_NCLASSES];
+static _Atomic uint64_t oversize;
+
+/* Per-thread freelists */
+static __thread pool_hdr_t* local[POOL_NCLASSES][POOL_LOCAL_MAX];
+static __thread int nlocal[POOL_NCLASSES];
+
+/* Initializes the size classes */
+void pool_init()
+{
+	size_t sizes[POOL_NCLASSES] = {POOL_SMALL_SIZE, POOL_MEDIUM_SIZE,
+		                           POOL_LARGE_SIZE};
+	int i;
+
+	for(i = 0; i < POOL_NCLASSES; i++)
+	{
+		classes[i].size = sizes[i];
+		classes[i].stride = HDR_SIZE + sizes[i];
+		atomic_init(&classes[i].head, 0);
+		atomic_init(&classes[i].nslabs, 0);
+		atomic_init(&classes[i].ndepot, 0);
+		if (pthread_mutex_init(&classes[i].grow_lock, NULL) ||
+			pthread_mutex_init(&classes[i].depot_lock, NULL))
+		{
+			printf("Failed to initialize pool lock.\n");
+			exit(0);
+		}
+	}
+}
+
+/* Address of the header of slot index in class c */
+static pool_hdr_t* slot(struct pool_class* c, uint32_t index)
+{
+	return (pool_hdr_t*)(c->slabs[index / POOL_SLAB_COUNT] +
+		                 (index % POOL_SLAB_COUNT) * c->stride);
+}
+
+/* Pushes a buffer on the global stack of its class */
+static void global_push(struct pool_class* c, pool_hdr_t* h)
+{
+	uint64_t old = atomic_load_explicit(&c->head, memory_order_relaxed);
+	uint64_t new;
+
+	do
+	{
+		atomic_store_explicit(&h->next, (uint32_t)old, memory_order_relaxed);
+		new = (((old >> 32) + 1) << 32) | (h->index + 1);
+	} while(!atomic_compare_exchange_weak_explicit(&c->head, &old, new,
+		     memory_order_release, memory_order_relaxed));
+}
+
+/* Pops a buffer off the global stack, NULL if empty */
+static pool_hdr_t* global_pop(struct pool_class* c)
+{
+	uint64_t old = atomic_load_explicit(&c->head, memory_order_acquire);
+	uint64_t new;
+	pool_hdr_t* h;
+
+	do
+	{
+		if ((uint32_t)old == 0)
+			return NULL;
+		/* Slots are never unmapped, so reading a stale next is
+		   harmless: the tag makes the exchange fail */
+		h = slot(c, (uint32_t)old - 1);
+		new = (((old >> 32) + 1) << 32) |
+		      atomic_load_explicit(&h->next, memory_order_relaxed);
+	} while(!atomic_compare_exchange_weak_explicit(&c->head, &old, new,
+		     memory_order_acquire, memory_order_acquire));
+	return h;
+}
+
+/*
+ * adopt: takes over a freelist parked in the depot of class c as
+ * the calling thread's own. Returns 1 if there was one.
+ */
+static int adopt(struct pool_class* c, int cls)
+{
+	int n;
+
+	if (atomic_load_explicit(&c->ndepot, memory_order_relaxed) == 0)
+		return 0;
+
+	pthread_mutex_lock(&c->depot_lock);
+	n = atomic_load_explicit(&c->ndepot, memory_order_relaxed);
+	if (n > 0)
+	{
+		n--;
+		memcpy(local[cls], c->depot[n], 
+			   c->depot_len[n] * sizeof(pool_hdr_t*));
+		nlocal[cls] = c->depot_len[n];
+		atomic_store_explicit(&c->ndepot, n, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&c->depot_lock);
+	if (nlocal[cls] > 0)
+		atomic_fetch_add_explicit(&c->adopted, 1, memory_order_relaxed);
+	return nlocal[cls] > 0;
+}
+
+/*
+ * grow: carves a new slab for class c. Returns one buffer and
+ * hands the rest to the calling thread and the global stack.
+ */
+static pool_hdr_t* grow(struct pool_class* c, int cls)
+{
+	pool_hdr_t* h;
+	int n, i;
+
+	pthread_mutex_lock(&c->grow_lock);
+
+	/* Someone else may have refilled the stack meanwhile */
+	if ((h = global_pop(c)) != NULL)
+	{
+		pthread_mutex_unlock(&c->grow_lock);
+		return h;
+	}
+
+	n = atomic_load(&c->nslabs);
+	if (n == POOL_MAX_SLABS)
+	{
+		pthread_mutex_unlock(&c->grow_lock);
+		return NULL;
+	}
+
+	c->slabs[n] = Malloc(POOL_SLAB_COUNT * c->stride);
+	for(i = 0; i < POOL_SLAB_COUNT; i++)
+	{
+		h = (pool_hdr_t*)(c->slabs[n] + i * c->stride);
+		h->index = n * POOL_SLAB_COUNT + i;
+		h->cls = cls;
+		atomic_init(&h->next, 0);
+	}
+	atomic_store(&c->nslabs, n + 1);
+	atomic_fetch_add_explicit(&c->grows, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&c->grow_lock);
+
+	/* Keep a few for this thread, publish the rest */
+	for(i = 1; i < POOL_SLAB_COUNT; i++)
+	{
+		h = slot(c, n * POOL_SLAB_COUNT + i);
+		if (nlocal[cls] < POOL_LOCAL_MAX / 2)
+			local[cls][nlocal[cls]++] = h;
+		else
+			global_push(c, h);
+	}
+	return slot(c, n * POOL_SLAB_COUNT);
+}
+
+/*
+ * pool_alloc: returns a buffer of at least size bytes. Requests
+ * larger than the largest class fall back to Malloc.
+ */
+void* pool_alloc(size_t size)
+{
+	struct pool_class* c;
+	pool_hdr_t* h;
+	int64_t used, high;
+	int cls;
+
+	for(cls = 0; cls < POOL_NCLASSES; cls++)
+		if (size <= classes[cls].size)
+			break;
+
+	/* Too large for any class */
+	if (cls == POOL_NCLASSES)
+	{
+		atomic_fetch_add_explicit(&oversize, 1, memory_order_relaxed);
+		h = Malloc(HDR_SIZE + size);
+		h->cls = POOL_NCLASSES;
+		return h + 1;
+	}
+
+	c = &classes[cls];
+	atomic_fetch_add_explicit(&c->requests, 1, memory_order_relaxed);
+
+	if (nlocal[cls] > 0 || adopt(c, cls))
+	{
+		h = local[cls][--nlocal[cls]];
+		atomic_fetch_add_explicit(&c->local_hits, 1, memory_order_relaxed);
+	}
+	else if ((h = global_pop(c)) != NULL)
+		atomic_fetch_add_explicit(&c->global_hits, 1, memory_order_relaxed);
+	else if ((h = grow(c, cls)) == NULL)
+	{
+		/* Class is exhausted */
+		atomic_fetch_add_explicit(&oversize, 1, memory_order_relaxed);
+		h = Malloc(HDR_SIZE + size);
+		h->cls = POOL_NCLASSES;
+		return h + 1;
+	}
+
+	/* Track the high-water mark */
+	used = atomic_fetch_add_explicit(&c->in_use, 1, memory_order_relaxed) + 1;
+	high = atomic_load_explicit(&c->high_water, memory_order_relaxed);
+	while(used > high && !atomic_compare_exchange_weak_explicit(
+		  &c->high_water, &high, used, memory_order_relaxed,
+		  memory_order_relaxed))
+		;
+	return h + 1;
+}
+
+/* pool_free: returns a buffer from pool_alloc to its class */
+void pool_free(void* buf)
+{
+	pool_hdr_t* h;
+	struct pool_class* c;
+	int cls;
+
+	if (buf == NULL)
+		return;
+
+	h = (pool_hdr_t*)buf - 1;
+	cls = h->cls;
+	if (cls == POOL_NCLASSES)
+	{
+		Free(h);
+		return;
+	}
+
+	c = &classes[cls];
+	atomic_fetch_sub_explicit(&c->in_use, 1, memory_order_relaxed);
+
+	/* Spill half of the local list when it is full */
+	if (nlocal[cls] == POOL_LOCAL_MAX)
+	{
+		while(nlocal[cls] > POOL_LOCAL_MAX / 2)
+			global_push(c, local[cls][--nlocal[cls]]);
+	}
+	local[cls][nlocal[cls]++] = h;
+}
+
+/*
+ * pool_thread_release: hands every buffer cached by the calling
+ * thread back, parked in the depot as a whole if there is room and
+ * to the global stacks if not. Called when a thread exits, or now
+ * and then by a background thread that mostly frees.
+ */
+void pool_thread_release()
+{
+	struct pool_class* c;
+	int cls, n;
+
+	for(cls = 0; cls < POOL_NCLASSES; cls++)
+	{
+		c = &classes[cls];
+		if (nlocal[cls] == 0)
+			continue;
+
+		pthread_mutex_lock(&c->depot_lock);
+		n = atomic_load_explicit(&c->ndepot, memory_order_relaxed);
+		if (n < POOL_DEPOT_MAX)
+		{
+			memcpy(c->depot[n], local[cls], 
+				   nlocal[cls] * sizeof(pool_hdr_t*));
+			c->depot_len[n] = nlocal[cls];
+			nlocal[cls] = 0;
+			atomic_store_explicit(&c->ndepot, n + 1, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&c->depot_lock);
+
+		while(nlocal[cls] > 0)
+			global_push(c, local[cls][--nlocal[cls]]);
+	}
+}
+
+/* pool_report: writes pool statistics into out, returns length */
+size_t pool_report(char* out, size_t len)
+{
+	size_t n = 0;
+	int cls;
+
+	for(cls = 0; cls < POOL_NCLASSES && n < len; cls++)
+	{
+		struct pool_class* c = &classes[cls];
+		uint64_t req = atomic_load(&c->requests);
+		uint64_t hits = atomic_load(&c->local_hits) +
+		                atomic_load(&c->global_hits);
+
+		n += snprintf(out + n, len - n,
+			"pool.%zu: requests=%lu hit_rate=%.2f%% local=%lu "
+			"global=%lu adopted=%lu slabs=%d in_use=%ld "
+			"high_water=%ld\r\n",
+			c->size, (unsigned long)req,
+			req ? 100.0 * hits / req : 100.0,
+			(unsigned long)atomic_load(&c->local_hits),
+			(unsigned long)atomic_load(&c->global_hits),
+			(unsigned long)atomic_load(&c->adopted),
+			atomic_load(&c->nslabs), (long)atomic_load(&c->in_use),
+			(long)atomic_load(&c->high_water));
+	}
+	if (n < len)
+		n += snprintf(out + n, len - n, "pool.oversize: %lu\r\n",
+			          (unsigned long)atomic_load(&oversize));
+	return n < len ? n : len;
+}
+
+/* pool_footprint: bytes pool_alloc really hands out for size */
+size_t pool_footprint(size_t size)
+{
+	int cls;
+
+	for(cls = 0; cls < POOL_NCLASSES; cls++)
+		if (size <= classes[cls].size)
+			return classes[cls].size;
+	return size;
+}
+
+/* Initializes an empty chain */
+void bufchain_init(bufchain_t* bc)
+{
+	bc->head = NULL;
+	bc->tail = NULL;
+	bc->len = 0;
+	bc->footprint = 0;
+}
+
+/* Adds an empty chunk with room for cap bytes to the chain */
+static chunk_t* add_chunk(bufchain_t* bc, size_t cap)
+{
+	size_t size = offsetof(chunk_t, data) + cap;
+	chunk_t* c = pool_alloc(size);
+
+	c->next = NULL;
+	c->len = 0;
+	c->cap = cap;
+	if (bc->tail == NULL)
+		bc->head = c;
+	else
+		bc->tail->next = c;
+	bc->tail = c;
+	bc->footprint += pool_footprint(size);
+	return c;
+}
+
+/* bufchain_append: copies n bytes to the end of the chain */
+void bufchain_append(bufchain_t* bc, const void* data, size_t n)
+{
+	const char* src = data;
+
+	while(n > 0)
+	{
+		size_t room, cnt;
+		char* dst = bufchain_reserve(bc, &room);
+
+		cnt = n < room ? n : room;
+		memcpy(dst, src, cnt);
+		bufchain_commit(bc, cnt);
+		src += cnt;
+		n -= cnt;
+	}
+}
+
+/*
+ * bufchain_reserve: returns the free space at the end of the chain,
+ * starting a new chunk when the tail is full, and sets room to its
+ * size. Data written there becomes part of the chain once committed,
+ * so a stream can be read straight into its chunks.
+ */
+char* bufchain_reserve(bufchain_t* bc, size_t* room)
+{
+	chunk_t* c = bc->tail;
+
+	if (c == NULL || c->len == c->cap)
+		c = add_chunk(bc, CHUNK_DATA_SIZE);
+	*room = c->cap - c->len;
+	return c->data + c->len;
+}
+
+/* bufchain_commit: appends n bytes written to the reserved space */
+void bufchain_commit(bufchain_t* bc, size_t n)
+{
+	bc->tail->len += n;
+	bc->len += n;
+}
+
+/*
+ * bufchain_trim: moves a partly filled tail chunk into the smallest
+ * buffer that holds it, or drops it if it is empty, so a finished
+ * stream does not keep unused chunk space. Short streams end up in
+ * a single small buffer.
+ */
+void bufchain_trim(bufchain_t* bc)
+{
+	chunk_t* old = bc->tail;
+	chunk_t* prev;
+	chunk_t* c;
+	size_t size;
+
+	if (old == NULL)
+		return;
+	size = offsetof(chunk_t, data) + old->len;
+	if (old->len > 0 && pool_footprint(size) >= 
+		pool_footprint(offsetof(chunk_t, data) + old->cap))
+		return;
+
+	/* Unlink the tail */
+	for(prev = bc->head; prev != old && prev->next != old; prev = prev->next)
+		;
+	if (prev == old)
+		bc->head = bc->tail = NULL;
+	else
+	{
+		prev->next = NULL;
+		bc->tail = prev;
+	}
+	bc->footprint -= pool_footprint(offsetof(chunk_t, data) + old->cap);
+
+	/* Copy it over to a smaller buffer */
+	if (old->len > 0)
+	{
+		c = add_chunk(bc, pool_footprint(size) - offsetof(chunk_t, data));
+		memcpy(c->data, old->data, old->len);
+		c->len = old->len;
+	}
+	pool_free(old);
+}
+
+/* bufchain_release: returns every chunk of the chain to the pool */
+void bufchain_release(bufchain_t* bc)
+{
+	chunk_t* c = bc->head;
+
+	while(c != NULL)
+	{
+		chunk_t* next = c->next;
+		pool_free(c);
+		c = next;
+	}
+	bufchain_init(bc);
+}
+
+/* bufchain_write: writes the whole chain to fd, -1 on error */
+ssize_t bufchain_write(int fd, bufchain_t* bc)
+{
+	return bufchain_writev(fd, bc, NULL);
+}
+
+/*
+ * bufchain_writev: writes one chain and then another (which may be
+ * NULL) to fd, gathering up to BUFCHAIN_IOV chunks per system call.
+ * Returns the bytes written or -1 on error.
+ */
+ssize_t bufchain_writev(int fd, bufchain_t* first, bufchain_t* second)
+{
+	struct iovec iov[BUFCHAIN_IOV];
+	chunk_t* c = first->head;
+	size_t off = 0;
+	ssize_t total = 0;
+
+	while(1)
+	{
+		bufchain_t* next;
+		chunk_t* p;
+		ssize_t n;
+		int cnt = 0;
+
+		/* Move on to the second chain when the first is done */
+		if (c == NULL && second != NULL)
+		{
+			c = second->head;
+			second = NULL;
+			continue;
+		}
+		if (c == NULL)
+			return total;
+
+		/* Gather from the current position */
+		iov[cnt].iov_base = c->data + off;
+		iov[cnt++].iov_len = c->len - off;
+		next = second;
+		for(p = c->next; cnt < BUFCHAIN_IOV; p = p->next)
+		{
+			if (p == NULL && next != NULL)
+			{
+				p = next->head;
+				next = NULL;
+			}
+			if (p == NULL)
+				break;
+			iov[cnt].iov_base = p->data;
+			iov[cnt++].iov_len = p->len;
+		}
+
+		if ((n = writev(fd, iov, cnt)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += n;
+
+		/* Skip what was written, which may end inside a chunk */
+		n += off;
+		while(c != NULL && n >= (ssize_t)c->len)
+		{
+			n -= c->len;
+			c = c->next;
+			if (c == NULL && second != NULL)
+			{
+				c = second->head;
+				second = NULL;
+			}
+		}
+		off = n;
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * bufpool.h - Pooled, recycled fixed-size buffers shared across
+ *             connections. Every size class has a small per-thread
+ *             freelist in front of a lock-free global freelist, so
+ *             the steady-state request path never calls the allocator.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "csapp.h"
+
+/* Size classes (usable bytes per buffer) */
+#define POOL_SMALL_SIZE  256
+#define POOL_MEDIUM_SIZE 2048
+#define POOL_LARGE_SIZE  8192
+#define POOL_NCLASSES    3
+
+/* Buffers carved out of one slab, and max slabs per class */
+#define POOL_SLAB_COUNT  128
+#define POOL_MAX_SLABS   256
+
+/* Max buffers a thread keeps for itself per class */
+#define POOL_LOCAL_MAX   32
+
+/* Freelists of exited threads parked per class for new threads */
+#define POOL_DEPOT_MAX   16
+
+/* Header in front of every pooled buffer */
+typedef struct pool_hdr
+{
+	uint32_t index;            /* slot within its class */
+	uint32_t cls;              /* size class, POOL_NCLASSES if malloc'd */
+	_Atomic uint32_t next;     /* freelist link (index+1, 0 ends list) */
+	uint32_t pad;
+} pool_hdr_t;
+
+/* One link in a chain of pooled buffers holding a byte stream */
+typedef struct chunk
+{
+	struct chunk* next;
+	uint32_t len;
+	uint32_t cap;        /* bytes data can hold */
+	char data[];
+} chunk_t;
+
+#define CHUNK_DATA_SIZE (POOL_LARGE_SIZE - offsetof(chunk_t, data))
+
+/* Max chunks handed to one writev */
+#define BUFCHAIN_IOV 64
+
+/* A byte stream stored as a chain of pooled chunks */
+typedef struct bufchain
+{
+	chunk_t* head;
+	chunk_t* tail;
+	size_t len;
+	size_t footprint;    /* pool bytes held by the chunks */
+} bufchain_t;
+
+void pool_init();
+void* pool_alloc(size_t size);
+void pool_free(void* buf);
+size_t pool_footprint(size_t size);
+void pool_thread_release();
+size_t pool_report(char* out, size_t len);
+
+void bufchain_init(bufchain_t* bc);
+void bufchain_append(bufchain_t* bc, const void* data, size_t n);
+char* bufchain_reserve(bufchain_t* bc, size_t* room);
+void bufchain_commit(bufchain_t* bc, size_t n);
+void bufchain_trim(bufchain_t* bc);
+void bufchain_release(bufchain_t* bc);
+ssize_t bufchain_write(int fd, bufchain_t* bc);
+ssize_t bufchain_writev(int fd, bufchain_t* first, bufchain_t* second);
+
+#endif /* __BUFPOOL_H__ */
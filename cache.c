@@ -1,6 +1,15 @@
 /*
  * cache - A simple linked-list implementation of a cache
- *         It is threadsafe.
+ *         with a hash index over canonical keys and a
+ *         pluggable eviction policy. It is threadsafe.
+ *
+ *         Writers take the write lock. Lookups take no lock: they
+ *         walk the hash index inside an epoch (see epoch.h) and pin
+ *         what they find, and removed blocks are released only once
+ *         no reader can still be on them. A lookup writes only lines
+ *         of its own slot: what the policy, the frequency sketch and
+ *         the hosts learn from it is held back there and applied by
+ *         the next writer.
  *
  * Sunny Nahar
  * anahar
@@ -13,231 +22,1241 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "cache.h"
+#include "tinylfu.h"
+#include "policy.h"
+#include "quota.h"
+#include "disk.h"
+#include "dedup.h"
+#include "vary.h"
+#include "epoch.h"
+#include "hot.h"
+
+/* A shard of the cache: its own index, lock, policy lists, hosts,
+   share of the capacity and reclaimer. Keys are spread over the 
+   shards by hash; with per-core serving each CPU owns one */
+typedef struct cache
+{
+	/* A read write lock to protect the shard */
+	pthread_rwlock_t lock;
+	int id;
+	long capacity;            /* its share of cache_capacity */
+	long total_size;
+	int num;
+	policy_state_t* policy;   /* lists of the eviction policy */
+	quota_t* hosts;           /* host partitions */
+
+	/* Statistics, under the write lock */
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t rejections;      /* refused by admission */
+	uint64_t sync_evictions;
+
+	/* Background reclaimer: watermarks in bytes, 0 while it is off */
+	long reclaim_low;
+	long reclaim_high;
+	int reclaim_wanted;
+	pthread_mutex_t reclaim_lock;
+	pthread_cond_t reclaim_cond;
+	uint64_t reclaim_runs;
+	uint64_t reclaim_evictions; /* under the write lock only */
+
+	/* Hash index: chains of blocks linked through hnext, changed 
+	   under the write lock and walked by readers with no lock */
+	_Atomic(cb_t*) buckets[CACHE_BUCKETS];
+} cache_t;
+
+/* The shards; one unless set before init_cache */
+cache_t** shards;
+int num_shards = 1;
+
+/* Limits, changed only before init_cache */
+long cache_capacity = MAX_CACHE_SIZE;
+long max_object_size = MAX_OBJECT_SIZE;
+
+/* Eviction policy, LRU unless set before init_cache */
+policy_t* policy = &lru_policy;
+
+/* Readers walk the index without the read lock unless turned off */
+int lockfree_reads = 1;
+
+/* Admission policy, one of ADMIT_* */
+int admission = ADMIT_TINYLFU;
 
-/* cache */
-int total_size;
-int num;
-int pc;
+/* Lookup statistics, a cache line per epoch slot so that a hit
+   writes nothing other threads read; readers without a slot share
+   the last one. Per-host misses are held back in the slot and 
+   passed on in batches */
+typedef struct reader_stats
+{
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+	_Atomic uint64_t saved_us;  /* fetch time saved by hits */
+	host_t* host;               /* host the held back misses are for */
+	uint32_t host_misses;
+	_Atomic uint32_t tail;      /* samples the slot ever recorded */
+	uint32_t head_seen;         /* samples last seen drained */
+	uint32_t dropped;           /* samples lost to a full ring */
+	char pad[64 - 3 * sizeof(uint64_t) - sizeof(host_t*) - 
+	         4 * sizeof(uint32_t)];
+} reader_stats_t;
+reader_stats_t reader_stats[EPOCH_MAX_READERS + 1];
+
+/* Misses a slot holds back at most */
+#define READER_BATCH 64
+
+/* Lookups a slot holds back for the sketch and the policy (a power
+   of two); they are drained by one thread at a time */
+#define READER_SAMPLES 128
 
-cb_t* end;
+/* A lookup held back: its key, and the block it hit if any */
+typedef struct sample
+{
+	uint64_t hash;
+	cb_t* cb;           /* NULL on a miss */
+	uint32_t n;         /* hits it stands for */
+} sample_t;
+
+/* The samples of a slot: filled by the slot's owner alone and 
+   emptied by whoever holds the write lock, so a hit writes no 
+   shared line; the head sits on a line of its own */
+typedef struct sample_ring
+{
+	_Atomic uint32_t head;      /* samples ever drained */
+	char pad[64 - sizeof(uint32_t)];
+	sample_t s[READER_SAMPLES];
+} sample_ring_t;
+sample_ring_t sample_rings[EPOCH_MAX_READERS] __attribute__((aligned(64)));
+pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* A read write lock to protect the cache */
-pthread_rwlock_t cache_lock;
+/* Blocks taken out under the write lock, moved to the limbo after
+   it is dropped; linked through rnext */
+_Atomic(cb_t*) graveyard;
+
+/* Removed blocks, oldest first, waiting for the readers that may
+   still be on them */
+cb_t* limbo_head;
+cb_t* limbo_tail;
+pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Watermarks of the reclaimer in percent of a shard's capacity */
+int reclaim_low_pct = RECLAIM_LOW_PCT;
+int reclaim_high_pct = RECLAIM_HIGH_PCT;
+
+/* Blocks released after removal */
+_Atomic uint64_t deferred_frees;
 
 /* Initializes default variables of the cache */
 void init_cache()
 {
-	/* Init cache var */
-	total_size = 0;
-	num = 0;
-	end = NULL;
-	pc = 0;
-	
-	/* Init rwlock */
-	if (pthread_rwlock_init(&cache_lock, NULL))
+	int i;
+
+	tlfu_init();
+
+	/* Every shard gets an even share of the capacity */
+	shards = Malloc(num_shards * sizeof(cache_t*));
+	for (i = 0; i < num_shards; i++)
 	{
-	    printf("Failed to initialize rw lock.\n");
-	    exit(0);
+		cache_t* c = Calloc(1, sizeof(cache_t));
+
+		c->id = i;
+		c->capacity = cache_capacity / num_shards;
+		c->policy = policy_new(policy, c->capacity);
+		c->hosts = quota_new(i, num_shards);
+		pthread_mutex_init(&c->reclaim_lock, NULL);
+		pthread_cond_init(&c->reclaim_cond, NULL);
+	
+		/* Init rwlock */
+		if (pthread_rwlock_init(&c->lock, NULL))
+		{
+		    printf("Failed to initialize rw lock.\n");
+		    exit(0);
+		}
+		shards[i] = c;
 	}
 }
 
+/* 
+ * set_cache_shards: splits the cache into n shards, before 
+ * init_cache. Returns -1 unless 0 < n.
+ */
+int set_cache_shards(int n)
+{
+	if (n <= 0)
+		return -1;
+	num_shards = n;
+	return 0;
+}
+
+/* 
+ * cache_shard_of: the shard keys with this hash are kept in; with 
+ * per-core serving, also the CPU that owns them
+ */
+int cache_shard_of(uint64_t hash)
+{
+	return (uint32_t)(hash >> 32) % num_shards;
+}
+
+/* The shard of keys with this hash */
+static cache_t* shard(uint64_t hash)
+{
+	return shards[cache_shard_of(hash)];
+}
+
 /* Free cache block */
 void free_cb(cb_t* cb)
 {
-	/* Free inside pointers */
-	Free(cb->hostname);
-	Free(cb->uri);
-	Free(cb->data);
+	/* Return the header chunks and drop the shared body */
+	bufchain_release(&cb->hdr);
+	body_release(cb->body);
 
-	/* Free pointer itself */
-	Free(cb);
+	/* The keys live in the same pool buffer as the block */
+	pool_free(cb);
+}
+
+/* Drops a reference; the block is freed with the last one */
+static void unref_cb(cb_t* cb)
+{
+	if (atomic_fetch_sub(&cb->refcnt, 1) == 1)
+		free_cb(cb);
+}
+
+/* 
+ * release_cb: unpins a block found by find, drops a reference taken
+ * by cache_collect, or gives back a block lent by the thread's hot
+ * cache. The block is freed once none of them hold it and it is
+ * out of the cache.
+ */
+void release_cb(cb_t* cb)
+{
+	if (hot_return(cb) || epoch_unpin(cb))
+		return;
+	unref_cb(cb);
 }
 
 /* Get total_size of cache */
-int get_total_size()
+long get_total_size()
 {
-	return total_size;
+	long total = 0;
+	int i;
+
+	for (i = 0; i < num_shards; i++)
+		total += shards[i]->total_size;
+	return total;
 }
 
-/* Get cache lock */
-pthread_rwlock_t* get_cache_lock()
+/* 
+ * set_cache_limits: sets the cache capacity and the largest body
+ * that is cached, in bytes, before init_cache
+ */
+void set_cache_limits(long cache_size, long object_size)
 {
-	return &cache_lock;
+	cache_capacity = cache_size;
+	max_object_size = object_size;
+}
+
+/* Get the largest body that is cached */
+long get_max_object_size()
+{
+	return max_object_size;
 }
 
 /* 
- * remove_LRU: Removes the most recently used element 
- * in accordance with the access counter pc 
+ * parse_bytes: parses a byte count with an optional K, M or G
+ * suffix, leaving end behind it
  */
-void remove_LRU()
+long parse_bytes(const char* s, char** end)
 {
-	/* Check empty cache */
-	if(end == NULL) 
-		return;
+	long n = strtol(s, end, 10);
 
-	/* Find min use_index */
-	cb_t* curr = end;
-	cb_t* min_p = curr;
-	uint32_t min = curr->use_index;
-	curr = curr->next;
-	
-	/* Iterate through the linked list 
-	   By construction, no pointers should be 
-	   NULL */
-	while(curr != end)
+	switch (**end)
+	{
+	case 'K': case 'k': n <<= 10; (*end)++; break;
+	case 'M': case 'm': n <<= 20; (*end)++; break;
+	case 'G': case 'g': n <<= 30; (*end)++; break;
+	}
+	return n;
+}
+
+/* 
+ * remove_cb: unlinks a block from its shard c, telling the policy
+ * whether it was evicted. Must be called with the write lock of c
+ * held.
+ */
+static void remove_cb(cache_t* c, cb_t* cb, int evicted)
+{
+	/* Unlink from its bucket; its own hnext stays, so a reader on
+	   it still gets to the end of the chain */
+	_Atomic(cb_t*)* pp = &c->buckets[cb->hash & (CACHE_BUCKETS - 1)];
+	while(*pp != cb)
+		pp = &(*pp)->hnext;
+	atomic_store_explicit(pp, cb->hnext, memory_order_release);
+
+	/* Marked before hot caches are checked for it, while hot_offer
+	   marks it held before checking this; one of them sees the 
+	   other, so no hot cache keeps it unnoticed */
+	atomic_store(&cb->dead, 1);
+	if (atomic_load(&cb->hot))
+		hot_removed();
+
+	/* Update size and num; a body still used by other blocks
+	   stays charged to the shard */
+	c->total_size -= cb->size;
+	if (--cb->body->users > 0)
+		c->total_size += cb->body->data.footprint;
+	c->num--;
+	quota_detach(cb);
+
+	/* Take it off the policy's lists */
+	policy->on_remove(c->policy, cb, evicted);
+
+	/* The cache's reference is dropped once the lock is released,
+	   so freeing its chunks stays out of the critical section */
+	cb->rnext = atomic_load(&graveyard);
+	while(!atomic_compare_exchange_weak(&graveyard, &cb->rnext, cb))
+		;
+}
+
+/* Whether p is among the n pins */
+static int pinned(void** pins, int n, void* p)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (pins[i] == p)
+			return 1;
+	return 0;
+}
+
+/* 
+ * reap: moves the blocks removed so far to the limbo, and drops the
+ * cache's reference to those no reader can reach or has pinned any
+ * more. Called after releasing the write lock; readers may still 
+ * hold references of their own.
+ */
+static void reap()
+{
+	static void* pins[EPOCH_MAX_READERS * EPOCH_PINS];
+	cb_t* cb = atomic_exchange(&graveyard, NULL);
+	cb_t* ready = NULL;
+	cb_t* held = NULL;
+	cb_t* held_last = NULL;
+	uint64_t oldest;
+	int npins;
+
+	pthread_mutex_lock(&limbo_lock);
+	if (cb != NULL)
+	{
+		/* They were unlinked before now */
+		uint64_t now = epoch_now();
+		while (cb != NULL)
+		{
+			cb_t* next = cb->rnext;
+			cb->retired = now;
+			cb->rnext = NULL;
+			if (limbo_tail != NULL)
+				limbo_tail->rnext = cb;
+			else
+				limbo_head = cb;
+			limbo_tail = cb;
+			cb = next;
+		}
+	}
+	if (limbo_head != NULL)
 	{
-		/* Still safeguard */
-		if(curr != NULL && curr->use_index < min)
+		/* Pins are read after the epochs, so none is missed; the
+		   pinned blocks stay at the front, in order */
+		oldest = epoch_quiesce();
+		npins = epoch_pins(pins);
+		while (limbo_head != NULL && limbo_head->retired < oldest)
+		{
+			cb = limbo_head;
+			limbo_head = cb->rnext;
+			if (pinned(pins, npins, cb))
+			{
+				cb->rnext = NULL;
+				if (held_last != NULL)
+					held_last->rnext = cb;
+				else
+					held = cb;
+				held_last = cb;
+				continue;
+			}
+			cb->rnext = ready;
+			ready = cb;
+		}
+		if (held != NULL)
 		{
-			/* Set minimum */
-			min_p = curr;
-			min = curr->use_index;
+			held_last->rnext = limbo_head;
+			if (limbo_head == NULL)
+				limbo_tail = held_last;
+			limbo_head = held;
 		}
-		curr = curr->next;
+		else if (limbo_head == NULL)
+			limbo_tail = NULL;
 	}
+	pthread_mutex_unlock(&limbo_lock);
 
-	/* Update size and num */
-	total_size -= min_p->size;
-	num--;
+	while (ready != NULL)
+	{
+		cb = ready->rnext;
+		unref_cb(ready);
+		atomic_fetch_add_explicit(&deferred_frees, 1, memory_order_relaxed);
+		ready = cb;
+	}
+}
+
+/* 
+ * apply_sample: lets the sketch see a lookup of hash and, if it hit
+ * cb n times, the policy and cb's host
+ */
+static void apply_sample(uint64_t hash, cb_t* cb, uint32_t n)
+{
+	if (admission == ADMIT_TINYLFU)
+		tlfu_touch(hash);
+	if (cb == NULL)
+		return;
+	policy->on_hit(cb);
+	atomic_fetch_add_explicit(&cb->host->hits, n, memory_order_relaxed);
+}
+
+/* Whether cb is in the hash index, walked like a reader does */
+static int indexed(uint64_t hash, cb_t* cb)
+{
+	cb_t* curr = atomic_load_explicit(
+		&shard(hash)->buckets[hash & (CACHE_BUCKETS - 1)], 
+		memory_order_acquire);
 
-	/* update pointers: this is fine since it is
-	   circularly linked, so no edge cases */
-	min_p->prev->next = min_p->next;
-	min_p->next->prev = min_p->prev;
+	while (curr != NULL && curr != cb)
+		curr = atomic_load_explicit(&curr->hnext, memory_order_acquire);
+	return curr != NULL;
+}
+
+/* 
+ * drain_samples: applies the samples every slot held back, unless 
+ * another thread is at it; one thread at a time empties the rings. 
+ * It runs in an epoch, so a hit on a block still indexed can be 
+ * applied while the block may be removed; one that left the index
+ * already is left out, as the block may be gone.
+ */
+static void drain_samples()
+{
+	uint32_t count = 0;
+	int i, slot, slots = epoch_slots();
+
+	if (pthread_mutex_trylock(&drain_lock))
+		return;
+	if ((slot = epoch_enter()) < 0)
+	{
+		pthread_mutex_unlock(&drain_lock);
+		return;
+	}
+	for (i = 0; i < slots; i++)
+	{
+		sample_ring_t* r = &sample_rings[i];
+		uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		uint32_t tail = atomic_load_explicit(&reader_stats[i].tail, 
+			                                 memory_order_acquire);
 
-	/* Free pointer */
-	free_cb(min_p);
+		if (head == tail)
+			continue;
+		for (; head != tail; head++)
+		{
+			sample_t* sp = &r->s[head & (READER_SAMPLES - 1)];
+			apply_sample(sp->hash, 
+				         sp->cb != NULL && indexed(sp->hash, sp->cb) ? 
+				         sp->cb : NULL, sp->n);
+			count++;
+		}
+		atomic_store_explicit(&r->head, head, memory_order_release);
+	}
+	epoch_exit(slot);
+	if (count > 0 && admission == ADMIT_TINYLFU)
+		tlfu_count(count);
+	pthread_mutex_unlock(&drain_lock);
 }
 
 /* 
- * update: updates the use_index of a cache_block
- * which is used in determining LRU
+ * evict_cb: evicts a block from shard c, handing it to the disk 
+ * tier if there is one. Must be called with the write lock of c
+ * held.
  */
-void update(cb_t* cb)
+static void evict_cb(cache_t* c, cb_t* cb)
 {
-	/* This is purposefully left thread-unsafe 
-	   to allow multireads */
-	/* The downside is that LRU is not exact, but
-	   approximate. */
-	cb->use_index = pc++;
+	c->evictions++;
+	disk_offer(cb);
+	remove_cb(c, cb, 1);
 }
 
 /* 
- * add_elem: Add element to the cache 
+ * shrink_to: evicts until shard c holds at most target bytes, or
+ * max blocks have gone if max is not -1, sparing reservations of
+ * hosts other than host as make_room says. Returns the number of
+ * blocks evicted. Must be called with the write lock of c held.
  */
-void add_elem(char *hostname, char *uri, char *data)
+static int shrink_to(cache_t* c, host_t* host, long target, int max)
 {
-	int size = 0;
+	int spared = 0, n = 0;
 
-	/* Lock while writing to cache */
-	if (pthread_rwlock_wrlock(&cache_lock))
+	while(c->total_size > target && c->num > 0 && n != max)
 	{
-	    printf("Failed to get a write lock.\n");
-	    exit(0);
+		cb_t* victim = policy->choose_victim(c->policy);
+		host_t* vh = victim->host;
+
+		if(vh != host && vh->bytes - (long)victim->size < vh->reserve &&
+		   spared++ < QUOTA_SPARE_TRIES)
+			policy->on_hit(victim);
+		else
+		{
+			evict_cb(c, victim);
+			n++;
+		}
 	}
+	return n;
+}
+
+/* 
+ * make_room: evicts until size more bytes fit, first within the
+ * quota of host and then in the whole shard c. Victims that would
+ * cut into another host's reservation are passed to the policy as
+ * hits a few times, so it offers something else; after that the
+ * reservation gives way. Must be called with the write lock of c
+ * held.
+ */
+static void make_room(cache_t* c, host_t* host, long size)
+{
+	while(host->quota > 0 && host->bytes + size > host->quota)
+	{
+		host->evictions++;
+		evict_cb(c, host->oldest);
+	}
+
+	c->sync_evictions += shrink_to(c, host, c->capacity - size - 1, -1);
+}
+
+/* Checks whether two blocks vary on the same request headers */
+static int same_vary(cb_t* a, cb_t* b)
+{
+	if (a->vary == NULL || b->vary == NULL)
+		return a->vary == b->vary;
+	return strcmp(a->vary, b->vary) == 0;
+}
 
-	/* Allocate new cache block */
-	cb_t *cb = Malloc(sizeof(cb_t));
+/* 
+ * add_elem: Add element to the cache. cost is what it took to
+ * fetch the object upstream, for cost-aware policies; raw_len is
+ * the body length before compression if data is gzipped. If
+ * key->vary is set this is the key->variant variant of the key.
+ */
+void add_elem(cache_key_t *key, bufchain_t *hdr, bufchain_t *data,
+	          time_t expires, uint32_t cost, uint32_t raw_len)
+{
+	long size = 0;
+	size_t klen = key->len + 1;
+	size_t hlen = strlen(key->host) + 1;
+	size_t vlen = key->vary != NULL ? strlen(key->vary) + 1 : 0;
+	cache_t* c = shard(key->hash);
+
+	/* Allocate new cache block with room for the key
+	   right behind it, outside of the lock */
+	cb_t *cb = pool_alloc(sizeof(cb_t) + klen + hlen + vlen);
+	size += pool_footprint(sizeof(cb_t) + klen + hlen + vlen);
 
-	/* Allocate space for data */
 	/* The plus one is for null character */
-	size += strlen(hostname)+1;
-	char* hn = Malloc(strlen(hostname)+1);
-	strcpy(hn, hostname);
-	
-	size += strlen(uri)+1;
-	char* u = Malloc(strlen(uri)+1);
-	strcpy(u, uri);
+	char* k = (char*)(cb + 1);
+	memcpy(k, key->str, klen);
+	char* hn = k + klen;
+	strcpy(hn, key->host);
+	cb->vary = NULL;
+	if (vlen > 0)
+	{
+		cb->vary = hn + hlen;
+		memcpy(cb->vary, key->vary, vlen);
+	}
 
-	size += strlen(data)+1;
-	char* d = Malloc(strlen(data)+1);
-	strcpy(d, data);
+	/* Take over the header and data chunks without copying; the 
+	   budget is charged for every pool byte they hold, so partly 
+	   filled tails are shrunk first. A body whose bytes are cached
+	   already under another key is shared instead of kept twice */
+	bufchain_trim(hdr);
+	bufchain_trim(data);
+	cb->hdr = *hdr;
+	bufchain_init(hdr);
+	cb->body = body_intern(data, c->id);
+	cb->data = cb->body->data;
+	size += cb->hdr.footprint + cb->data.footprint;
 
 	/* Update params */
+	cb->key = k;
+	cb->hash = key->hash;
 	cb->hostname = hn;
-	cb->uri = u;
-	cb->data = d;
+	cb->variant = key->variant;
+	cb->expires = expires;
+	cb->cost = cost;
+	cb->raw_len = raw_len;
+	atomic_init(&cb->dead, 0);
+	atomic_init(&cb->hot, 0);
+	atomic_init(&cb->refcnt, 1);
 
-	/* Make space in cache */
-	while(total_size + size >= MAX_CACHE_SIZE)
-		remove_LRU();
+	/* Lock the key's shard while writing to it */
+	if (pthread_rwlock_wrlock(&c->lock))
+	{
+	    printf("Failed to get a write lock.\n");
+	    exit(0);
+	}
 
-	/* If first elem then */
-	if(num == 0)
-	{	
-		cb->prev = cb;
-		cb->next = cb;
+	/* Let the policy and the sketch catch up on lookups first */
+	drain_samples();
+
+	/* Find the host's partition */
+	host_t* host = quota_host(c->hosts, cb->hostname, 1);
+
+	/* Replace any older copy of the same variant, and all copies
+	   that vary on other headers; variants of a key sit in its
+	   bucket newest first, so the last one left is the oldest */
+	cb_t* old = c->buckets[cb->hash & (CACHE_BUCKETS - 1)];
+	cb_t* oldest = NULL;
+	int variants = 0;
+	while(old != NULL)
+	{
+		cb_t* next = old->hnext;
+		if(old->hash == cb->hash && strcmp(old->key, cb->key) == 0)
+		{
+			if(!same_vary(old, cb) || old->variant == cb->variant)
+				remove_cb(c, old, 0);
+			else
+			{
+				variants++;
+				oldest = old;
+			}
+		}
+		old = next;
 	}
-	else
+	if(variants >= VARY_MAX_VARIANTS)
+		remove_cb(c, oldest, 0);
+
+	/* Only bytes not cached already need room */
+	long charge = size;
+	if(cb->body->users > 0)
+		charge -= cb->data.footprint;
+
+	/* An object larger than the shard or its host's quota never 
+	   fits, and a newcomer that needs room must be more popular than what it 
+	   would push out; with the reclaimer running, room is needed
+	   past the high watermark */
+	int reject = 0;
+	if(size >= c->capacity)
+	{
+		c->rejections++;
+		reject = 1;
+	}
+	else if(host->quota > 0 && size > host->quota)
 	{
-		/* Otherwise add to end of LL */
-		cb->prev = end;
-		cb->next = end->next;
-		end->next = cb;
+		host->rejections++;
+		reject = 1;
+	}
+	else if(c->total_size + charge >= 
+		    (c->reclaim_high > 0 ? c->reclaim_high : c->capacity) && 
+		    admission == ADMIT_TINYLFU)
+	{
+		cb_t* victim = policy->choose_victim(c->policy);
+		if(victim != NULL && !tlfu_admit(cb->hash, victim->hash))
+		{
+			c->rejections++;
+			reject = 1;
+		}
+	}
+	if(reject)
+	{
+		if (pthread_rwlock_unlock(&c->lock))
+		{
+		    printf("Failed to unlock a write lock.\n");
+		    exit(0);
+		}
+		reap();
+		free_cb(cb);
+		return;
 	}
 
-	/* Update cache params */
-	end = cb;
-	num++;
+	/* Make space in cache; eviction may drop the body's other
+	   users, and then it has to be charged after all */
+	make_room(c, host, charge);
+	if(cb->body->users == 0 && charge < size)
+	{
+		charge = size;
+		make_room(c, host, charge);
+	}
+
+	/* Update cache params and hand it to the policy */
+	c->num++;
 	cb->size = size;
-	cb->use_index = pc++;
-	total_size += size;
+	c->total_size += charge;
+	cb->body->users++;
+	quota_attach(host, cb);
+	policy->on_insert(c->policy, cb);
+	c->inserts++;
+
+	/* Add to the hash index last; the release store makes all of
+	   the block visible to readers that find it */
+	_Atomic(cb_t*)* bucket = &c->buckets[cb->hash & (CACHE_BUCKETS - 1)];
+	atomic_store_explicit(&cb->hnext, 
+		                  atomic_load_explicit(bucket, memory_order_relaxed),
+		                  memory_order_relaxed);
+	atomic_store_explicit(bucket, cb, memory_order_release);
+
+	/* Past the high watermark the reclaimer makes room for the
+	   next inserts */
+	int wake = c->reclaim_high > 0 && c->total_size > c->reclaim_high;
 
 	/* Unlock cache */
-	if (pthread_rwlock_unlock(&cache_lock))
+	if (pthread_rwlock_unlock(&c->lock))
 	{
 	    printf("Failed tounlock a write lock.\n");
 	    exit(0);
 	}
+	reap();
+	if (wake)
+	{
+		pthread_mutex_lock(&c->reclaim_lock);
+		c->reclaim_wanted = 1;
+		pthread_cond_signal(&c->reclaim_cond);
+		pthread_mutex_unlock(&c->reclaim_lock);
+	}
 }
 
 /* 
- * find: finds a specific hostname,uri pair in the cache 
- *       and returns a pointer to that cache block, or
- *       NULL otherwise
+ * read_begin: starts a walk of the hash index of shard c. Returns 
+ * the epoch slot of the calling thread, or -1 if it took the read 
+ * lock of c instead, for read_end.
  */
-cb_t* find(char* hostname, char* uri)
+static int read_begin(cache_t* c)
 {
-	/* Create read lock */
-  	if (pthread_rwlock_rdlock(&cache_lock))
+	int slot = lockfree_reads ? epoch_enter() : -1;
+
+	if (slot < 0 && pthread_rwlock_rdlock(&c->lock))
 	{
 	    printf("Failed to get a  read lock.\n");
 	    exit(0);
 	}
+	return slot;
+}
+
+/* read_end: ends a walk of c started by read_begin */
+static void read_end(cache_t* c, int slot)
+{
+	if (slot >= 0)
+		epoch_exit(slot);
+	else if (pthread_rwlock_unlock(&c->lock))
+	{
+	    printf("Failed to unlock a  read lock.\n");
+	    exit(0);
+	}
+}
+
+/* 
+ * bump: adds n to a lookup counter of slot. Counters of a slot are 
+ * only written by its owner, so a plain add does; the shared ones 
+ * need an atomic one.
+ */
+static void bump(int slot, _Atomic uint64_t* c, uint64_t n)
+{
+	if (slot < 0)
+		atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+	else
+		atomic_store_explicit(c, n + 
+			atomic_load_explicit(c, memory_order_relaxed), 
+			memory_order_relaxed);
+}
 
-	/* Empty cache */
-	if(end == NULL) 
+/* 
+ * count_miss: counts a miss of slot on host h. A slot holds them 
+ * back while its lookups stay on one host, up to READER_BATCH of 
+ * them, so they do not write the host's shared counter each.
+ */
+static void count_miss(int slot, host_t* h)
+{
+	reader_stats_t* st;
+
+	if (slot < 0)
 	{
-	    if (pthread_rwlock_unlock(&cache_lock))
-	    {
-			printf("Failed to unlock a  read lock.\n");
-			exit(0);
-	    }
-	    return NULL;
+		atomic_fetch_add_explicit(&h->misses, 1, memory_order_relaxed);
+		return;
 	}
+	st = &reader_stats[slot];
+	if (st->host != h || st->host_misses >= READER_BATCH)
+	{
+		if (st->host != NULL)
+			atomic_fetch_add_explicit(&st->host->misses, st->host_misses, 
+				                      memory_order_relaxed);
+		st->host = h;
+		st->host_misses = 0;
+	}
+	st->host_misses++;
+}
+
+/* 
+ * count_sample: records a lookup of hash that hit cb n times, or
+ * missed if cb is NULL, for the sketch and the policy. A slot holds
+ * them back in its ring; once the ring is full it drains all of
+ * them unless another thread is at it, and drops the sample if 
+ * that leaves no room.
+ */
+static void count_sample(int slot, uint64_t hash, cb_t* cb, uint32_t n)
+{
+	reader_stats_t* st;
+	sample_t* sp;
+	uint32_t tail;
+
+	if (slot < 0)
+	{
+		apply_sample(hash, cb, n);
+		if (admission == ADMIT_TINYLFU)
+			tlfu_count(1);
+		return;
+	}
+	st = &reader_stats[slot];
+	tail = atomic_load_explicit(&st->tail, memory_order_relaxed);
+	if (tail - st->head_seen == READER_SAMPLES)
+	{
+		drain_samples();
+		st->head_seen = atomic_load_explicit(&sample_rings[slot].head, 
+			                                 memory_order_acquire);
+		if (tail - st->head_seen == READER_SAMPLES)
+		{
+			st->dropped++;
+			return;
+		}
+	}
+	sp = &sample_rings[slot].s[tail & (READER_SAMPLES - 1)];
+	sp->hash = hash;
+	sp->cb = cb;
+	sp->n = n;
+	atomic_store_explicit(&st->tail, tail + 1, memory_order_release);
+}
+
+/* 
+ * count_hits: counts n hits on a pinned block in the counters of
+ * slot, and holds them back for the policy
+ */
+static void count_hits(int slot, cb_t* cb, uint32_t n)
+{
+	reader_stats_t* st = &reader_stats[slot < 0 ? EPOCH_MAX_READERS : slot];
+
+	bump(slot, &st->hits, n);
+	bump(slot, &st->saved_us, (uint64_t)cb->cost * n);
+	count_sample(slot, cb->hash, cb, n);
+}
+
+/* 
+ * find: finds a key in the cache through the hash index 
+ *       and returns a pointer to that cache block, or
+ *       NULL otherwise. Stale blocks are skipped, and so are
+ *       variants the request's headers do not select. The caller
+ *       must release_cb a returned block when done with it.
+ */
+cb_t* find(cache_key_t* key)
+{
+	time_t now = time(NULL);
+	cache_t* c = shard(key->hash);
+	cb_t* curr;
+	int slot;
 
-	/* Check first elem of cache */
-	cb_t* curr = end;
-	if(strcmp(hostname, curr->hostname) == 0 && strcmp(uri, curr->uri)==0)
+	/* The thread's hot cache answers without touching shared
+	   state; its hits are passed on in batches */
+	if ((curr = hot_find(key, now)) != NULL)
 		return curr;
 
-	/* Check rest of cache 
-	   All pointers should be non-NULL */
-	curr = curr -> next;
+	/* Walk the bucket; the full hash filters out nearly all 
+	   string compares. Pin the block before leaving, so it 
+	   outlives an eviction while in use: in the epoch slot, or
+	   with a reference if the slot has no room or there is none */
+	slot = read_begin(c);
+	for(curr = atomic_load_explicit(
+		           &c->buckets[key->hash & (CACHE_BUCKETS - 1)],
+		           memory_order_acquire); 
+		curr != NULL;
+		curr = atomic_load_explicit(&curr->hnext, memory_order_acquire))
+	{
+		if(curr->hash == key->hash && strcmp(curr->key, key->str) == 0 &&
+		   (curr->expires == 0 || curr->expires > now) &&
+		   (curr->vary == NULL || key->headers == NULL ||
+		    vary_match(curr->vary, curr->variant, key->headers)))
+			break;
+	}
+	if (curr != NULL && (slot < 0 || epoch_pin(slot, curr) < 0))
+		atomic_fetch_add(&curr->refcnt, 1);
+	read_end(c, slot);
+
+	/* Every lookup feeds the frequency sketch, a hit the policy too;
+	   both are held back in the slot */
+	if (curr != NULL)
+	{
+		count_hits(slot, curr, 1);
+		hot_offer(curr);
+	}
+	else
+	{
+		host_t* h = quota_host(c->hosts, key->host, 0);
+		bump(slot, &reader_stats[slot < 0 ? EPOCH_MAX_READERS : slot].misses,
+			 1);
+		if (h != NULL)
+			count_miss(slot, h);
+		if (admission == ADMIT_TINYLFU)
+			count_sample(slot, key->hash, NULL, 0);
+	}
+	return curr;
+}
+
+/* 
+ * cache_touch: passes on n hits on a pinned block that were served
+ * without asking the cache, e.g. by a thread's hot cache, through 
+ * the calling thread's slot
+ */
+void cache_touch(cb_t* cb, uint32_t n)
+{
+	count_hits(lockfree_reads ? epoch_slot() : -1, cb, n);
+}
+
+/* 
+ * cache_contains: returns 1 if a fresh copy of key is cached. Unlike
+ * find it leaves the policy and all statistics alone, so checking
+ * does not make an object look popular.
+ */
+int cache_contains(cache_key_t* key)
+{
+	time_t now = time(NULL);
+	cb_t* curr;
+	cache_t* c = shard(key->hash);
+	int slot = read_begin(c);
+
+	for(curr = atomic_load_explicit(
+		           &c->buckets[key->hash & (CACHE_BUCKETS - 1)],
+		           memory_order_acquire); 
+		curr != NULL;
+		curr = atomic_load_explicit(&curr->hnext, memory_order_acquire))
+	{
+		if(curr->hash == key->hash && strcmp(curr->key, key->str) == 0 &&
+		   (curr->expires == 0 || curr->expires > now) &&
+		   (curr->vary == NULL || key->headers == NULL ||
+		    vary_variant(curr->vary, key->headers) == curr->variant))
+			break;
+	}
+	read_end(c, slot);
+	return curr != NULL;
+}
+
+/* 
+ * cache_collect: pins every cached block and returns them in a
+ * Malloc'd array through blocks. The caller must release_cb each
+ * one and Free the array. Returns the number of blocks.
+ */
+int cache_collect(cb_t*** blocks)
+{
+	cb_t* curr;
+	int i, j, n = 0;
 
-	/* Still safeguard */
-	while(curr != NULL && curr != end)
+	*blocks = NULL;
+	for (j = 0; j < num_shards; j++)
 	{
-		if(strcmp(hostname, curr->hostname) == 0 && strcmp(uri, curr->uri)==0)
-			return curr;
-		curr = curr->next;
+		cache_t* c = shards[j];
+
+		if (pthread_rwlock_rdlock(&c->lock))
+		{
+		    printf("Failed to get a  read lock.\n");
+		    exit(0);
+		}
+		*blocks = Realloc(*blocks, (n + c->num + 1) * sizeof(cb_t*));
+		for(i = 0; i < CACHE_BUCKETS; i++)
+			for(curr = c->buckets[i]; curr != NULL; curr = curr->hnext)
+			{
+				atomic_fetch_add(&curr->refcnt, 1);
+				(*blocks)[n++] = curr;
+			}
+		if (pthread_rwlock_unlock(&c->lock))
+		{
+		    printf("Failed to unlock a  read lock.\n");
+		    exit(0);
+		}
+	}
+	return n;
+}
+
+/* 
+ * clear_cache: drops every block without evicting it anywhere,
+ * e.g. at shutdown
+ */
+void clear_cache()
+{
+	cb_t* victim;
+	int i;
+
+	for (i = 0; i < num_shards; i++)
+	{
+		cache_t* c = shards[i];
+
+		if (pthread_rwlock_wrlock(&c->lock))
+		{
+		    printf("Failed to get a write lock.\n");
+		    exit(0);
+		}
+		while((victim = policy->choose_victim(c->policy)) != NULL)
+			remove_cb(c, victim, 0);
+		if (pthread_rwlock_unlock(&c->lock))
+		{
+		    printf("Failed to unlock a write lock.\n");
+		    exit(0);
+		}
+		reap();
+	}
+}
+
+/* 
+ * remove_elem: removes every block stored under a key,
+ * e.g. after a request that changed it at the origin
+ */
+void remove_elem(cache_key_t* key)
+{
+	cache_t* c = shard(key->hash);
+	cb_t* curr;
+	cb_t* next;
+
+	/* Lock the key's shard while writing to it */
+	if (pthread_rwlock_wrlock(&c->lock))
+	{
+	    printf("Failed to get a write lock.\n");
+	    exit(0);
+	}
+
+	for(curr = c->buckets[key->hash & (CACHE_BUCKETS - 1)]; curr != NULL;
+		curr = next)
+	{
+		next = curr->hnext;
+		if(curr->hash == key->hash && strcmp(curr->key, key->str) == 0)
+			remove_cb(c, curr, 0);
 	}
 
 	/* Unlock cache */
-	if (pthread_rwlock_unlock(&cache_lock))
+	if (pthread_rwlock_unlock(&c->lock))
 	{
-	    printf("Failed to unlock a  read lock.\n");
+	    printf("Failed to unlock a write lock.\n");
 	    exit(0);
 	}
+	reap();
+
+	/* The disk tier must not serve it either */
+	disk_remove(key);
+}
+
+/* 
+ * reclaimer: evicts from the high watermark of its shard down to 
+ * the low one whenever an insert crosses it, in batches so readers
+ * and inserts get the lock in between. Victims are freed between
+ * batches, with no lock held.
+ */
+static void* reclaimer(void* vargp)
+{
+	cache_t* c = vargp;
+
+	Pthread_detach(pthread_self());
+
+	while (1)
+	{
+		int more;
+
+		pthread_mutex_lock(&c->reclaim_lock);
+		while (!c->reclaim_wanted)
+			pthread_cond_wait(&c->reclaim_cond, &c->reclaim_lock);
+		c->reclaim_wanted = 0;
+		pthread_mutex_unlock(&c->reclaim_lock);
+
+		do
+		{
+			if (pthread_rwlock_wrlock(&c->lock))
+			{
+			    printf("Failed to get a write lock.\n");
+			    exit(0);
+			}
+			drain_samples();
+			c->reclaim_evictions += shrink_to(c, NULL, c->reclaim_low, 
+				                              RECLAIM_BATCH);
+			more = c->total_size > c->reclaim_low && c->num > 0;
+			if (!more)
+				c->reclaim_runs++;
+			if (pthread_rwlock_unlock(&c->lock))
+			{
+			    printf("Failed to unlock a write lock.\n");
+			    exit(0);
+			}
+			reap();
+		} while (more);
+		pool_thread_release();
+	}
 	return NULL;
-}
\ No newline at end of file
+}
+
+/* 
+ * set_reclaim: sets the watermarks of the reclaimers in percent of
+ * a shard's capacity, before start_reclaimer. Returns -1 unless
+ * 0 < low < high < 100.
+ */
+int set_reclaim(int low_pct, int high_pct)
+{
+	if (low_pct <= 0 || high_pct >= 100 || low_pct >= high_pct)
+		return -1;
+	reclaim_low_pct = low_pct;
+	reclaim_high_pct = high_pct;
+	return 0;
+}
+
+/* 
+ * start_reclaimer: starts keeping every shard between its 
+ * watermarks in the background, a reclaimer each, after 
+ * init_cache. Without it every insert makes its own room.
+ */
+void start_reclaimer()
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < num_shards; i++)
+	{
+		cache_t* c = shards[i];
+
+		c->reclaim_low = c->capacity / 100 * reclaim_low_pct;
+		c->reclaim_high = c->capacity / 100 * reclaim_high_pct;
+		Pthread_create(&tid, NULL, reclaimer, c);
+	}
+}
+
+/* 
+ * set_lockfree_reads: turns lookups without the read lock on or
+ * off, e.g. to compare the two
+ */
+void set_lockfree_reads(int on)
+{
+	lockfree_reads = on;
+}
+
+/* Selects the admission policy */
+void set_admission(int policy)
+{
+	admission = policy;
+}
+
+/* 
+ * set_eviction: selects the eviction policy by name before
+ * init_cache. Returns -1 if there is no such policy.
+ */
+int set_eviction(const char* name)
+{
+	policy_t* p = find_policy(name);
+
+	if (p == NULL)
+		return -1;
+	policy = p;
+	return 0;
+}
+
+/* cache_report: writes cache statistics into out, returns length */
+size_t cache_report(char* out, size_t len)
+{
+	uint64_t h = 0, m = 0, saved = 0, dropped = 0;
+	uint64_t inserts = 0, evictions = 0, rejections = 0;
+	uint64_t runs = 0, reclaimed = 0, sync_evictions = 0;
+	long total = 0, low = 0, high = 0;
+	int objects = 0;
+	size_t n;
+	int i;
+
+	/* Each shard is read under its lock; the sums are as consistent
+	   as the shards are with each other */
+	for (i = 0; i < num_shards; i++)
+	{
+		cache_t* c = shards[i];
+
+		if (pthread_rwlock_rdlock(&c->lock))
+		{
+		    printf("Failed to get a  read lock.\n");
+		    exit(0);
+		}
+		objects += c->num;
+		total += c->total_size;
+		inserts += c->inserts;
+		evictions += c->evictions;
+		rejections += c->rejections;
+		low += c->reclaim_low;
+		high += c->reclaim_high;
+		runs += c->reclaim_runs;
+		reclaimed += c->reclaim_evictions;
+		sync_evictions += c->sync_evictions;
+		if (pthread_rwlock_unlock(&c->lock))
+		{
+		    printf("Failed to unlock a  read lock.\n");
+		    exit(0);
+		}
+	}
+	for (i = 0; i <= EPOCH_MAX_READERS; i++)
+	{
+		h += atomic_load_explicit(&reader_stats[i].hits, 
+			                      memory_order_relaxed);
+		m += atomic_load_explicit(&reader_stats[i].misses, 
+			                      memory_order_relaxed);
+		saved += atomic_load_explicit(&reader_stats[i].saved_us, 
+			                          memory_order_relaxed);
+		dropped += reader_stats[i].dropped;
+	}
+	n = snprintf(out, len,
+		"cache: objects=%d bytes=%ld capacity=%ld shards=%d hits=%lu "
+		"misses=%lu hit_rate=%.2f%% inserts=%lu evictions=%lu "
+		"fetch_saved_ms=%lu\r\n"
+		"admission: policy=%s rejected=%lu dropped_samples=%lu\r\n",
+		objects, total, cache_capacity, num_shards, (unsigned long)h, 
+		(unsigned long)m,
+		h + m ? 100.0 * h / (h + m) : 0.0, (unsigned long)inserts,
+		(unsigned long)evictions, 
+		(unsigned long)(saved / 1000),
+		admission == ADMIT_TINYLFU ? "tinylfu" : "all",
+		(unsigned long)rejections, (unsigned long)dropped);
+	if (n < len && high > 0)
+		n += snprintf(out + n, len - n, 
+			"reclaim: low=%ld high=%ld runs=%lu evictions=%lu "
+			"sync_evictions=%lu deferred_frees=%lu\r\n",
+			low, high, (unsigned long)runs,
+			(unsigned long)reclaimed, (unsigned long)sync_evictions,
+			(unsigned long)atomic_load(&deferred_frees));
+	if (n < len)
+		n += policy_report(policy, h, m, inserts, evictions, out + n, 
+			               len - n);
+	if (n < len)
+		n += dedup_report(out + n, len - n);
+	if (n < len)
+		n += vary_report(out + n, len - n);
+	return n < len ? n : len;
+}
+
+/* 
+ * cache_host_report: writes a line per host of every shard into 
+ * out, returns length
+ */
+size_t cache_host_report(char* out, size_t len)
+{
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < num_shards && n < len; i++)
+	{
+		cache_t* c = shards[i];
+
+		if (pthread_rwlock_rdlock(&c->lock))
+		{
+		    printf("Failed to get a  read lock.\n");
+		    exit(0);
+		}
+		n += quota_report(c->hosts, out + n, len - n);
+		if (pthread_rwlock_unlock(&c->lock))
+		{
+		    printf("Failed to unlock a  read lock.\n");
+		    exit(0);
+		}
+	}
+	return n;
+}
@@ -1,6 +1,12 @@
 /*
  * cache.h - A simple linked-list implementation of a cache
- *           It is threadsafe.
+ *           with a hash index over canonical keys and a
+ *           pluggable eviction policy. It is threadsafe;
+ *           lookups take no lock. The cache can be split into
+ *           shards by key hash, each with its own index, lock,
+ *           policy lists, hosts, share of the capacity and
+ *           reclaimer, so that per-core serving gives every CPU
+ *           a cache of its own.
  *
  * Sunny Nahar
  * anahar
@@ -8,33 +14,98 @@
  * Amrith Deepak
  * amrithd
  */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "csapp.h"
+#include "bufpool.h"
+#include "cachekey.h"
 
-/* Recommended max cache and object sizes */
+/* Default max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Largest object size allowed; a block's size, with the overhead of
+   its chunks, has to fit the 32-bit size field */
+#define OBJECT_SIZE_LIMIT ((1L << 32) - (1L << 26))
+
+/* Admission policies */
+#define ADMIT_ALL     0  /* admit every cacheable response */
+#define ADMIT_TINYLFU 1  /* admit only if more popular than the victim */
+
+/* Buckets of the hash index of a shard (a power of two) */
+#define CACHE_BUCKETS 16384
+
+/* Default watermarks of the reclaimers, in percent of a shard's
+   capacity, and the most blocks one evicts per hold of the write
+   lock */
+#define RECLAIM_LOW_PCT  85
+#define RECLAIM_HIGH_PCT 95
+#define RECLAIM_BATCH    32
+
 /* cache block struct */
 typedef struct cache_block
 {
-	uint32_t use_index;
-	uint32_t size;
-	char* hostname;
-	char* uri;
-	char* data;
-	struct cache_block* prev;
+	uint32_t size;      /* pool bytes held, key and chunks included;
+	                       a shared body counts in full */
+	uint32_t cost;      /* upstream fetch time in microseconds */
+	uint32_t raw_len;   /* body length before gzip, 0 if stored as is */
+	uint8_t list;       /* policy list the block is on */
+	_Atomic uint8_t dead; /* removed from the cache */
+	_Atomic uint8_t freq; /* access count kept by the policy */
+	_Atomic uint8_t hot;  /* held by a thread's hot cache */
+	uint8_t counted;    /* hits the policy has acted on */
+	int heap_index;     /* slot in a policy heap */
+	double priority;    /* key of a policy heap */
+	_Atomic int refcnt; /* one for the cache, one per reader */
+	time_t expires;     /* end of freshness, 0 if none given */
+	uint64_t hash;      /* hash of key */
+	char* key;          /* canonical key, interned */
+	char* hostname;     /* lowercased host, interned */
+	char* vary;         /* Vary names, interned; NULL if it does not
+	                       vary */
+	uint64_t variant;   /* which variant of key it is */
+	bufchain_t hdr;     /* status line and headers */
+	bufchain_t data;    /* body, a view of the shared one */
+	struct body* body;  /* shared body holding the data chunks */
+	struct cache_block* prev;  /* policy list links */
 	struct cache_block* next;
+	_Atomic(struct cache_block*) hnext; /* next in hash bucket, kept
+	                                       for readers once removed */
+	struct cache_block* rnext; /* next removed block awaiting release */
+	uint64_t retired;   /* epoch it was removed in */
+	struct host_entry* host;   /* partition it is charged to */
+	struct cache_block* host_prev; /* host's blocks, oldest first */
+	struct cache_block* host_next;
 } cb_t;
 
 void init_cache();
+int set_cache_shards(int n);
+int cache_shard_of(uint64_t hash);
 void free_cb(cb_t* cb);
-int get_total_size();
-pthread_rwlock_t* get_cache_lock();
-void remove_LRU();
-void update(cb_t* cb);
-void add_elem(char *hostname, char *uri, char *data);
-cb_t* find(char* hostname, char* uri);
\ No newline at end of file
+long get_total_size();
+void set_cache_limits(long cache_size, long object_size);
+long get_max_object_size();
+long parse_bytes(const char* s, char** end);
+void add_elem(cache_key_t *key, bufchain_t *hdr, bufchain_t *data,
+	          time_t expires, uint32_t cost, uint32_t raw_len);
+cb_t* find(cache_key_t* key);
+void cache_touch(cb_t* cb, uint32_t n);
+int cache_contains(cache_key_t* key);
+void remove_elem(cache_key_t* key);
+int cache_collect(cb_t*** blocks);
+void clear_cache();
+void release_cb(cb_t* cb);
+void set_admission(int policy);
+void set_lockfree_reads(int on);
+int set_reclaim(int low_pct, int high_pct);
+void start_reclaimer();
+int set_eviction(const char* name);
+size_t cache_report(char* out, size_t len);
+size_t cache_host_report(char* out, size_t len);
+
+#endif /* __CACHE_H__ */
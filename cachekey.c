@@ -0,0 +1,248 @@
+/*
+ * cachekey - Canonical cache keys. Equivalent URLs map to the same
+ *            key: the host is lowercased, the default port is
+ *            dropped, percent-escapes of unreserved characters are
+ *            decoded (the rest are uppercased), dot segments are
+ *            removed, and configured query parameters are stripped
+ *            and the remaining ones optionally sorted.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "cachekey.h"
+
+#define DEFAULT_HTTP_PORT 80
+
+/* Query parameters dropped from keys, set once at startup */
+static char strip_params[MAX_STRIP_PARAMS][MAXLINE];
+static int num_strip;
+static int sort_query;
+
+/* Adds a query parameter to strip from keys, -1 if the list is full */
+int cachekey_strip_param(const char* name)
+{
+	if (num_strip == MAX_STRIP_PARAMS)
+		return -1;
+	snprintf(strip_params[num_strip++], MAXLINE, "%s", name);
+	return 0;
+}
+
+/* Turns sorting of query parameters on or off */
+void cachekey_sort_query(int on)
+{
+	sort_query = on;
+}
+
+/* FNV-1a, 64 bit */
+uint64_t hash_bytes(const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len-- > 0)
+	{
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Value of a hex digit, -1 if it is not one */
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Unreserved characters never need escaping (RFC 3986) */
+static int unreserved(int c)
+{
+	return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * normalize_escapes: copies n bytes of src to dst, decoding escaped
+ * unreserved characters and uppercasing the hex of the others.
+ * Returns the number of bytes written.
+ */
+static size_t normalize_escapes(char* dst, const char* src, size_t n)
+{
+	size_t i = 0, o = 0;
+
+	while (i < n)
+	{
+		int hi, lo;
+		if (src[i] == '%' && i + 2 < n &&
+			(hi = hexval(src[i + 1])) >= 0 &&
+			(lo = hexval(src[i + 2])) >= 0)
+		{
+			int c = hi * 16 + lo;
+			if (unreserved(c))
+				dst[o++] = c;
+			else
+				o += sprintf(dst + o, "%%%02X", c);
+			i += 3;
+		}
+		else
+			dst[o++] = src[i++];
+	}
+	dst[o] = 0;
+	return o;
+}
+
+/*
+ * remove_dot_segments: resolves "." and ".." segments of path in
+ * place, following RFC 3986 section 5.2.4
+ */
+static void remove_dot_segments(char* path)
+{
+	char out[MAXLINE];
+	char* in = path;
+	size_t o = 0;
+
+	while (*in)
+	{
+		if (strncmp(in, "../", 3) == 0)
+			in += 3;
+		else if (strncmp(in, "./", 2) == 0)
+			in += 2;
+		else if (strncmp(in, "/./", 3) == 0)
+			in += 2;
+		else if (strcmp(in, "/.") == 0)
+			in[1] = 0;
+		else if (strncmp(in, "/../", 4) == 0 || strcmp(in, "/..") == 0)
+		{
+			/* Drop the last output segment */
+			in += 3;
+			if (*in == 0)
+				*--in = '/';
+			while (o > 0 && out[o - 1] != '/')
+				o--;
+			if (o > 0)
+				o--;
+		}
+		else if (strcmp(in, ".") == 0 || strcmp(in, "..") == 0)
+			break;
+		else
+		{
+			/* Move the first segment over */
+			do
+				out[o++] = *in++;
+			while (*in && *in != '/');
+		}
+	}
+	out[o] = 0;
+	strcpy(path, o ? out : "/");
+}
+
+/* Checks whether a query parameter is on the strip list */
+static int stripped(const char* param)
+{
+	size_t len = strcspn(param, "=");
+	int i;
+
+	for (i = 0; i < num_strip; i++)
+		if (strlen(strip_params[i]) == len &&
+			strncmp(param, strip_params[i], len) == 0)
+			return 1;
+	return 0;
+}
+
+/* Orders query parameters for sorting */
+static int param_cmp(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * normalize_query: rewrites the query q in place, dropping stripped
+ * parameters and sorting the remainder if configured
+ */
+static void normalize_query(char* q)
+{
+	char* params[MAXLINE / 2];
+	char out[MAXLINE];
+	int n = 0, i;
+	size_t o = 0;
+	char* save;
+	char* p;
+
+	for (p = strtok_r(q, "&", &save); p != NULL;
+		 p = strtok_r(NULL, "&", &save))
+		if (!stripped(p))
+			params[n++] = p;
+
+	if (sort_query)
+		qsort(params, n, sizeof(char*), param_cmp);
+
+	out[0] = 0;
+	for (i = 0; i < n; i++)
+		o += sprintf(out + o, "%s%s", i ? "&" : "", params[i]);
+	strcpy(q, out);
+}
+
+/*
+ * make_cache_key: builds the canonical key of a request for path
+ * on host:port. Returns -1 if the key does not fit.
+ */
+int make_cache_key(cache_key_t* key, const char* scheme, const char* host,
+	               int port, const char* path)
+{
+	char p[MAXLINE];
+	char q[MAXLINE];
+	size_t plen, i;
+	const char* query;
+	int n;
+
+	/* Lowercased host, without a trailing dot */
+	for (i = 0; host[i] && i < MAXLINE - 1; i++)
+		key->host[i] = tolower((unsigned char)host[i]);
+	if (i > 0 && key->host[i - 1] == '.')
+		i--;
+	key->host[i] = 0;
+
+	/* Path and query, without any fragment */
+	plen = strcspn(path, "?#");
+	query = path[plen] == '?' ? path + plen + 1 : NULL;
+	normalize_escapes(p, path, plen);
+	if (p[0] != '/')
+	{
+		memmove(p + 1, p, strlen(p) + 1);
+		p[0] = '/';
+	}
+	remove_dot_segments(p);
+
+	q[0] = 0;
+	if (query != NULL)
+	{
+		normalize_escapes(q, query, strcspn(query, "#"));
+		normalize_query(q);
+	}
+
+	/* Put it together, eliding the default port */
+	if (port == DEFAULT_HTTP_PORT)
+		n = snprintf(key->str, MAXLINE, "%s://%s%s%s%s", scheme,
+			         key->host, p, q[0] ? "?" : "", q);
+	else
+		n = snprintf(key->str, MAXLINE, "%s://%s:%d%s%s%s", scheme,
+			         key->host, port, p, q[0] ? "?" : "", q);
+	if (n < 0 || n >= MAXLINE)
+		return -1;
+
+	key->len = n;
+	key->hash = hash_bytes(key->str, key->len);
+	key->headers = NULL;
+	key->vary = NULL;
+	key->variant = 0;
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * cachekey.h - Canonical cache keys. A key covers the scheme, the
+ *              lowercased host, the port (elided when it is the
+ *              default) and a normalized path and query, and is
+ *              hashed once when it is built.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Max query parameters that can be configured for stripping */
+#define MAX_STRIP_PARAMS 32
+
+/* A canonical cache key */
+typedef struct cache_key
+{
+	char str[MAXLINE];   /* scheme://host[:port]/path[?query] */
+	size_t len;          /* length of str */
+	char host[MAXLINE];  /* lowercased host name */
+	uint64_t hash;       /* hash of str */
+	const char* headers; /* request header lines sent upstream, to
+	                        pick a variant; NULL if unknown */
+	const char* vary;    /* Vary names of a response being added,
+	                        NULL if it does not vary */
+	uint64_t variant;    /* its variant, see vary.h */
+} cache_key_t;
+
+int make_cache_key(cache_key_t* key, const char* scheme, const char* host,
+	               int port, const char* path);
+uint64_t hash_bytes(const void* data, size_t len);
+int cachekey_strip_param(const char* name);
+void cachekey_sort_query(int on);
+
+#endif /* __CACHEKEY_H__ */
@@ -0,0 +1,277 @@
+/*
+ * cachesim - Replays a synthetic request trace against the cache
+ *            and prints its hit rates, so cache policies can be
+ *            compared without a network. Popular objects follow a
+ *            Zipf distribution; a share of the requests go to
+ *            one-off URLs, like a crawler would send. Objects come
+ *            from origins of differing latency, so the share of
+ *            fetch time saved is reported too. A share of the
+ *            objects can carry the same bytes as another object,
+ *            as versioned or tracking URLs do.
+ *
+ *            With -b, the warmed cache is then read by 1, 2, 4 and
+ *            up to the given number of threads at once, and the
+ *            lookup throughput of each run is printed, to see how
+ *            hits scale with cores; -L makes lookups take the read
+ *            lock, to compare. -S splits the cache into shards, as
+ *            per-core serving does, to see what that costs in hits.
+ *
+ *            usage: cachesim [-n requests] [-k objects] [-z alpha]
+ *                            [-s one-off share] [-A tinylfu|all]
+ *                            [-e lru|slru|arc|s3fifo|gdsf]
+ *                            [-d duplicate share] [-b threads] [-L]
+ *                            [-S shards]
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "cache.h"
+#include "epoch.h"
+
+/* Lookups made by each thread of a benchmark run */
+#define BENCH_LOOKUPS 100000
+
+/* Bytes of every simulated response header */
+static const char* sim_hdr = "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n";
+
+/* Random state for xorshift64 */
+static uint64_t rng = 88172645463325252ULL;
+
+/* A benchmark thread */
+typedef struct bench
+{
+	pthread_t tid;
+	uint64_t rng;     /* its own random state */
+	double* cdf;      /* popularity of the objects */
+	long objects;
+	long hits;
+} bench_t;
+
+/* Next pseudo random number from state s */
+static uint64_t next_rand(uint64_t* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* Uniform double in [0, 1) */
+static double next_unit(uint64_t* s)
+{
+	return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Body size of object id: 1 to 32 KB, smaller ones more common */
+static size_t object_size(long id)
+{
+	uint64_t h = hash_bytes(&id, sizeof(id));
+	return 1024 << (h % 6) >> (h >> 8) % 2;
+}
+
+/* Fetch time of object id in microseconds: its origin takes 1 to
+   256 ms, plus 10 us per KB */
+static uint32_t object_cost(long id)
+{
+	uint64_t h = hash_bytes(&id, sizeof(id));
+	return (1000 << (h >> 16) % 9) + object_size(id) / 100;
+}
+
+/* Object whose bytes id carries: itself, or for a share dup of the
+   objects one of the 64 most popular */
+static long body_of(long id, double dup)
+{
+	uint64_t h = hash_bytes(&id, sizeof(id));
+	return (h >> 24) % 10000 < dup * 10000 ? (long)(h % 64) : id;
+}
+
+/* Picks a rank from the Zipf CDF by binary search */
+static long zipf_pick(double* cdf, long k, uint64_t* s)
+{
+	double u = next_unit(s);
+	long lo = 0, hi = k - 1;
+
+	while (lo < hi)
+	{
+		long mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* A benchmark thread: looks up popular objects, inserting nothing */
+static void* bench_thread(void* vargp)
+{
+	bench_t* b = vargp;
+	char path[MAXLINE];
+	cache_key_t key;
+	cb_t* cb;
+	long i;
+
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+	{
+		sprintf(path, "/obj/%ld", zipf_pick(b->cdf, b->objects, &b->rng));
+		make_cache_key(&key, "http", "sim", 80, path);
+		if ((cb = find(&key)) != NULL)
+		{
+			b->hits++;
+			release_cb(cb);
+		}
+	}
+	epoch_thread_release();
+	return NULL;
+}
+
+/* 
+ * bench: reads the cache from 1, 2, 4 and so on up to max threads
+ * at once and prints the lookup rate of each run
+ */
+static void bench(double* cdf, long objects, int max)
+{
+	bench_t* b = Malloc(max * sizeof(bench_t));
+	double base = 0;
+	int n, i;
+
+	for (n = 1; n <= max; n = n < max && n * 2 > max ? max : n * 2)
+	{
+		struct timespec start, end;
+		long hits = 0;
+		double secs, rate;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < n; i++)
+		{
+			b[i].rng = 88172645463325252ULL + i;
+			b[i].cdf = cdf;
+			b[i].objects = objects;
+			b[i].hits = 0;
+			Pthread_create(&b[i].tid, NULL, bench_thread, &b[i]);
+		}
+		for (i = 0; i < n; i++)
+		{
+			Pthread_join(b[i].tid, NULL);
+			hits += b[i].hits;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) + 
+		       (end.tv_nsec - start.tv_nsec) / 1e9;
+		rate = n * BENCH_LOOKUPS / secs;
+		if (n == 1)
+			base = rate;
+		printf("threads=%d lookups_per_sec=%.0f speedup=%.2f "
+			   "hit_rate=%.2f%%\n", n, rate, rate / base, 
+			   100.0 * hits / (n * BENCH_LOOKUPS));
+		if (n == max)
+			break;
+	}
+	Free(b);
+}
+
+int main(int argc, char* argv[])
+{
+	long requests = 1000000, objects = 20000, i;
+	double alpha = 0.9, oneoff = 0.3, sum = 0;
+	double* cdf;
+	long hits = 0, oneoff_id = 0;
+	double cost = 0, saved = 0, dup = 0;
+	static char body[32768];
+	int opt, threads = 0;
+
+	while ((opt = getopt(argc, argv, "n:k:z:s:A:e:d:b:LS:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': requests = atol(optarg); break;
+		case 'k': objects = atol(optarg); break;
+		case 'z': alpha = atof(optarg); break;
+		case 's': oneoff = atof(optarg); break;
+		case 'd': dup = atof(optarg); break;
+		case 'b': threads = atoi(optarg); break;
+		case 'L': set_lockfree_reads(0); break;
+		case 'A':
+			set_admission(strcmp(optarg, "all") == 0 ?
+				          ADMIT_ALL : ADMIT_TINYLFU);
+			break;
+		case 'S':
+			if (set_cache_shards(atoi(optarg)) == 0)
+				break;
+			printf("Bad shard count: %s\n", optarg);
+			exit(0);
+		case 'e':
+			if (set_eviction(optarg) == 0)
+				break;
+			/* fall through */
+		default:
+			printf("usage: %s [-n requests] [-k objects] [-z alpha] "
+				   "[-s one-off share] [-A tinylfu|all] "
+				   "[-e lru|slru|arc|s3fifo|gdsf] [-d duplicate share] "
+				   "[-b threads] [-L] [-S shards]\n", argv[0]);
+			exit(0);
+		}
+	}
+
+	pool_init();
+	init_cache();
+
+	/* Zipf CDF over the popular objects */
+	cdf = Malloc(objects * sizeof(double));
+	for (i = 0; i < objects; i++)
+		sum += 1.0 / pow(i + 1, alpha);
+	cdf[0] = 1.0 / sum;
+	for (i = 1; i < objects; i++)
+		cdf[i] = cdf[i - 1] + 1.0 / pow(i + 1, alpha) / sum;
+
+	for (i = 0; i < requests; i++)
+	{
+		char path[MAXLINE];
+		cache_key_t key;
+		long id;
+		cb_t* cb;
+
+		/* One-off ids never repeat */
+		if (next_unit(&rng) < oneoff)
+			id = objects + oneoff_id++;
+		else
+			id = zipf_pick(cdf, objects, &rng);
+
+		sprintf(path, "/obj/%ld", id);
+		make_cache_key(&key, "http", "sim", 80, path);
+
+		cost += object_cost(id);
+		if ((cb = find(&key)) != NULL)
+		{
+			hits++;
+			saved += cb->cost;
+			release_cb(cb);
+		}
+		else
+		{
+			bufchain_t hdr, data;
+			long b = body_of(id, dup);
+
+			/* Bodies differ unless they are copies */
+			memcpy(body, &b, sizeof(b));
+			bufchain_init(&hdr);
+			bufchain_init(&data);
+			bufchain_append(&hdr, sim_hdr, strlen(sim_hdr));
+			bufchain_append(&data, body, object_size(b));
+			add_elem(&key, &hdr, &data, 0, object_cost(id), 0);
+		}
+	}
+
+	printf("requests=%ld objects=%ld alpha=%.2f one-off=%.0f%% "
+		   "hit_rate=%.2f%% fetch_saved=%.2f%%\n", requests, objects, alpha,
+		   oneoff * 100, 100.0 * hits / requests, 100.0 * saved / cost);
+	if (threads > 0)
+		bench(cdf, objects, threads);
+	return 0;
+}
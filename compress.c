@@ -0,0 +1,429 @@
+/*
+ * compress - gzip storage of cached bodies with zlib. A body is
+ *            compressed once, outside the cache lock, before it is
+ *            added; its header is rewritten to describe the gzip
+ *            form, which is what clients that accept gzip get. For
+ *            the rest the identity header is rebuilt and the body
+ *            is inflated chunk by chunk as it is sent.
+ *
+ *            With on-the-fly compression a response relayed to a
+ *            client that accepts gzip is deflated as it streams
+ *            through, and the gzip form is what gets cached, so
+ *            each object is compressed once.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include "compress.h"
+
+/* Content types that compress well, matched as prefixes */
+static const char* compressible[] = {
+	"text/", "application/javascript", "application/x-javascript",
+	"application/json", "application/xml", "application/xhtml+xml",
+	"application/rss+xml", "application/atom+xml", "image/svg+xml", NULL
+};
+
+/* Origin header lines replaced when a body is stored gzipped */
+static const char* gzip_drop[] = {
+	"Content-Length:", "Content-Encoding:", NULL
+};
+
+/* Stored lines replaced when it is sent inflated */
+static const char* identity_drop[] = {
+	"Content-Encoding:", "Content-Length:", NULL
+};
+
+static int enabled;
+static int on_the_fly;
+
+/* Statistics */
+static _Atomic uint64_t objects;
+static _Atomic uint64_t raw_bytes;
+static _Atomic uint64_t stored_bytes;
+static _Atomic uint64_t incompressible;
+static _Atomic uint64_t compress_us;
+static _Atomic uint64_t gzip_hits;
+static _Atomic uint64_t inflate_hits;
+static _Atomic uint64_t inflate_us;
+static _Atomic uint64_t otf_responses;
+static _Atomic uint64_t otf_raw_bytes;
+static _Atomic uint64_t otf_gz_bytes;
+static _Atomic uint64_t otf_us;
+
+/* Microseconds since start */
+static uint64_t since(struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		   (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* compress_enable: turns compressed storage on or off */
+void compress_enable(int on)
+{
+	enabled = on;
+}
+
+/* compress_on_the_fly: turns gzipping of relayed responses on or off */
+void compress_on_the_fly(int on)
+{
+	on_the_fly = on;
+}
+
+/* compress_type: whether a Content-Type is worth compressing */
+int compress_type(const char* content_type)
+{
+	int i;
+
+	for (i = 0; compressible[i] != NULL; i++)
+		if (strncasecmp(content_type, compressible[i], 
+			            strlen(compressible[i])) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * gzip_chain: appends the gzip form of a chain to out. Returns 0,
+ * or -1 if zlib failed.
+ */
+int gzip_chain(bufchain_t* in, bufchain_t* out)
+{
+	chunk_t* c = in->head;
+	z_stream z;
+	int flush;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, 
+		             Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	do
+	{
+		if (c != NULL)
+		{
+			z.next_in = (Bytef*)c->data;
+			z.avail_in = c->len;
+			c = c->next;
+		}
+		flush = c == NULL ? Z_FINISH : Z_NO_FLUSH;
+
+		/* Deflate straight into the chain */
+		do
+		{
+			size_t room;
+			char* dst = bufchain_reserve(out, &room);
+			z.next_out = (Bytef*)dst;
+			z.avail_out = room;
+			if (deflate(&z, flush) == Z_STREAM_ERROR)
+			{
+				deflateEnd(&z);
+				return -1;
+			}
+			bufchain_commit(out, room - z.avail_out);
+		} while (z.avail_out == 0);
+	} while (flush != Z_FINISH);
+
+	deflateEnd(&z);
+	return 0;
+}
+
+/*
+ * compress_wanted: whether a response should be gzipped on its
+ * way to a client: on-the-fly compression is on, the client takes
+ * gzip, and the body is a complete, unencoded one of a compressible
+ * type that is not known to be too small
+ */
+int compress_wanted(http_response_t* resp, int method, int accept_gzip)
+{
+	return on_the_fly && accept_gzip && method == METHOD_GET &&
+		   resp->status == 200 && !resp->encoded && 
+		   resp->framing != BODY_NONE &&
+		   (resp->content_length < 0 || 
+		   	resp->content_length >= COMPRESS_MIN) &&
+		   compress_type(resp->content_type);
+}
+
+/*
+ * compress_header: appends the lines of an origin header to to,
+ * rewritten for the gzip form of its body: gz_len bytes long, or
+ * of unknown length if it is -1, sent chunked if asked. The origin's
+ * Vary lines are kept, with Accept-Encoding added unless they list it
+ * or vary on everything. The blank line ending the header is left to
+ * the caller.
+ */
+void compress_header(bufchain_t* from, bufchain_t* to, long gz_len,
+	                 int chunked)
+{
+	char line[MAXLINE];
+
+	http_copy_header(from, to, gzip_drop);
+	strcpy(line, "Content-Encoding: gzip\r\n");
+	if (!http_header_lists(from, "Vary:", "Accept-Encoding") &&
+		!http_header_lists(from, "Vary:", "*"))
+		strcat(line, "Vary: Accept-Encoding\r\n");
+	if (gz_len >= 0)
+		sprintf(line + strlen(line), "Content-Length: %ld\r\n", gz_len);
+	if (chunked)
+		strcat(line, "Transfer-Encoding: chunked\r\n");
+	bufchain_append(to, line, strlen(line));
+}
+
+/* Sends n bytes of gzip output to fd, as one chunk if chunked */
+static int send_gz(int fd, char* buf, size_t n, int chunked)
+{
+	char size[32];
+	int len;
+
+	if (n == 0)
+		return 0;
+	if (chunked)
+	{
+		len = sprintf(size, "%zx\r\n", n);
+		if (rio_writen(fd, size, len) != len)
+			return -1;
+	}
+	if (rio_writen(fd, buf, n) != (ssize_t)n)
+		return -1;
+	if (chunked && rio_writen(fd, "\r\n", 2) != 2)
+		return -1;
+	return 0;
+}
+
+/*
+ * compress_relay: reads the rest of resp's body from rp and sends
+ * it to fd gzipped, in chunks if asked. Its gzip form is kept in
+ * keep for as long as that stays under max_keep bytes; keep is
+ * emptied once it does not. A client that goes away does not stop
+ * the body from being read and kept. Returns the length of the body
+ * before compression, or -1 if it was truncated.
+ */
+long compress_relay(rio_t* rp, http_response_t* resp, int fd, 
+	                int chunked, bufchain_t* keep, long max_keep)
+{
+	struct timespec start;
+	char* in = pool_alloc(POOL_LARGE_SIZE);
+	char* out = pool_alloc(POOL_LARGE_SIZE);
+	int keeping = 1, truncated = 0, unsent = 0, flush;
+	long raw = 0, gz = 0;
+	ssize_t nread;
+	z_stream z;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, 
+		             Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		pool_free(in);
+		pool_free(out);
+		return -1;
+	}
+
+	do
+	{
+		/* Next piece of the body, or the end of it */
+		nread = http_read_body(rp, resp, in, POOL_LARGE_SIZE);
+		if (nread < 0)
+			truncated = 1;
+		flush = nread > 0 ? Z_NO_FLUSH : Z_FINISH;
+		z.next_in = (Bytef*)in;
+		z.avail_in = nread > 0 ? nread : 0;
+		raw += z.avail_in;
+
+		do
+		{
+			size_t n;
+			z.next_out = (Bytef*)out;
+			z.avail_out = POOL_LARGE_SIZE;
+			deflate(&z, flush);
+			n = POOL_LARGE_SIZE - z.avail_out;
+			gz += n;
+
+			if (keeping && gz < max_keep)
+				bufchain_append(keep, out, n);
+			else if (keeping)
+			{
+				keeping = 0;
+				bufchain_release(keep);
+			}
+			if (!unsent && send_gz(fd, out, n, chunked) < 0)
+				unsent = 1;
+		} while (z.avail_out == 0);
+	} while (flush != Z_FINISH);
+
+	/* Last chunk of a chunked body */
+	if (!unsent && !truncated && chunked)
+		rio_writen(fd, "0\r\n\r\n", 5);
+
+	deflateEnd(&z);
+	pool_free(in);
+	pool_free(out);
+	atomic_fetch_add(&otf_responses, 1);
+	atomic_fetch_add(&otf_raw_bytes, raw);
+	atomic_fetch_add(&otf_gz_bytes, gz);
+	atomic_fetch_add(&otf_us, since(&start));
+	if (truncated)
+	{
+		bufchain_release(keep);
+		return -1;
+	}
+	return raw;
+}
+
+/*
+ * compress_body: stores a complete body gzipped if compressed
+ * storage is on, its type compresses and it shrinks by at least an
+ * eighth. data is replaced and resp->hdr rewritten for the gzip
+ * form. Returns the original length, or 0 if data was left as is.
+ */
+uint32_t compress_body(http_response_t* resp, bufchain_t* data)
+{
+	struct timespec start;
+	bufchain_t gz, hdr;
+	size_t raw = data->len;
+
+	if (!enabled || resp->encoded || raw < COMPRESS_MIN || 
+		raw > UINT32_MAX || !compress_type(resp->content_type))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bufchain_init(&gz);
+	if (gzip_chain(data, &gz) < 0 || gz.len > raw - raw / 8)
+	{
+		bufchain_release(&gz);
+		atomic_fetch_add(&incompressible, 1);
+		atomic_fetch_add(&compress_us, since(&start));
+		return 0;
+	}
+
+	/* Same header, describing the gzip form */
+	bufchain_init(&hdr);
+	compress_header(&resp->hdr, &hdr, gz.len, 0);
+	bufchain_release(&resp->hdr);
+	resp->hdr = hdr;
+	resp->content_length = gz.len;
+
+	bufchain_release(data);
+	*data = gz;
+
+	atomic_fetch_add(&objects, 1);
+	atomic_fetch_add(&raw_bytes, raw);
+	atomic_fetch_add(&stored_bytes, gz.len);
+	atomic_fetch_add(&compress_us, since(&start));
+	return raw;
+}
+
+/* Inflates a gzip chain to fd, -1 on error */
+static int gunzip_write(int fd, bufchain_t* in)
+{
+	char* buf = pool_alloc(POOL_LARGE_SIZE);
+	chunk_t* c;
+	z_stream z;
+	int rc = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 16) != Z_OK)
+	{
+		pool_free(buf);
+		return -1;
+	}
+
+	for (c = in->head; c != NULL && rc != Z_STREAM_END; c = c->next)
+	{
+		z.next_in = (Bytef*)c->data;
+		z.avail_in = c->len;
+		do
+		{
+			ssize_t n;
+			z.next_out = (Bytef*)buf;
+			z.avail_out = POOL_LARGE_SIZE;
+			rc = inflate(&z, Z_NO_FLUSH);
+			if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+				break;
+			n = POOL_LARGE_SIZE - z.avail_out;
+			if (n > 0 && rio_writen(fd, buf, n) != n)
+			{
+				rc = Z_ERRNO;
+				break;
+			}
+		} while (z.avail_out == 0 && rc != Z_STREAM_END);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+			break;
+	}
+
+	inflateEnd(&z);
+	pool_free(buf);
+	return rc == Z_STREAM_END ? 0 : -1;
+}
+
+/*
+ * compress_send: sends a cached response to fd, only its header if
+ * head_only. A gzipped body goes out as stored if the client
+ * accepts gzip, and is inflated under its identity header if not.
+ * Returns 0, or -1 if sending failed.
+ */
+int compress_send(int fd, cb_t* cb, int head_only, int accept_gzip)
+{
+	struct timespec start;
+	bufchain_t hdr;
+	char line[MAXLINE];
+	int rc;
+
+	if (cb->raw_len == 0 || accept_gzip)
+	{
+		if (cb->raw_len > 0)
+			atomic_fetch_add(&gzip_hits, 1);
+		return bufchain_writev(fd, &cb->hdr, head_only ? NULL : &cb->data)
+			   < 0 ? -1 : 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bufchain_init(&hdr);
+	http_copy_header(&cb->hdr, &hdr, identity_drop);
+	sprintf(line, "Content-Length: %u\r\n\r\n", cb->raw_len);
+	bufchain_append(&hdr, line, strlen(line));
+	rc = bufchain_write(fd, &hdr) < 0 ? -1 : 0;
+	bufchain_release(&hdr);
+	if (rc == 0 && !head_only)
+		rc = gunzip_write(fd, &cb->data);
+
+	atomic_fetch_add(&inflate_hits, 1);
+	atomic_fetch_add(&inflate_us, since(&start));
+	return rc;
+}
+
+/* compress_report: writes compression statistics into out */
+size_t compress_report(char* out, size_t len)
+{
+	uint64_t n = atomic_load(&objects);
+	uint64_t raw = atomic_load(&raw_bytes);
+	uint64_t tried = n + atomic_load(&incompressible);
+	uint64_t ih = atomic_load(&inflate_hits);
+	uint64_t on = atomic_load(&otf_responses);
+	uint64_t ogz = atomic_load(&otf_gz_bytes);
+	int k = snprintf(out, len,
+		"compress: enabled=%d objects=%lu incompressible=%lu "
+		"raw_bytes=%lu stored_bytes=%lu ratio=%.2f "
+		"compress_us_per_object=%.1f gzip_hits=%lu inflate_hits=%lu "
+		"inflate_us_per_hit=%.1f\r\n"
+		"gzip: on_the_fly=%d responses=%lu raw_bytes=%lu gzip_bytes=%lu "
+		"ratio=%.2f us_per_response=%.1f\r\n",
+		enabled, (unsigned long)n, 
+		(unsigned long)atomic_load(&incompressible), (unsigned long)raw,
+		(unsigned long)atomic_load(&stored_bytes),
+		raw ? (double)raw / atomic_load(&stored_bytes) : 0.0,
+		tried ? (double)atomic_load(&compress_us) / tried : 0.0,
+		(unsigned long)atomic_load(&gzip_hits), (unsigned long)ih,
+		ih ? (double)atomic_load(&inflate_us) / ih : 0.0,
+		on_the_fly, (unsigned long)on, 
+		(unsigned long)atomic_load(&otf_raw_bytes), (unsigned long)ogz,
+		ogz ? (double)atomic_load(&otf_raw_bytes) / ogz : 0.0,
+		on ? (double)atomic_load(&otf_us) / on : 0.0);
+	return (size_t)k < len ? (size_t)k : len;
+}
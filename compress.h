@@ -0,0 +1,40 @@
+/*
+ * compress.h - Compressed storage of cached text. Bodies of
+ *              compressible types are kept gzipped; the stored
+ *              form goes as is to clients that accept gzip and is
+ *              inflated on the way out for those that do not.
+ *              Uncompressed responses can also be gzipped as they
+ *              are relayed to clients that accept it.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "cache.h"
+#include "http.h"
+
+/* Smallest body worth compressing */
+#define COMPRESS_MIN 256
+
+/* zlib level; 6 is its usual trade of speed for size */
+#define COMPRESS_LEVEL 6
+
+void compress_enable(int on);
+void compress_on_the_fly(int on);
+int compress_wanted(http_response_t* resp, int method, int accept_gzip);
+void compress_header(bufchain_t* from, bufchain_t* to, long gz_len,
+	                 int chunked);
+long compress_relay(rio_t* rp, http_response_t* resp, int fd, 
+	                int chunked, bufchain_t* keep, long max_keep);
+int compress_type(const char* content_type);
+int gzip_chain(bufchain_t* in, bufchain_t* out);
+uint32_t compress_body(http_response_t* resp, bufchain_t* data);
+int compress_send(int fd, cb_t* cb, int head_only, int accept_gzip);
+size_t compress_report(char* out, size_t len);
+
+#endif /* __COMPRESS_H__ */
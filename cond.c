@@ -0,0 +1,184 @@
+/*
+ * cond - 304 Not Modified from cached or freshly fetched copies.
+ *        If-None-Match is compared weakly with the ETag, and takes
+ *        precedence; otherwise If-Modified-Since is compared with
+ *        Last-Modified as dates. The 304 carries the stored header
+ *        lines except those describing the body.
+ *
+ *        A GET's validators are not sent upstream, so a miss still
+ *        fetches (and caches) the whole object and the client gets
+ *        its 304 from that.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "cond.h"
+
+/* Stored lines left out of a 304 */
+static const char* not_modified_drop[] = {
+	"HTTP/", "Content-Length:", "Content-Range:", NULL
+};
+
+/* Statistics */
+static _Atomic uint64_t requests;
+static _Atomic uint64_t cached_304;
+static _Atomic uint64_t fetched_304;
+static _Atomic uint64_t modified;
+static _Atomic uint64_t saved_bytes;
+
+/* Parses an HTTP date (IMF-fixdate), -1 if it is not one */
+static time_t parse_date(const char* s)
+{
+	struct tm tm;
+	char* end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == NULL || *end != 0)
+		return -1;
+	return timegm(&tm);
+}
+
+/* Checks an If-None-Match list for the entity tag etag, weakly */
+static int etag_listed(const char* list, const char* etag)
+{
+	size_t len;
+
+	/* W/ makes no difference to a weak comparison */
+	if (strncmp(etag, "W/", 2) == 0)
+		etag += 2;
+	len = strlen(etag);
+
+	while (*list)
+	{
+		const char* end;
+
+		while (*list == ' ' || *list == '\t' || *list == ',')
+			list++;
+		if (*list == '*')
+			return 1;
+		if (strncmp(list, "W/", 2) == 0)
+			list += 2;
+		if (*list != '"' || (end = strchr(list + 1, '"')) == NULL)
+			return 0;
+		if ((size_t)(end + 1 - list) == len && 
+			strncmp(list, etag, len) == 0)
+			return 1;
+		list = end + 1;
+	}
+	return 0;
+}
+
+/*
+ * cond_match: whether the validators of req show the client has
+ * the copy with the header hdr already. Returns 0 for a request
+ * that is not conditional.
+ */
+int cond_match(http_request_t* req, bufchain_t* hdr)
+{
+	char v[MAXLINE];
+	time_t since, last;
+
+	if (req->if_none_match[0] != 0)
+		return http_header_value(hdr, "ETag:", v, sizeof(v)) &&
+			   etag_listed(req->if_none_match, v);
+
+	if (req->if_modified_since[0] == 0 ||
+		(since = parse_date(req->if_modified_since)) < 0 ||
+		!http_header_value(hdr, "Last-Modified:", v, sizeof(v)) ||
+		(last = parse_date(v)) < 0)
+		return 0;
+	return last <= since;
+}
+
+/* Sends a 304 built from the header hdr */
+static void not_modified(int fd, bufchain_t* hdr)
+{
+	char line[MAXLINE];
+	bufchain_t out;
+
+	if (hdr->head != NULL && hdr->head->len >= 8 &&
+		strncmp(hdr->head->data, "HTTP/1.", 7) == 0)
+		sprintf(line, "%.8s 304 Not Modified\r\n", hdr->head->data);
+	else
+		strcpy(line, "HTTP/1.0 304 Not Modified\r\n");
+
+	bufchain_init(&out);
+	bufchain_append(&out, line, strlen(line));
+	http_copy_header(hdr, &out, not_modified_drop);
+	bufchain_append(&out, "\r\n", 2);
+	bufchain_write(fd, &out);
+	bufchain_release(&out);
+}
+
+/* Whether req is a GET or HEAD with validators */
+static int conditional(http_request_t* req)
+{
+	return req != NULL && (req->method == METHOD_GET || 
+		                   req->method == METHOD_HEAD) &&
+		   (req->if_none_match[0] != 0 || req->if_modified_since[0] != 0);
+}
+
+/*
+ * cond_serve: answers a conditional request from a cached block.
+ * Returns 1 if it sent a 304, 0 if the copy has to be sent.
+ */
+int cond_serve(int fd, cb_t* cb, http_request_t* req)
+{
+	if (!conditional(req))
+		return 0;
+	atomic_fetch_add(&requests, 1);
+	if (!cond_match(req, &cb->hdr))
+	{
+		atomic_fetch_add(&modified, 1);
+		return 0;
+	}
+	not_modified(fd, &cb->hdr);
+	atomic_fetch_add(&cached_304, 1);
+	atomic_fetch_add(&saved_bytes, cb->data.len);
+	return 1;
+}
+
+/*
+ * cond_begin: answers a conditional request with a 304 if the
+ * response just fetched for it matches. Returns 1 if it did, and
+ * then the body is not for the client.
+ */
+int cond_begin(http_request_t* req, http_response_t* resp, int fd)
+{
+	if (fd < 0 || !conditional(req) || resp->status != 200)
+		return 0;
+	atomic_fetch_add(&requests, 1);
+	if (!cond_match(req, &resp->hdr))
+	{
+		atomic_fetch_add(&modified, 1);
+		return 0;
+	}
+	not_modified(fd, &resp->hdr);
+	atomic_fetch_add(&fetched_304, 1);
+	if (resp->content_length > 0)
+		atomic_fetch_add(&saved_bytes, resp->content_length);
+	return 1;
+}
+
+/* cond_report: writes conditional request statistics into out */
+size_t cond_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"conditional: requests=%lu not_modified_hits=%lu "
+		"not_modified_fetched=%lu modified=%lu bytes_saved=%lu\r\n",
+		(unsigned long)atomic_load(&requests),
+		(unsigned long)atomic_load(&cached_304),
+		(unsigned long)atomic_load(&fetched_304),
+		(unsigned long)atomic_load(&modified),
+		(unsigned long)atomic_load(&saved_bytes));
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,24 @@
+/*
+ * cond.h - Conditional requests answered by the proxy. A client's
+ *          If-None-Match or If-Modified-Since is checked against
+ *          the ETag and Last-Modified of the copy it would get, and
+ *          if they match it gets a 304 without a body.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __COND_H__
+#define __COND_H__
+
+#include "cache.h"
+#include "http.h"
+
+int cond_match(http_request_t* req, bufchain_t* hdr);
+int cond_serve(int fd, cb_t* cb, http_request_t* req);
+int cond_begin(http_request_t* req, http_response_t* resp, int fd);
+size_t cond_report(char* out, size_t len);
+
+#endif /* __COND_H__ */
@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include "bufpool.h"
 
 /* Updated with a reentrant open_clientfd_r function */
 
@@ -586,8 +587,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
 		return -1;
@@ -611,16 +611,29 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ *     The buffer comes from the buffer pool; release it with rio_releaseb.
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_buf = pool_alloc(RIO_BUFSIZE);
     rp->rio_bufptr = rp->rio_buf;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_releaseb - Return the read buffer of rp to the buffer pool
+ */
+void rio_releaseb(rio_t *rp) 
+{
+    pool_free(rp->rio_buf);
+    rp->rio_buf = NULL;
+    rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -756,6 +769,8 @@ int open_clientfd(char *hostname, int port)
 
 /*
  * open_clientfd_r - thread-safe version of open_clientfd
+ *   Returns -1 if no connection could be made and -2 if the
+ *   hostname did not resolve.
  */
 int open_clientfd_r(char *hostname, int port) {
     int clientfd;
@@ -771,7 +786,8 @@ int open_clientfd_r(char *hostname, int port) {
     /* Get a list of addrinfo structs */
     sprintf(port_str, "%d", port);
     if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
-        return -1;
+        close(clientfd);
+        return -2;
     }
   
     /* Walk the list, using each addrinfo to try to connect */
@@ -849,9 +865,12 @@ int Open_clientfd_r(char *hostname, int port)
 {
     int rc;
 
-    if ((rc = open_clientfd_r(hostname, port)) < 0) {
+    if ((rc = open_clientfd_r(hostname, port)) == -1) {
         unix_error("Open_clientfd_r error");
     }
+    else if (rc == -2) {
+        dns_error("Open_clientfd_r DNS error");
+    }
     return rc;
 }
 
@@ -0,0 +1,295 @@
+/*
+ * dedup - A table of cached bodies keyed by their xxHash64 digest.
+ *         A new body is hashed outside the cache lock; if the same
+ *         bytes are stored already, its chunks go back to the pool
+ *         and the stored body gains a reference instead. Digests
+ *         only pick candidates, the bytes are compared before a
+ *         body is shared, so a collision can never serve the wrong
+ *         object.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "dedup.h"
+
+/* xxHash64 primes */
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+/* Streaming xxHash64 state, so a chain hashes across chunks */
+typedef struct xxh64
+{
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buf[32];
+	size_t buffered;
+	uint64_t seed;
+} xxh64_t;
+
+/* The table and its statistics, all under table_lock */
+static body_t* table[DEDUP_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t bodies;
+static uint64_t shared;
+static uint64_t shared_bytes;
+static uint64_t collisions;
+
+static uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+static void xxh_init(xxh64_t* s, uint64_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->seed = seed;
+	s->v[0] = seed + PRIME1 + PRIME2;
+	s->v[1] = seed + PRIME2;
+	s->v[2] = seed;
+	s->v[3] = seed - PRIME1;
+}
+
+/* Consumes one 32 byte stripe */
+static void xxh_stripe(xxh64_t* s, const unsigned char* p)
+{
+	s->v[0] = xxh_round(s->v[0], read64(p));
+	s->v[1] = xxh_round(s->v[1], read64(p + 8));
+	s->v[2] = xxh_round(s->v[2], read64(p + 16));
+	s->v[3] = xxh_round(s->v[3], read64(p + 24));
+}
+
+static void xxh_update(xxh64_t* s, const unsigned char* p, size_t n)
+{
+	s->total += n;
+
+	/* Top up a partial stripe left by the last chunk */
+	if (s->buffered > 0)
+	{
+		size_t take = 32 - s->buffered;
+		if (take > n)
+			take = n;
+		memcpy(s->buf + s->buffered, p, take);
+		s->buffered += take;
+		p += take;
+		n -= take;
+		if (s->buffered < 32)
+			return;
+		xxh_stripe(s, s->buf);
+		s->buffered = 0;
+	}
+
+	for (; n >= 32; p += 32, n -= 32)
+		xxh_stripe(s, p);
+	memcpy(s->buf, p, n);
+	s->buffered = n;
+}
+
+static uint64_t xxh_digest(xxh64_t* s)
+{
+	const unsigned char* p = s->buf;
+	size_t n = s->buffered;
+	uint64_t h;
+
+	if (s->total >= 32)
+	{
+		h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12) +
+			rotl(s->v[3], 18);
+		h = xxh_merge(h, s->v[0]);
+		h = xxh_merge(h, s->v[1]);
+		h = xxh_merge(h, s->v[2]);
+		h = xxh_merge(h, s->v[3]);
+	}
+	else
+		h = s->seed + PRIME5;
+	h += s->total;
+
+	for (; n >= 8; p += 8, n -= 8)
+	{
+		h ^= xxh_round(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if (n >= 4)
+	{
+		h ^= (uint64_t)read32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+		n -= 4;
+	}
+	for (; n > 0; p++, n--)
+	{
+		h ^= *p * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* xxh64_chain: xxHash64 of the bytes held by a chain */
+uint64_t xxh64_chain(bufchain_t* bc, uint64_t seed)
+{
+	xxh64_t s;
+	chunk_t* c;
+
+	xxh_init(&s, seed);
+	for (c = bc->head; c != NULL; c = c->next)
+		xxh_update(&s, (unsigned char*)c->data, c->len);
+	return xxh_digest(&s);
+}
+
+/* Whether two chains hold the same bytes, however they are split */
+static int chain_equal(bufchain_t* a, bufchain_t* b)
+{
+	chunk_t* ca = a->head;
+	chunk_t* cb = b->head;
+	size_t oa = 0, ob = 0;
+
+	if (a->len != b->len)
+		return 0;
+	while (ca != NULL && cb != NULL)
+	{
+		size_t n = ca->len - oa;
+		if (n > cb->len - ob)
+			n = cb->len - ob;
+		if (memcmp(ca->data + oa, cb->data + ob, n) != 0)
+			return 0;
+		oa += n;
+		ob += n;
+		if (oa == ca->len)
+		{
+			ca = ca->next;
+			oa = 0;
+		}
+		if (ob == cb->len)
+		{
+			cb = cb->next;
+			ob = 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * body_intern: returns the body holding the bytes of data for blocks
+ * of a cache shard with a reference for the caller, taking over 
+ * data's chunks or, if the shard stores the same bytes already, 
+ * releasing them. data is left empty.
+ */
+body_t* body_intern(bufchain_t* data, int shard)
+{
+	uint64_t digest = xxh64_chain(data, 0);
+	body_t** bucket = &table[digest & (DEDUP_BUCKETS - 1)];
+	body_t* b;
+
+	pthread_mutex_lock(&table_lock);
+	for (b = *bucket; b != NULL; b = b->next)
+	{
+		if (b->digest != digest || b->shard != shard)
+			continue;
+		if (chain_equal(&b->data, data))
+			break;
+		collisions++;
+	}
+
+	if (b != NULL)
+	{
+		b->refcnt++;
+		shared++;
+		shared_bytes += b->data.footprint;
+		pthread_mutex_unlock(&table_lock);
+		bufchain_release(data);
+		return b;
+	}
+
+	b = pool_alloc(sizeof(body_t));
+	b->digest = digest;
+	b->data = *data;
+	b->refcnt = 1;
+	b->users = 0;
+	b->shard = shard;
+	b->next = *bucket;
+	*bucket = b;
+	bodies++;
+	pthread_mutex_unlock(&table_lock);
+	bufchain_init(data);
+	return b;
+}
+
+/* body_release: drops a reference, freeing the body with the last */
+void body_release(body_t* body)
+{
+	body_t** pp;
+
+	pthread_mutex_lock(&table_lock);
+	if (--body->refcnt > 0)
+	{
+		shared--;
+		shared_bytes -= body->data.footprint;
+		pthread_mutex_unlock(&table_lock);
+		return;
+	}
+
+	pp = &table[body->digest & (DEDUP_BUCKETS - 1)];
+	while (*pp != body)
+		pp = &(*pp)->next;
+	*pp = body->next;
+	bodies--;
+	pthread_mutex_unlock(&table_lock);
+
+	bufchain_release(&body->data);
+	pool_free(body);
+}
+
+/* dedup_report: writes body sharing statistics into out */
+size_t dedup_report(char* out, size_t len)
+{
+	int n;
+
+	pthread_mutex_lock(&table_lock);
+	n = snprintf(out, len,
+		"dedup: bodies=%lu shared_refs=%lu saved_bytes=%lu "
+		"collisions=%lu\r\n",
+		(unsigned long)bodies, (unsigned long)shared,
+		(unsigned long)shared_bytes, (unsigned long)collisions);
+	pthread_mutex_unlock(&table_lock);
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,40 @@
+/*
+ * dedup.h - Content-addressed storage of cached bodies. Bodies are
+ *           hashed with xxHash64 and kept once, however many cache
+ *           blocks point at them; a body is freed when the last
+ *           block referencing it goes. Bodies are not shared across
+ *           cache shards, so each shard counts its own users.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stdint.h>
+#include "bufpool.h"
+
+/* Buckets of the body table (a power of two) */
+#define DEDUP_BUCKETS 16384
+
+/* A body shared by every block with the same bytes */
+typedef struct body
+{
+	uint64_t digest;       /* xxHash64 of the bytes */
+	bufchain_t data;       /* the bytes; never changed once shared */
+	int refcnt;            /* blocks pointing at it, under the table lock */
+	int users;             /* of those, blocks in the cache index,
+	                          under the write lock of shard */
+	int shard;             /* cache shard of the blocks */
+	struct body* next;     /* next in table bucket */
+} body_t;
+
+uint64_t xxh64_chain(bufchain_t* bc, uint64_t seed);
+body_t* body_intern(bufchain_t* data, int shard);
+void body_release(body_t* body);
+size_t dedup_report(char* out, size_t len);
+
+#endif /* __DEDUP_H__ */
@@ -0,0 +1,541 @@
+/*
+ * disk - Second cache tier in a local file used as a ring. Records
+ *        (stored header followed by body) are appended at the head
+ *        of the ring; the oldest records are dropped from the index
+ *        as the head wraps over them. The index lives only in
+ *        memory.
+ *
+ *        Evicted blocks are pinned and queued; a single writer
+ *        thread writes them out at a bounded rate, so eviction
+ *        never waits for the disk. A hit is sent from the file with
+ *        sendfile, and an object hit DISK_PROMOTE_HITS times is read
+ *        back into memory. Readers pin an entry while sending it,
+ *        and the writer never reuses space a pinned entry is in.
+ *        The tier keeps one variant per key, the last evicted.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include "disk.h"
+#include "vary.h"
+
+/* A record in the file */
+typedef struct disk_entry
+{
+	uint64_t hash;
+	char* key;
+	time_t expires;
+	uint32_t cost;
+	uint32_t raw_len;        /* body length before gzip, 0 if none */
+	char* vary;              /* Vary names, NULL if it does not vary */
+	uint64_t variant;
+	off_t off;               /* where the record starts */
+	size_t hdr_len;
+	size_t data_len;
+	int ready;               /* fully written */
+	int dead;                /* dropped while pinned */
+	int pins;                /* readers and the writer using it */
+	int hits;
+	struct disk_entry* prev; /* ring order, oldest first */
+	struct disk_entry* next;
+	struct disk_entry* hnext; /* next in bucket */
+} disk_entry_t;
+
+/* An evicted block waiting for the writer */
+typedef struct disk_job
+{
+	cb_t* cb;
+	struct disk_job* next;
+} disk_job_t;
+
+/* The file, -1 while the tier is off */
+static int disk_fd = -1;
+static long capacity;
+static long rate;            /* bytes per second, 0 if unlimited */
+
+/* Ring and index, under disk_lock */
+static off_t head;
+static long used;
+static int objects;
+static disk_entry_t* buckets[DISK_BUCKETS];
+static disk_entry_t* oldest;
+static disk_entry_t* newest;
+static int pinned_dead;
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+
+/* Write queue, under queue_lock */
+static disk_job_t* queue_head;
+static disk_job_t* queue_tail;
+static long queued;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Statistics */
+static uint64_t hits;
+static uint64_t misses;
+static uint64_t promotions;
+static uint64_t writes;
+static uint64_t written;
+static uint64_t dropped;
+
+/* Finds the entry of key, only if it is ready and fresh if asked */
+static disk_entry_t* lookup(cache_key_t* key, int usable)
+{
+	time_t now = time(NULL);
+	disk_entry_t* e;
+
+	for (e = buckets[key->hash & (DISK_BUCKETS - 1)]; e != NULL;
+		 e = e->hnext)
+		if (e->hash == key->hash && strcmp(e->key, key->str) == 0)
+		{
+			if (usable && (!e->ready ||
+				(e->expires != 0 && e->expires <= now)))
+				return NULL;
+			return e;
+		}
+	return NULL;
+}
+
+/* Frees an entry that is off the index */
+static void free_entry(disk_entry_t* e)
+{
+	Free(e->key);
+	if (e->vary != NULL)
+		Free(e->vary);
+	Free(e);
+}
+
+/*
+ * drop_entry: takes an entry off the index and the ring. A pinned
+ * entry is freed by its last unpin. Must hold disk_lock.
+ */
+static void drop_entry(disk_entry_t* e)
+{
+	disk_entry_t** pp = &buckets[e->hash & (DISK_BUCKETS - 1)];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		oldest = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		newest = e->prev;
+
+	used -= e->hdr_len + e->data_len;
+	objects--;
+
+	if (e->pins > 0)
+	{
+		e->dead = 1;
+		pinned_dead++;
+	}
+	else
+		free_entry(e);
+}
+
+/* Drops a pin on an entry. Must hold disk_lock. */
+static void unpin(disk_entry_t* e)
+{
+	if (--e->pins == 0 && e->dead)
+	{
+		free_entry(e);
+		if (--pinned_dead == 0)
+			pthread_cond_broadcast(&drained);
+	}
+}
+
+/*
+ * reserve: makes room for a record of len bytes at the head of the
+ * ring, dropping the records it overlaps, and indexes it as not yet
+ * ready and pinned by the writer. Must hold disk_lock.
+ */
+static disk_entry_t* reserve(cb_t* cb, cache_key_t* key, size_t len)
+{
+	disk_entry_t* e;
+	disk_entry_t** bucket;
+
+	/* Wrap when the record does not fit before the end */
+	if (head + (off_t)len > capacity)
+	{
+		while (oldest != NULL && oldest->off >= head)
+			drop_entry(oldest);
+		head = 0;
+	}
+	while (oldest != NULL && oldest->off >= head &&
+		   oldest->off < head + (off_t)len)
+		drop_entry(oldest);
+
+	/* Space still being sent from cannot be reused yet */
+	while (pinned_dead > 0)
+		pthread_cond_wait(&drained, &disk_lock);
+
+	e = Malloc(sizeof(disk_entry_t));
+	e->hash = key->hash;
+	e->key = Malloc(key->len + 1);
+	strcpy(e->key, key->str);
+	e->expires = cb->expires;
+	e->cost = cb->cost;
+	e->raw_len = cb->raw_len;
+	e->vary = NULL;
+	if (cb->vary != NULL)
+	{
+		e->vary = Malloc(strlen(cb->vary) + 1);
+		strcpy(e->vary, cb->vary);
+	}
+	e->variant = cb->variant;
+	e->off = head;
+	e->hdr_len = cb->hdr.len;
+	e->data_len = cb->data.len;
+	e->ready = 0;
+	e->dead = 0;
+	e->pins = 1;
+	e->hits = 0;
+
+	bucket = &buckets[e->hash & (DISK_BUCKETS - 1)];
+	e->hnext = *bucket;
+	*bucket = e;
+	e->next = NULL;
+	e->prev = newest;
+	if (newest != NULL)
+		newest->next = e;
+	else
+		oldest = e;
+	newest = e;
+
+	head += len;
+	used += len;
+	objects++;
+	return e;
+}
+
+/* Waits until writing bytes more keeps within the rate limit */
+static void throttle(long bytes)
+{
+	static double tokens;
+	static struct timespec last;
+	struct timespec now;
+
+	if (rate <= 0)
+		return;
+
+	/* Refill for the time passed, with at most a second of burst */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tokens += ((now.tv_sec - last.tv_sec) +
+		       (now.tv_nsec - last.tv_nsec) / 1e9) * rate;
+	if (tokens > rate)
+		tokens = rate;
+	last = now;
+
+	tokens -= bytes;
+	if (tokens < 0)
+	{
+		double wait = -tokens / rate;
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &last);
+		tokens = 0;
+	}
+}
+
+/* Writes a chain to the file at off, -1 on error */
+static int write_chain(bufchain_t* bc, off_t off)
+{
+	chunk_t* c;
+
+	for (c = bc->head; c != NULL; c = c->next)
+	{
+		size_t done = 0;
+		while (done < c->len)
+		{
+			ssize_t n = pwrite(disk_fd, c->data + done, c->len - done, off);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			done += n;
+			off += n;
+		}
+	}
+	return 0;
+}
+
+/* Reads len bytes of the file at off onto the end of a chain */
+static int read_chain(bufchain_t* bc, off_t off, size_t len)
+{
+	while (len > 0)
+	{
+		size_t room;
+		char* dst = bufchain_reserve(bc, &room);
+		ssize_t n;
+
+		if ((n = pread(disk_fd, dst, room < len ? room : len, off)) < 0 &&
+			errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		bufchain_commit(bc, n);
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* The writer thread: writes queued blocks out one at a time */
+static void* writer(void* vargp)
+{
+	(void)vargp;
+	Pthread_detach(pthread_self());
+
+	while (1)
+	{
+		disk_job_t* job;
+		disk_entry_t* e;
+		cache_key_t key;
+		cb_t* cb;
+		size_t len;
+		int ok;
+
+		/* Next block */
+		pthread_mutex_lock(&queue_lock);
+		while (queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		job = queue_head;
+		if ((queue_head = job->next) == NULL)
+			queue_tail = NULL;
+		cb = job->cb;
+		len = cb->hdr.len + cb->data.len;
+		queued -= len;
+		pthread_mutex_unlock(&queue_lock);
+		pool_free(job);
+
+		key.hash = cb->hash;
+		key.len = strlen(cb->key);
+		memcpy(key.str, cb->key, key.len + 1);
+
+		/* A copy promoted earlier may still be on disk */
+		pthread_mutex_lock(&disk_lock);
+		e = lookup(&key, 1);
+		if (e != NULL && e->hdr_len + e->data_len == len &&
+			e->variant == cb->variant)
+		{
+			e->hits = 0;
+			pthread_mutex_unlock(&disk_lock);
+			release_cb(cb);
+			continue;
+		}
+		if ((e = lookup(&key, 0)) != NULL)
+			drop_entry(e);
+		pthread_mutex_unlock(&disk_lock);
+
+		throttle(len);
+
+		pthread_mutex_lock(&disk_lock);
+		e = reserve(cb, &key, len);
+		pthread_mutex_unlock(&disk_lock);
+
+		ok = write_chain(&cb->hdr, e->off) == 0 &&
+			 write_chain(&cb->data, e->off + cb->hdr.len) == 0;
+
+		pthread_mutex_lock(&disk_lock);
+		if (ok)
+		{
+			e->ready = 1;
+			writes++;
+			written += len;
+		}
+		else if (!e->dead)
+			drop_entry(e);
+		unpin(e);
+		pthread_mutex_unlock(&disk_lock);
+
+		release_cb(cb);
+	}
+	return NULL;
+}
+
+/*
+ * disk_init: turns the tier on with a file of size bytes at path,
+ * written at no more than rate bytes per second (0 for no limit).
+ * Returns -1 if the file cannot be set up.
+ */
+int disk_init(const char* path, long size, long r)
+{
+	pthread_t tid;
+
+	if ((disk_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		return -1;
+	if (ftruncate(disk_fd, size) < 0)
+	{
+		close(disk_fd);
+		disk_fd = -1;
+		return -1;
+	}
+	capacity = size;
+	rate = r;
+	Pthread_create(&tid, NULL, writer, NULL);
+	return 0;
+}
+
+/*
+ * disk_offer: queues an evicted block for the writer, pinning it
+ * until it is written. Blocks are dropped while the queue is full.
+ * Cheap enough to call under the cache lock.
+ */
+void disk_offer(cb_t* cb)
+{
+	size_t len = cb->hdr.len + cb->data.len;
+	disk_job_t* job;
+
+	if (disk_fd < 0 || (long)len > capacity ||
+		(cb->expires != 0 && cb->expires <= time(NULL)))
+		return;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queued + (long)len > DISK_QUEUE_MAX)
+	{
+		dropped++;
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	job = pool_alloc(sizeof(disk_job_t));
+	atomic_fetch_add(&cb->refcnt, 1);
+	job->cb = cb;
+	job->next = NULL;
+	if (queue_tail != NULL)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	queued += len;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Sends len bytes of the file at off to fd, -1 on error */
+static int send_range(int fd, off_t off, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = sendfile(fd, disk_fd, &off, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * disk_serve: sends the stored response for key to fd, only its
+ * header if head_only. A hot object is read back into memory
+ * afterwards. A gzipped body is only sent to clients that accept
+ * gzip, and a variant only to requests that select it; anything
+ * else counts as a miss. Returns 1 if the tier had
+ * it, 0 otherwise.
+ */
+int disk_serve(cache_key_t* key, int fd, int head_only, int accept_gzip)
+{
+	disk_entry_t* e;
+	int promote;
+
+	if (disk_fd < 0)
+		return 0;
+
+	pthread_mutex_lock(&disk_lock);
+	if ((e = lookup(key, 1)) == NULL || (e->raw_len > 0 && !accept_gzip) ||
+		(e->vary != NULL && key->headers != NULL &&
+		 vary_variant(e->vary, key->headers) != e->variant))
+	{
+		misses++;
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+	e->pins++;
+	hits++;
+	promote = ++e->hits >= DISK_PROMOTE_HITS;
+	pthread_mutex_unlock(&disk_lock);
+
+	send_range(fd, e->off, head_only ? e->hdr_len :
+		                   e->hdr_len + e->data_len);
+
+	/* Hot again: back to memory, keeping the copy here until the
+	   writer replaces it */
+	if (promote)
+	{
+		bufchain_t hdr, data;
+		bufchain_init(&hdr);
+		bufchain_init(&data);
+		if (read_chain(&hdr, e->off, e->hdr_len) == 0 &&
+			read_chain(&data, e->off + e->hdr_len, e->data_len) == 0)
+		{
+			key->vary = e->vary;
+			key->variant = e->variant;
+			add_elem(key, &hdr, &data, e->expires, e->cost, e->raw_len);
+			key->vary = NULL;
+			pthread_mutex_lock(&disk_lock);
+			promotions++;
+			e->hits = 0;
+			pthread_mutex_unlock(&disk_lock);
+		}
+		bufchain_release(&hdr);
+		bufchain_release(&data);
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	unpin(e);
+	pthread_mutex_unlock(&disk_lock);
+	return 1;
+}
+
+/* disk_remove: drops the record of key, if any */
+void disk_remove(cache_key_t* key)
+{
+	disk_entry_t* e;
+
+	if (disk_fd < 0)
+		return;
+	pthread_mutex_lock(&disk_lock);
+	if ((e = lookup(key, 0)) != NULL)
+		drop_entry(e);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* disk_report: writes tier statistics into out, returns length */
+size_t disk_report(char* out, size_t len)
+{
+	long q;
+	int n;
+
+	if (disk_fd < 0)
+		return 0;
+
+	pthread_mutex_lock(&queue_lock);
+	q = queued;
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_mutex_lock(&disk_lock);
+	n = snprintf(out, len,
+		"disk: objects=%d bytes=%ld capacity=%ld queued=%ld writes=%lu "
+		"written=%lu dropped=%lu hits=%lu misses=%lu promotions=%lu\r\n",
+		objects, used, capacity, q, (unsigned long)writes,
+		(unsigned long)written, (unsigned long)dropped,
+		(unsigned long)hits, (unsigned long)misses,
+		(unsigned long)promotions);
+	pthread_mutex_unlock(&disk_lock);
+	return (size_t)n < len ? (size_t)n : len;
+}
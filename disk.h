@@ -0,0 +1,36 @@
+/*
+ * disk.h - Optional second cache tier in a local file. Blocks
+ *          evicted from memory are queued and written out by a
+ *          background thread; an in-memory index finds them again,
+ *          and they are sent straight from the file with sendfile.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "cache.h"
+
+/* Default size of the tier */
+#define DISK_DEFAULT_SIZE (64L << 20)
+
+/* Buckets of the index (a power of two) */
+#define DISK_BUCKETS 16384
+
+/* Bytes of evicted blocks allowed to wait for the writer */
+#define DISK_QUEUE_MAX (8L << 20)
+
+/* Hits after which an object moves back to memory */
+#define DISK_PROMOTE_HITS 2
+
+int disk_init(const char* path, long size, long rate);
+void disk_offer(cb_t* cb);
+int disk_serve(cache_key_t* key, int fd, int head_only, int accept_gzip);
+void disk_remove(cache_key_t* key);
+size_t disk_report(char* out, size_t len);
+
+#endif /* __DISK_H__ */
@@ -13,6 +13,7 @@
 MAX_BASIC=25
 MAX_CACHE=15
 MAX_CONCURRENCY=10
+MAX_PROTOCOL=10
 
 # Various constants
 HOME_DIR=`pwd`
@@ -65,6 +66,34 @@ function download_noproxy {
     cd $HOME_DIR
 }
 
+#
+# download_proxy_hdr - like download_proxy, but with a request header
+#     and keeping the response header in <filename>.hdr
+# usage: download_proxy_hdr <testdir> <filename> <origin_url> <proxy_url> <header>
+#
+function download_proxy_hdr {
+    cd $1
+    curl --max-time ${TIMEOUT} --silent --proxy $4 --header "$5" \
+        --dump-header $2.hdr --output $2 $3
+    (( $? == 28 )) && echo "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# protocol_check - counts a protocol test as run, and as passed if
+#     its status is 0
+# usage: protocol_check <status> <description>
+#
+function protocol_check {
+    numRun=`expr $numRun + 1`
+    if [ $1 -eq 0 ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo "   Success: $2"
+    else
+        echo "   Failure: $2"
+    fi
+}
+
 #
 # clear_dirs - Clear the download directories
 #
@@ -404,14 +433,100 @@ fi
 
 echo "CachingConcurrency: $concurrencyScore / ${MAX_CONCURRENCY}"
 
+#####
+# Protocol
+#
+# Byte ranges, conditional requests and Vary, against the range
+# capable Tiny. The proxy gzips on the fly, so what it caches varies
+# on Accept-Encoding.
+#
+echo ""
+echo "*** Protocol ***"
+
+# Run the Tiny Web server
+tiny_port=$(free_port)
+echo "Starting tiny on port ${tiny_port}"
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+
+# Wait for tiny to start in earnest
+wait_for_port_use "${tiny_port}"
+
+# Run the proxy
+proxy_port=$(free_port)
+echo "Starting proxy on port ${proxy_port}"
+./proxy -g ${proxy_port} &> /dev/null &
+proxy_pid=$!
+
+# Wait for the proxy to start in earnest
+wait_for_port_use "${proxy_port}"
+
+numRun=0
+numSucceeded=0
+clear_dirs
+origin="http://localhost:${tiny_port}"
+proxy="http://localhost:${proxy_port}"
+
+echo "1: A range of ./tiny/csapp.c before it is cached"
+download_proxy_hdr $PROXY_DIR csapp.c.0 "${origin}/csapp.c" ${proxy} "Range: bytes=0-99"
+head -c 100 ./tiny/csapp.c | cmp -s - ${PROXY_DIR}/csapp.c.0 && \
+    grep -q "^HTTP/1.[01] 206" ${PROXY_DIR}/csapp.c.0.hdr
+protocol_check $? "206 with the first 100 bytes."
+
+echo "2: A range of ./tiny/csapp.c from the cache"
+download_proxy_hdr $PROXY_DIR csapp.c.1 "${origin}/csapp.c" ${proxy} "Range: bytes=-50"
+tail -c 50 ./tiny/csapp.c | cmp -s - ${PROXY_DIR}/csapp.c.1 && \
+    grep -q "^HTTP/1.[01] 206" ${PROXY_DIR}/csapp.c.1.hdr
+protocol_check $? "206 with the last 50 bytes."
+
+echo "3: Two ranges of ./tiny/csapp.c"
+download_proxy_hdr $PROXY_DIR csapp.c.2 "${origin}/csapp.c" ${proxy} "Range: bytes=0-9,20-29"
+grep -qi "^Content-type: multipart/byteranges" ${PROXY_DIR}/csapp.c.2.hdr && \
+    grep -qi "Content-range: bytes 20-29/" ${PROXY_DIR}/csapp.c.2
+protocol_check $? "206 multipart/byteranges with both parts."
+
+echo "4: A range past the end of ./tiny/csapp.c"
+download_proxy_hdr $PROXY_DIR csapp.c.3 "${origin}/csapp.c" ${proxy} "Range: bytes=99999999-"
+grep -q "^HTTP/1.[01] 416" ${PROXY_DIR}/csapp.c.3.hdr
+protocol_check $? "416."
+
+echo "5: ./tiny/home.html, then again if modified since"
+download_proxy_hdr $PROXY_DIR home.html "${origin}/home.html" ${proxy} "Accept: */*"
+modified=`grep -i "^Last-modified:" ${PROXY_DIR}/home.html.hdr | cut -d' ' -f2- | tr -d '\r'`
+download_proxy_hdr $PROXY_DIR home.html.1 "${origin}/home.html" ${proxy} "If-Modified-Since: ${modified}"
+[ -n "${modified}" ] && grep -q "^HTTP/1.[01] 304" ${PROXY_DIR}/home.html.1.hdr && \
+    [ ! -s ${PROXY_DIR}/home.html.1 ]
+protocol_check $? "304 with no body."
+
+echo "6: ./tiny/tiny.c gzipped, then plain"
+download_proxy_hdr $PROXY_DIR tiny.c.gz "${origin}/tiny.c" ${proxy} "Accept-Encoding: gzip"
+download_proxy_hdr $PROXY_DIR tiny.c "${origin}/tiny.c" ${proxy} "Accept-Encoding: identity"
+gzip -dc ${PROXY_DIR}/tiny.c.gz 2> /dev/null | cmp -s - ./tiny/tiny.c && \
+    grep -qi "^Vary: Accept-Encoding" ${PROXY_DIR}/tiny.c.gz.hdr && \
+    cmp -s ${PROXY_DIR}/tiny.c ./tiny/tiny.c
+protocol_check $? "Each variant decodes to the file."
+
+# Clean up
+echo "Killing tiny and proxy"
+kill $tiny_pid 2> /dev/null
+wait $tiny_pid 2> /dev/null
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+
+protocolScore=`expr ${MAX_PROTOCOL} \* ${numSucceeded} / ${numRun}`
+
+echo "Protocol: $protocolScore / ${MAX_PROTOCOL}"
+
 # Emit the total score
-totalScore=`expr ${basicScore} + ${cacheScore} + ${concurrencyScore}`
-maxScore=`expr ${MAX_BASIC} + ${MAX_CACHE} + ${MAX_CONCURRENCY}`
+totalScore=`expr ${basicScore} + ${cacheScore} + ${concurrencyScore} + ${protocolScore}`
+maxScore=`expr ${MAX_BASIC} + ${MAX_CACHE} + ${MAX_CONCURRENCY} + ${MAX_PROTOCOL}`
 echo ""
 echo "totalScore = ${totalScore} / ${maxScore}"
 
 echo ""
-echo "{ \"scores\": {\"Basic\":${basicScore}, \"Caching\":${cacheScore}, \"CachingConcurrency\":${concurrencyScore}}, \"scoreboard\": [${totalScore}, ${basicScore}, ${cacheScore}, ${concurrencyScore}]}"
+echo "{ \"scores\": {\"Basic\":${basicScore}, \"Caching\":${cacheScore}, \"CachingConcurrency\":${concurrencyScore}, \"Protocol\":${protocolScore}}, \"scoreboard\": [${totalScore}, ${basicScore}, ${cacheScore}, ${concurrencyScore}, ${protocolScore}]}"
 
 exit
 
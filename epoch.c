@@ -0,0 +1,205 @@
+/*
+ * epoch - Epoch-based reclamation. Each reading thread claims a slot
+ *         the first time it reads and keeps it until it exits. A
+ *         writer tags what it unlinked with the epoch it unlinked it
+ *         in, starts a new epoch and frees the tagged things older
+ *         than the oldest epoch a reader still announces.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stddef.h>
+#include <stdatomic.h>
+#include "epoch.h"
+
+/* Bytes of a cache line */
+#define EPOCH_LINE 64
+
+/* A reader slot, alone on its cache line */
+typedef struct reader
+{
+	_Atomic uint64_t epoch; /* epoch it entered in, 0 while outside */
+	_Atomic(void*) pins[EPOCH_PINS]; /* kept past exit, NULL if free */
+	_Atomic int used;       /* claimed by a thread */
+	char pad[EPOCH_LINE - sizeof(uint64_t) - EPOCH_PINS * sizeof(void*) -
+	         sizeof(int)];
+} reader_t;
+
+static reader_t readers[EPOCH_MAX_READERS];
+
+/* Current epoch, starting at 1 so 0 can mean outside */
+static _Atomic uint64_t global_epoch = 1;
+
+/* Slots ever claimed; writers scan no further */
+static _Atomic int high;
+
+/* Slot of the calling thread; -1 if it has none yet, -2 if none
+   was free */
+static __thread int self = -1;
+
+/* Claims a free slot for the calling thread */
+static void claim()
+{
+	int i, h;
+
+	self = -2;
+	for (i = 0; i < EPOCH_MAX_READERS; i++)
+	{
+		int unused = 0;
+
+		if (atomic_load_explicit(&readers[i].used, memory_order_relaxed) ||
+			!atomic_compare_exchange_strong(&readers[i].used, &unused, 1))
+			continue;
+
+		h = atomic_load(&high);
+		while (h <= i && !atomic_compare_exchange_weak(&high, &h, i + 1))
+			;
+		self = i;
+		return;
+	}
+}
+
+/*
+ * epoch_slot: returns the calling thread's slot, claiming one if it
+ * has none yet, or -1 if every slot is taken. Others may keep per
+ * reader state by it; the slot stays the thread's until
+ * epoch_thread_release.
+ */
+int epoch_slot()
+{
+	if (self == -1)
+		claim();
+	return self < 0 ? -1 : self;
+}
+
+/*
+ * epoch_slots: how many slots were ever claimed; no slot past them
+ * is in use
+ */
+int epoch_slots()
+{
+	return atomic_load(&high);
+}
+
+/*
+ * epoch_enter: announces that the calling thread is about to read.
+ * Returns its slot for epoch_exit, or -1 if every slot is taken, in
+ * which case the caller has to lock out writers instead.
+ */
+int epoch_enter()
+{
+	if (epoch_slot() < 0)
+		return -1;
+
+	/* The fence pairs with the one in epoch_quiesce: either the
+	   writer sees this slot, or this reader sees the unlink. The 
+	   release makes pins taken before visible with the epoch */
+	atomic_store_explicit(&readers[self].epoch, atomic_load(&global_epoch),
+		                  memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	return self;
+}
+
+/* epoch_exit: ends a read started by epoch_enter */
+void epoch_exit(int slot)
+{
+	atomic_store_explicit(&readers[slot].epoch, 0, memory_order_release);
+}
+
+/* epoch_now: the current epoch, to tag something just unlinked */
+uint64_t epoch_now()
+{
+	return atomic_load(&global_epoch);
+}
+
+/*
+ * epoch_quiesce: starts a new epoch and returns the oldest one a
+ * reader may still be in. Whatever was tagged with an older epoch
+ * can no longer be reached and may be freed.
+ */
+uint64_t epoch_quiesce()
+{
+	uint64_t oldest = atomic_fetch_add(&global_epoch, 1) + 1;
+	int i, n = atomic_load(&high);
+
+	for (i = 0; i < n; i++)
+	{
+		uint64_t e = atomic_load(&readers[i].epoch);
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+	return oldest;
+}
+
+/*
+ * epoch_pin: pins p in slot, which the caller entered, so that it
+ * stays valid after epoch_exit until epoch_unpin. Returns -1 if the
+ * slot has no room left.
+ */
+int epoch_pin(int slot, void* p)
+{
+	int i;
+
+	for (i = 0; i < EPOCH_PINS; i++)
+		if (atomic_load_explicit(&readers[slot].pins[i], 
+			                     memory_order_relaxed) == NULL)
+		{
+			atomic_store_explicit(&readers[slot].pins[i], p, 
+				                  memory_order_relaxed);
+			return 0;
+		}
+	return -1;
+}
+
+/* epoch_unpin: unpins p; returns 0 if the calling thread had not */
+int epoch_unpin(void* p)
+{
+	int i;
+
+	if (self < 0)
+		return 0;
+	for (i = 0; i < EPOCH_PINS; i++)
+		if (atomic_load_explicit(&readers[self].pins[i], 
+			                     memory_order_relaxed) == p)
+		{
+			atomic_store_explicit(&readers[self].pins[i], NULL, 
+				                  memory_order_release);
+			return 1;
+		}
+	return 0;
+}
+
+/*
+ * epoch_pins: collects every pin into out, which has room for
+ * EPOCH_MAX_READERS * EPOCH_PINS, and returns how many there are.
+ * Called after epoch_quiesce, it sees every pin taken by a reader
+ * quiesce found outside or in a newer epoch.
+ */
+int epoch_pins(void** out)
+{
+	int i, j, n = 0, h = atomic_load(&high);
+
+	for (i = 0; i < h; i++)
+		for (j = 0; j < EPOCH_PINS; j++)
+		{
+			void* p = atomic_load_explicit(&readers[i].pins[j], 
+				                           memory_order_acquire);
+			if (p != NULL)
+				out[n++] = p;
+		}
+	return n;
+}
+
+/*
+ * epoch_thread_release: gives up the calling thread's slot. Called
+ * when a thread that read is about to exit.
+ */
+void epoch_thread_release()
+{
+	if (self >= 0)
+		atomic_store_explicit(&readers[self].used, 0, memory_order_release);
+	self = -1;
+}
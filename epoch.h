@@ -0,0 +1,41 @@
+/*
+ * epoch.h - Epoch-based reclamation for lock-free readers. A reader
+ *           announces the global epoch in a slot of its own while it
+ *           walks shared structures, and a writer that unlinked
+ *           something frees it only once every active reader entered
+ *           after the unlink. Readers write nothing but their own
+ *           slot, which sits on a cache line of its own.
+ *
+ *           A reader can also pin a few things in its slot to keep
+ *           using them after it exits; writers collect the pins and
+ *           keep pinned things until they are unpinned.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stdint.h>
+
+/* Threads that can read at once; the rest fall back to locking */
+#define EPOCH_MAX_READERS 512
+
+/* Things a reader can keep pinned at once */
+#define EPOCH_PINS 4
+
+int epoch_slot();
+int epoch_slots();
+int epoch_enter();
+void epoch_exit(int slot);
+uint64_t epoch_now();
+uint64_t epoch_quiesce();
+void epoch_thread_release();
+int epoch_pin(int slot, void* p);
+int epoch_unpin(void* p);
+int epoch_pins(void** out);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,223 @@
+/*
+ * hot - Per-thread hot caches. Each entry holds a reference on a
+ *       block, so the block stays valid while the entry does. When
+ *       a block held by some hot cache is removed from the shared
+ *       cache, every thread drops its removed entries on its next
+ *       lookup, so they do not hold memory the cache no longer
+ *       counts. A block found here is lent to the caller without
+ *       another reference, and release_cb hands it back.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdatomic.h>
+#include "hot.h"
+
+/* An entry of a thread's hot cache */
+typedef struct hot_entry
+{
+	cb_t* cb;          /* pinned block, NULL if empty */
+	uint32_t score;    /* its hits, lowered by contenders */
+	uint32_t pending;  /* hits not passed on yet */
+	int lent;          /* times found and not released yet */
+} hot_entry_t;
+
+/* The calling thread's entries, NULL if it has none */
+static __thread hot_entry_t* table;
+
+/* Bumped whenever a block held by a hot cache is removed */
+static _Atomic uint64_t removals;
+
+/* Value of removals the calling thread last swept for */
+static __thread uint64_t swept;
+
+/* Statistics; hits are added in batches */
+static _Atomic uint64_t threads;
+static _Atomic uint64_t hits;
+static _Atomic uint64_t installs;
+static _Atomic uint64_t drops;
+
+/* hot_enable: gives the calling thread a hot cache */
+void hot_enable()
+{
+	if (table != NULL)
+		return;
+	table = Calloc(HOT_SLOTS, sizeof(hot_entry_t));
+	atomic_fetch_add(&threads, 1);
+}
+
+/* Whether a pinned block has left the shared cache */
+static int removed(cb_t* cb)
+{
+	return atomic_load_explicit(&cb->dead, memory_order_acquire);
+}
+
+/* Passes on an entry's pending hits */
+static void sync_hits(hot_entry_t* e)
+{
+	if (e->pending == 0)
+		return;
+	cache_touch(e->cb, e->pending);
+	atomic_fetch_add_explicit(&hits, e->pending, memory_order_relaxed);
+	e->pending = 0;
+}
+
+/* Empties an entry that is not lent out, dropping its reference */
+static void drop(hot_entry_t* e)
+{
+	cb_t* cb = e->cb;
+
+	sync_hits(e);
+	e->cb = NULL;
+	release_cb(cb);
+	atomic_fetch_add_explicit(&drops, 1, memory_order_relaxed);
+}
+
+/* Drops every entry whose block was removed and is not lent */
+static void sweep_removed()
+{
+	int i;
+
+	swept = atomic_load_explicit(&removals, memory_order_acquire);
+	for (i = 0; i < HOT_SLOTS; i++)
+		if (table[i].cb != NULL && table[i].lent == 0 && 
+			removed(table[i].cb))
+			drop(&table[i]);
+}
+
+/* 
+ * hot_find: returns the block cached for key in the calling thread's
+ * hot cache, or NULL. The block is lent, not pinned again; it must
+ * still be given back with release_cb.
+ */
+cb_t* hot_find(cache_key_t* key, time_t now)
+{
+	hot_entry_t* e;
+	cb_t* cb;
+
+	if (table == NULL)
+		return NULL;
+
+	/* Let go of every removed block since the last lookup, even
+	   those nobody asks for any more */
+	if (atomic_load_explicit(&removals, memory_order_acquire) != swept)
+		sweep_removed();
+
+	e = &table[key->hash & (HOT_SLOTS - 1)];
+	cb = e->cb;
+	if (cb == NULL || cb->hash != key->hash || strcmp(cb->key, key->str))
+		return NULL;
+
+	/* Purged, replaced, evicted or stale: ask the shared cache */
+	if (removed(cb) || (cb->expires != 0 && cb->expires <= now))
+	{
+		if (e->lent == 0)
+			drop(e);
+		return NULL;
+	}
+
+	e->lent++;
+	if (e->score < HOT_MAX_SCORE)
+		e->score++;
+	if (++e->pending == HOT_SYNC)
+		sync_hits(e);
+	return cb;
+}
+
+/* 
+ * hot_return: takes back a block lent by hot_find. Returns 0 if cb
+ * was not lent by the calling thread's hot cache.
+ */
+int hot_return(cb_t* cb)
+{
+	hot_entry_t* e;
+
+	if (table == NULL)
+		return 0;
+	e = &table[cb->hash & (HOT_SLOTS - 1)];
+	if (e->cb != cb || e->lent == 0)
+		return 0;
+
+	/* Removed while lent out: nothing holds it back any more */
+	if (--e->lent == 0 && removed(cb))
+		drop(e);
+	return 1;
+}
+
+/* 
+ * hot_offer: offers a block just found in the shared cache. It takes
+ * an empty or dead entry right away; a live one only once contenders
+ * have worn its score down. Blocks that vary are left out, since the
+ * entry would not know the request headers.
+ */
+void hot_offer(cb_t* cb)
+{
+	hot_entry_t* e;
+
+	if (table == NULL || cb->vary != NULL)
+		return;
+	e = &table[cb->hash & (HOT_SLOTS - 1)];
+	if (e->cb == cb || e->lent > 0)
+		return;
+	if (e->cb != NULL)
+	{
+		if (!removed(e->cb) && --e->score > 0)
+			return;
+		drop(e);
+	}
+
+	/* Marked held before checking it is still cached; the mirror 
+	   of remove_cb */
+	if (!atomic_load_explicit(&cb->hot, memory_order_relaxed))
+		atomic_store(&cb->hot, 1);
+	if (atomic_load(&cb->dead))
+		return;
+
+	atomic_fetch_add(&cb->refcnt, 1);
+	e->cb = cb;
+	e->score = 1;
+	e->pending = 0;
+	atomic_fetch_add_explicit(&installs, 1, memory_order_relaxed);
+}
+
+/* 
+ * hot_removed: tells every hot cache that a block it may hold was
+ * removed. Called by the cache with its write lock held.
+ */
+void hot_removed()
+{
+	atomic_fetch_add_explicit(&removals, 1, memory_order_release);
+}
+
+/* 
+ * hot_thread_release: empties the calling thread's hot cache and
+ * frees it. Called when a thread that has one is about to exit.
+ */
+void hot_thread_release()
+{
+	int i;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < HOT_SLOTS; i++)
+		if (table[i].cb != NULL)
+			drop(&table[i]);
+	Free(table);
+	table = NULL;
+	atomic_fetch_sub(&threads, 1);
+}
+
+/* hot_report: writes hot cache statistics into out, returns length */
+size_t hot_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"hot: threads=%lu slots=%d hits=%lu installs=%lu drops=%lu\r\n",
+		(unsigned long)atomic_load(&threads), HOT_SLOTS,
+		(unsigned long)atomic_load(&hits), 
+		(unsigned long)atomic_load(&installs),
+		(unsigned long)atomic_load(&drops));
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,41 @@
+/*
+ * hot.h - A small per-thread cache of pinned references to the
+ *         hottest blocks, in front of the shared cache. A hit in it
+ *         writes nothing other threads touch: the block is pinned
+ *         already, and whether it is still cached is read from the
+ *         block itself, which is marked once, when it is removed.
+ *         Its hits reach the policy and the statistics in batches.
+ *
+ *         Only long-lived threads, like the workers of a pool, have
+ *         one; the others go to the shared cache directly.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __HOT_H__
+#define __HOT_H__
+
+#include <time.h>
+#include "cache.h"
+
+/* Entries per thread, direct mapped by hash (a power of two) */
+#define HOT_SLOTS 256
+
+/* Hits on an entry passed on to the shared cache at once */
+#define HOT_SYNC 64
+
+/* Shared hits a contender needs to displace the most used entry */
+#define HOT_MAX_SCORE 8
+
+void hot_enable();
+cb_t* hot_find(cache_key_t* key, time_t now);
+int hot_return(cb_t* cb);
+void hot_offer(cb_t* cb);
+void hot_removed();
+void hot_thread_release();
+size_t hot_report(char* out, size_t len);
+
+#endif /* __HOT_H__ */
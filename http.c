@@ -0,0 +1,690 @@
+/*
+ * http - Parsing of client requests and upstream HTTP responses
+ *        into a structured form, and framing of their bodies so that
+ *        they are read exactly instead of until the peer closes.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "http.h"
+#include "relay.h"
+
+/* Header names */
+static const char* content_length_tag = "Content-Length:";
+static const char* content_type_tag = "Content-Type:";
+static const char* transfer_encoding_tag = "Transfer-Encoding:";
+static const char* cache_control_tag = "Cache-Control:";
+static const char* expect_tag = "Expect:";
+static const char* accept_encoding_tag = "Accept-Encoding:";
+static const char* content_encoding_tag = "Content-Encoding:";
+static const char* vary_tag = "Vary:";
+static const char* range_tag = "Range:";
+static const char* if_range_tag = "If-Range:";
+static const char* if_none_match_tag = "If-None-Match:";
+static const char* if_modified_since_tag = "If-Modified-Since:";
+
+/* Method names, indexed by METHOD_* */
+static const char* method_names[] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH"
+};
+#define NUM_METHODS (int)(sizeof(method_names) / sizeof(method_names[0]))
+
+/* Checks for a header name, case-insensitively */
+static int is_header(const char* line, const char* tag)
+{
+	return strncasecmp(line, tag, strlen(tag)) == 0;
+}
+
+/* Returns the value of a header line with whitespace trimmed */
+static char* header_value(char* line, const char* tag)
+{
+	char* v = line + strlen(tag);
+	char* end;
+
+	while(*v == ' ' || *v == '\t')
+		v++;
+	end = v + strlen(v);
+	while(end > v && (end[-1] == '\r' || end[-1] == '\n' ||
+		  end[-1] == ' ' || end[-1] == '\t'))
+		*--end = 0;
+	return v;
+}
+
+/* Checks whether a comma separated list names a token */
+static int has_token(const char* list, const char* token)
+{
+	size_t len = strlen(token);
+
+	while(*list)
+	{
+		while(*list == ' ' || *list == '\t' || *list == ',')
+			list++;
+		if (strncasecmp(list, token, len) == 0 &&
+			(list[len] == 0 || list[len] == ',' || list[len] == ' ' ||
+			 list[len] == ';'))
+			return 1;
+		while(*list && *list != ',')
+			list++;
+	}
+	return 0;
+}
+
+/* Reads the q value given to a token in a list, 1 if there is none */
+static double token_quality(const char* list, const char* token)
+{
+	size_t len = strlen(token);
+
+	while(*list)
+	{
+		while(*list == ' ' || *list == '\t' || *list == ',')
+			list++;
+		if (strncasecmp(list, token, len) == 0)
+		{
+			const char* p = list + len;
+			while(*p == ' ' || *p == ';')
+				p++;
+			if (strncasecmp(p, "q=", 2) == 0)
+				return atof(p + 2);
+			return 1;
+		}
+		while(*list && *list != ',')
+			list++;
+	}
+	return 1;
+}
+
+/* Reads the numeric argument of a directive such as max-age=60 */
+static long directive_value(const char* list, const char* name)
+{
+	size_t len = strlen(name);
+
+	while(*list)
+	{
+		while(*list == ' ' || *list == '\t' || *list == ',')
+			list++;
+		if (strncasecmp(list, name, len) == 0 && list[len] == '=')
+			return strtol(list + len + 1 + (list[len + 1] == '"'), 
+				          NULL, 10);
+		while(*list && *list != ',')
+			list++;
+	}
+	return -1;
+}
+
+/*
+ * parse_length: reads a Content-Length value into *len, which holds
+ * the length seen so far or -1. Returns -1 if the value is not all
+ * digits or differs from one seen before.
+ */
+static int parse_length(const char* v, long* len)
+{
+	char* end;
+	long n;
+
+	if (!isdigit((unsigned char)*v))
+		return -1;
+	errno = 0;
+	n = strtol(v, &end, 10);
+	if (*end != 0 || errno == ERANGE || (*len >= 0 && *len != n))
+		return -1;
+	*len = n;
+	return 0;
+}
+
+/* Checks for the empty line ending a header, trailer or chunk */
+static int is_blank(const char* line)
+{
+	return strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0;
+}
+
+/*
+ * chunk_size: reads the size on a chunk-size line. Returns -1 unless
+ * it is hex digits, then optionally extensions after a ';', then the
+ * end of the line.
+ */
+static long chunk_size(const char* line)
+{
+	size_t len = strlen(line);
+	char* end;
+	long size;
+
+	if (!isxdigit((unsigned char)*line) || len == 0 || 
+		line[len - 1] != '\n')
+		return -1;
+	errno = 0;
+	size = strtol(line, &end, 16);
+	if (errno == ERANGE)
+		return -1;
+	while (*end == ' ' || *end == '\t')
+		end++;
+	if (*end != ';' && !is_blank(end))
+		return -1;
+	return size;
+}
+
+/* Records the directives of a Cache-Control header */
+static void parse_cache_control(http_response_t* resp, const char* v)
+{
+	long age;
+
+	/* no-cache would need revalidation, which we do not do */
+	if (has_token(v, "no-store") || has_token(v, "private") ||
+		has_token(v, "no-cache"))
+		resp->no_store = 1;
+
+	/* s-maxage overrides max-age for a shared cache */
+	if ((age = directive_value(v, "s-maxage")) >= 0)
+		resp->max_age = age;
+	else if (resp->max_age < 0 && 
+		     (age = directive_value(v, "max-age")) >= 0)
+		resp->max_age = age;
+}
+
+/* http_method: maps a method name to METHOD_*, -1 if unsupported */
+int http_method(const char* name)
+{
+	int i;
+
+	for(i = 0; i < NUM_METHODS; i++)
+		if (strcmp(name, method_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* Returns the name of a METHOD_* */
+const char* http_method_name(int method)
+{
+	return method_names[method];
+}
+
+/* Safe methods never change state at the origin */
+int http_method_safe(int method)
+{
+	return method == METHOD_GET || method == METHOD_HEAD;
+}
+
+/* Initializes a request with no headers seen yet */
+void http_request_init(http_request_t* req, int method)
+{
+	req->method = method;
+	req->content_length = -1;
+	req->malformed = 0;
+	req->chunked = 0;
+	req->expect_continue = 0;
+	req->accept_gzip = 0;
+	req->http11 = 0;
+	req->range[0] = 0;
+	req->if_range[0] = 0;
+	req->if_none_match[0] = 0;
+	req->if_modified_since[0] = 0;
+	bufchain_init(&req->hdr);
+}
+
+/*
+ * http_request_header: records a client header line. Returns 1
+ * if the line is kept for forwarding upstream and 0 if the proxy
+ * handles it itself.
+ */
+int http_request_header(http_request_t* req, char* line)
+{
+	char copy[MAXLINE];
+
+	if (is_header(line, content_length_tag))
+	{
+		strcpy(copy, line);
+		if (parse_length(header_value(copy, content_length_tag), 
+			             &req->content_length) < 0)
+			req->malformed = 1;
+	}
+	else if (is_header(line, transfer_encoding_tag))
+	{
+		strcpy(copy, line);
+		req->chunked = has_token(header_value(copy, 
+			           transfer_encoding_tag), "chunked");
+	}
+	else if (is_header(line, expect_tag))
+	{
+		/* We answer 100-continue ourselves */
+		strcpy(copy, line);
+		req->expect_continue = has_token(header_value(copy, expect_tag), 
+			                             "100-continue");
+		return 0;
+	}
+	else if (is_header(line, accept_encoding_tag))
+	{
+		/* gzip;q=0 turns it off */
+		char* v;
+		strcpy(copy, line);
+		v = header_value(copy, accept_encoding_tag);
+		req->accept_gzip = has_token(v, "gzip") && 
+			               token_quality(v, "gzip") > 0;
+	}
+	else if (is_header(line, range_tag) || is_header(line, if_range_tag))
+	{
+		/* A GET is fetched whole and the ranges cut from it here */
+		int if_range = is_header(line, if_range_tag);
+		strcpy(copy, line);
+		snprintf(if_range ? req->if_range : req->range, HTTP_RANGE_LEN,
+			     "%s", header_value(copy, if_range ? if_range_tag : 
+			                        range_tag));
+		return req->method != METHOD_GET;
+	}
+	else if (is_header(line, if_none_match_tag))
+	{
+		/* Likewise, so a GET can still fill the cache */
+		strcpy(copy, line);
+		snprintf(req->if_none_match, HTTP_RANGE_LEN, "%s",
+			     header_value(copy, if_none_match_tag));
+		return req->method != METHOD_GET;
+	}
+	else if (is_header(line, if_modified_since_tag))
+	{
+		strcpy(copy, line);
+		snprintf(req->if_modified_since, HTTP_TYPE_LEN, "%s",
+			     header_value(copy, if_modified_since_tag));
+		return req->method != METHOD_GET;
+	}
+	return 1;
+}
+
+/* Frees the storage held by a request */
+void http_request_release(http_request_t* req)
+{
+	bufchain_release(&req->hdr);
+}
+
+/*
+ * http_forward_chunked: streams a chunked body from rp to to_fd
+ * as is, chunk by chunk, without buffering it. Returns 0 once the
+ * last chunk and trailer are through, -1 if writing to to_fd failed
+ * and -2 if the body was malformed or cut short.
+ */
+int http_forward_chunked(rio_t* rp, int to_fd)
+{
+	char line[MAXLINE];
+	ssize_t n, sent;
+	long size;
+
+	while ((n = rio_readlineb(rp, line, MAXLINE)) > 0)
+	{
+		if (rio_writen(to_fd, line, n) != n)
+			return -1;
+		if ((size = chunk_size(line)) < 0)
+			return -2;
+
+		if (size == 0)
+		{
+			/* Trailer up to the blank line */
+			while ((n = rio_readlineb(rp, line, MAXLINE)) > 0)
+			{
+				if (rio_writen(to_fd, line, n) != n)
+					return -1;
+				if (is_blank(line))
+					return 0;
+			}
+			return -2;
+		}
+
+		/* Chunk data and its CRLF */
+		if ((sent = relay_body(rp, to_fd, size)) != size)
+			return sent < 0 ? -1 : -2;
+		if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0 || !is_blank(line))
+			return -2;
+		if (rio_writen(to_fd, line, n) != n)
+			return -1;
+	}
+	return -2;
+}
+
+/*
+ * http_read_response: reads the status line and headers of a
+ * response. Every header line except Transfer-Encoding (which
+ * is decoded here) is kept in resp->hdr. Returns -1 if no valid
+ * status line could be read or the Content-Length is malformed.
+ */
+int http_read_response(rio_t* rp, http_response_t* resp)
+{
+	char line[MAXLINE];
+	int malformed = 0;
+	ssize_t n;
+
+	resp->status = 0;
+	resp->content_length = -1;
+	resp->chunked = 0;
+	resp->content_type[0] = 0;
+	resp->no_store = 0;
+	resp->encoded = 0;
+	resp->max_age = -1;
+	resp->vary[0] = 0;
+	resp->remaining = 0;
+	resp->in_chunk = 0;
+	bufchain_init(&resp->hdr);
+
+	/* Status line */
+	if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+		return -1;
+	if (strncmp(line, "HTTP/", strlen("HTTP/")) != 0 ||
+		sscanf(line, "%*s %d", &resp->status) != 1)
+		return -1;
+	bufchain_append(&resp->hdr, line, n);
+
+	/* Header lines */
+	while ((n = rio_readlineb(rp, line, MAXLINE)) > 0)
+	{
+		if (is_blank(line))
+			break;
+
+		if (is_header(line, transfer_encoding_tag))
+		{
+			char copy[MAXLINE];
+			strcpy(copy, line);
+			resp->chunked = has_token(header_value(copy,
+				            transfer_encoding_tag), "chunked");
+			/* We hand the client a decoded body */
+			if (resp->chunked)
+				continue;
+		}
+		else if (is_header(line, content_length_tag))
+		{
+			/* One that does not parse or disagrees with another
+			   leaves the body's end unknown */
+			char copy[MAXLINE];
+			strcpy(copy, line);
+			if (parse_length(header_value(copy, content_length_tag), 
+				             &resp->content_length) < 0)
+				malformed = 1;
+		}
+		else if (is_header(line, cache_control_tag))
+		{
+			char copy[MAXLINE];
+			strcpy(copy, line);
+			parse_cache_control(resp, header_value(copy, 
+				                cache_control_tag));
+		}
+		else if (is_header(line, content_encoding_tag))
+		{
+			char copy[MAXLINE];
+			strcpy(copy, line);
+			resp->encoded = strcasecmp(header_value(copy, 
+				            content_encoding_tag), "identity") != 0;
+		}
+		else if (is_header(line, content_type_tag))
+		{
+			char copy[MAXLINE];
+			strcpy(copy, line);
+			snprintf(resp->content_type, HTTP_TYPE_LEN, "%s",
+				     header_value(copy, content_type_tag));
+		}
+		else if (is_header(line, vary_tag))
+		{
+			/* Several Vary lines add up to one list */
+			char copy[MAXLINE];
+			size_t used = strlen(resp->vary);
+			strcpy(copy, line);
+			snprintf(resp->vary + used, HTTP_VARY_LEN - used, "%s%s",
+				     used > 0 ? "," : "", header_value(copy, vary_tag));
+		}
+		bufchain_append(&resp->hdr, line, n);
+	}
+	if (n <= 0 || malformed)
+	{
+		bufchain_release(&resp->hdr);
+		return -1;
+	}
+
+	/* Work out how the body is delimited */
+	if ((resp->status >= 100 && resp->status < 200) ||
+		resp->status == 204 || resp->status == 304)
+		resp->framing = BODY_NONE;
+	else if (resp->chunked)
+		resp->framing = BODY_CHUNKED;
+	else if (resp->content_length >= 0)
+	{
+		resp->framing = BODY_LENGTH;
+		resp->remaining = resp->content_length;
+	}
+	else
+		resp->framing = BODY_EOF;
+	return 0;
+}
+
+/* Reads the next chunk-size line, 0 on the last chunk, -1 on error */
+static int next_chunk(rio_t* rp, http_response_t* resp)
+{
+	char line[MAXLINE];
+
+	/* Data of the previous chunk is followed by CRLF */
+	if (resp->in_chunk && (rio_readlineb(rp, line, MAXLINE) <= 0 ||
+		                   !is_blank(line)))
+		return -1;
+
+	if (rio_readlineb(rp, line, MAXLINE) <= 0)
+		return -1;
+	resp->remaining = chunk_size(line);
+	resp->in_chunk = 1;
+	if (resp->remaining < 0)
+		return -1;
+	if (resp->remaining > 0)
+		return 1;
+
+	/* Last chunk: skip the trailer */
+	while (rio_readlineb(rp, line, MAXLINE) > 0)
+		if (is_blank(line))
+			return 0;
+	return -1;
+}
+
+/*
+ * http_read_body: reads up to n bytes of decoded body into buf.
+ * Returns the number of bytes read, 0 at the end of the body, or
+ * -1 if the server closed before the body was complete.
+ */
+ssize_t http_read_body(rio_t* rp, http_response_t* resp,
+	                   char* buf, size_t n)
+{
+	ssize_t nread;
+	int rc;
+
+	switch(resp->framing)
+	{
+	case BODY_EOF:
+		nread = rio_readnb(rp, buf, n);
+		if (nread <= 0)
+			resp->framing = BODY_NONE;
+		return nread;
+
+	case BODY_CHUNKED:
+		if (resp->remaining == 0)
+		{
+			if ((rc = next_chunk(rp, resp)) <= 0)
+			{
+				resp->framing = BODY_NONE;
+				return rc;
+			}
+		}
+		/* fall through */
+	case BODY_LENGTH:
+		if (resp->remaining == 0)
+		{
+			resp->framing = BODY_NONE;
+			return 0;
+		}
+		if ((long)n > resp->remaining)
+			n = resp->remaining;
+		nread = rio_readnb(rp, buf, n);
+		if (nread <= 0)
+		{
+			/* Truncated body */
+			resp->framing = BODY_NONE;
+			return -1;
+		}
+		resp->remaining -= nread;
+		if (resp->remaining == 0 && resp->framing == BODY_LENGTH)
+			resp->framing = BODY_NONE;
+		return nread;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * http_end_header: completes resp->hdr for storage once the body
+ * length is known. A decoded chunked body gets a Content-Length.
+ */
+void http_end_header(http_response_t* resp, size_t body_len)
+{
+	char line[MAXLINE];
+
+	if (resp->chunked && resp->content_length < 0)
+	{
+		sprintf(line, "Content-Length: %zu\r\n", body_len);
+		bufchain_append(&resp->hdr, line, strlen(line));
+	}
+	bufchain_append(&resp->hdr, "\r\n", 2);
+}
+
+/*
+ * http_copy_header: appends the lines of a stored header to another
+ * chain, leaving out those starting with one of the NULL-terminated
+ * drop prefixes and the blank line at the end
+ */
+void http_copy_header(bufchain_t* from, bufchain_t* to, 
+	                  const char** drop)
+{
+	char line[MAXLINE];
+	size_t n = 0;
+	chunk_t* c;
+	uint32_t i;
+	int j;
+
+	for (c = from->head; c != NULL; c = c->next)
+	{
+		for (i = 0; i < c->len; i++)
+		{
+			if (n < sizeof(line) - 1)
+				line[n++] = c->data[i];
+			if (c->data[i] != '\n')
+				continue;
+
+			/* A whole line */
+			line[n] = 0;
+			for (j = 0; drop[j] != NULL && !is_header(line, drop[j]); j++)
+				;
+			if (drop[j] == NULL && strcmp(line, "\r\n") != 0)
+				bufchain_append(to, line, n);
+			n = 0;
+		}
+	}
+}
+
+/*
+ * http_header_value: copies the trimmed value of the first tag line
+ * of a stored header into out. Returns 0 if there is none.
+ */
+int http_header_value(bufchain_t* hdr, const char* tag, char* out, 
+	                  size_t len)
+{
+	char line[MAXLINE];
+	size_t n = 0;
+	chunk_t* c;
+	uint32_t i;
+
+	for (c = hdr->head; c != NULL; c = c->next)
+	{
+		for (i = 0; i < c->len; i++)
+		{
+			if (n < sizeof(line) - 1)
+				line[n++] = c->data[i];
+			if (c->data[i] != '\n')
+				continue;
+
+			line[n] = 0;
+			if (is_header(line, tag))
+			{
+				snprintf(out, len, "%s", header_value(line, tag));
+				return 1;
+			}
+			n = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * http_header_lists: checks whether any tag line of a stored header
+ * names token in its comma separated list
+ */
+int http_header_lists(bufchain_t* hdr, const char* tag, const char* token)
+{
+	char line[MAXLINE];
+	size_t n = 0;
+	chunk_t* c;
+	uint32_t i;
+
+	for (c = hdr->head; c != NULL; c = c->next)
+	{
+		for (i = 0; i < c->len; i++)
+		{
+			if (n < sizeof(line) - 1)
+				line[n++] = c->data[i];
+			if (c->data[i] != '\n')
+				continue;
+
+			line[n] = 0;
+			if (is_header(line, tag) && 
+				has_token(header_value(line, tag), token))
+				return 1;
+			n = 0;
+		}
+	}
+	return 0;
+}
+
+/* Frees the storage held by a response */
+void http_response_release(http_response_t* resp)
+{
+	bufchain_release(&resp->hdr);
+}
+
+/*
+ * http_cacheable_status: statuses whose responses may be stored
+ * without explicit freshness information
+ */
+int http_cacheable_status(int status)
+{
+	switch(status)
+	{
+	case 200: /* OK */
+	case 203: /* Non-Authoritative Information */
+	case 300: /* Multiple Choices */
+	case 301: /* Moved Permanently */
+	case 404: /* Not Found */
+	case 410: /* Gone */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * http_cacheable: decides from the header alone whether a response
+ * may be stored: its status, its Cache-Control directives and a
+ * Content-Length that fits within max_size together with the header.
+ */
+int http_cacheable(http_response_t* resp, long max_size)
+{
+	if (!http_cacheable_status(resp->status) || resp->no_store ||
+		resp->max_age == 0)
+		return 0;
+	if (resp->content_length >= 0 && 
+		(long)resp->hdr.len + resp->content_length >= max_size)
+		return 0;
+	return 1;
+}
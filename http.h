@@ -0,0 +1,97 @@
+/*
+ * http.h - Parsing of client requests and upstream HTTP responses
+ *          into a structured form, and framing of their bodies
+ *          (Content-Length, chunked or read until close).
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include "bufpool.h"
+
+/* How the body of a message is delimited */
+#define BODY_NONE    0  /* no body, or body fully read */
+#define BODY_LENGTH  1  /* exactly Content-Length bytes */
+#define BODY_CHUNKED 2  /* chunked transfer coding */
+#define BODY_EOF     3  /* until the server closes */
+
+#define HTTP_TYPE_LEN 256
+#define HTTP_VARY_LEN 512
+#define HTTP_RANGE_LEN 512
+
+/* Request methods the proxy forwards */
+#define METHOD_GET    0
+#define METHOD_HEAD   1
+#define METHOD_POST   2
+#define METHOD_PUT    3
+#define METHOD_DELETE 4
+#define METHOD_PATCH  5
+
+/* A parsed client request header */
+typedef struct http_request
+{
+	int method;                       /* one of METHOD_* */
+	long content_length;              /* -1 if absent */
+	int malformed;                    /* Content-Length unreadable or
+	                                     given twice differently */
+	int chunked;                      /* Transfer-Encoding: chunked */
+	int expect_continue;              /* Expect: 100-continue */
+	int accept_gzip;                  /* Accept-Encoding allows gzip */
+	int http11;                       /* sent as HTTP/1.1 */
+	char range[HTTP_RANGE_LEN];       /* Range value, empty if absent */
+	char if_range[HTTP_RANGE_LEN];    /* If-Range value, likewise */
+	char if_none_match[HTTP_RANGE_LEN]; /* validators, likewise */
+	char if_modified_since[HTTP_TYPE_LEN];
+	bufchain_t hdr;                   /* lines to forward, no blank line */
+} http_request_t;
+
+/* A parsed response header */
+typedef struct http_response
+{
+	int status;                       /* status code */
+	long content_length;              /* -1 if absent */
+	int chunked;                      /* Transfer-Encoding: chunked */
+	char content_type[HTTP_TYPE_LEN]; /* empty if absent */
+	int no_store;                     /* no-store, private or no-cache */
+	int encoded;                      /* Content-Encoding other than
+	                                     identity */
+	long max_age;                     /* s-maxage or max-age, -1 if absent */
+	char vary[HTTP_VARY_LEN];         /* Vary values joined, empty if
+	                                     absent */
+	bufchain_t hdr;                   /* header lines, no blank line */
+
+	/* Body reader state */
+	int framing;                      /* one of BODY_* */
+	long remaining;                   /* left in body or current chunk */
+	int in_chunk;                     /* inside chunked data */
+} http_response_t;
+
+int http_method(const char* name);
+const char* http_method_name(int method);
+int http_method_safe(int method);
+void http_request_init(http_request_t* req, int method);
+int http_request_header(http_request_t* req, char* line);
+void http_request_release(http_request_t* req);
+int http_forward_chunked(rio_t* rp, int to_fd);
+
+int http_read_response(rio_t* rp, http_response_t* resp);
+ssize_t http_read_body(rio_t* rp, http_response_t* resp,
+	                   char* buf, size_t n);
+void http_end_header(http_response_t* resp, size_t body_len);
+void http_copy_header(bufchain_t* from, bufchain_t* to, 
+	                  const char** drop);
+int http_header_value(bufchain_t* hdr, const char* tag, char* out, 
+	                  size_t len);
+int http_header_lists(bufchain_t* hdr, const char* tag, 
+	                  const char* token);
+void http_response_release(http_response_t* resp);
+int http_cacheable_status(int status);
+int http_cacheable(http_response_t* resp, long max_size);
+
+#endif /* __HTTP_H__ */
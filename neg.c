@@ -0,0 +1,248 @@
+/*
+ * neg - Short-lived entries for upstream failures, kept apart from
+ *       the object cache: they hold no body, only the class of
+ *       failure, the status and its reason phrase, from which the
+ *       proxy writes a canned error. Origin failures are keyed by
+ *       host:port and error responses by cache key. Expired entries
+ *       are dropped as lookups come across them, or swept when the
+ *       table is full.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "neg.h"
+#include "cachekey.h"
+
+/* An upstream failure */
+typedef struct neg_entry
+{
+	uint64_t hash;
+	char* key;
+	int cls;                      /* one of NEG_* */
+	int status;                   /* response status, 0 for origins */
+	char reason[NEG_REASON_LEN];  /* its reason phrase */
+	time_t expires;
+	struct neg_entry* next;
+} neg_entry_t;
+
+/* Seconds per class, 0 to turn one off */
+static int ttl[NEG_CLASSES] = {
+	NEG_DNS_TTL, NEG_CONNECT_TTL, NEG_404_TTL, NEG_5XX_TTL
+};
+static const char* class_names[NEG_CLASSES] = {
+	"dns", "connect", "404", "5xx"
+};
+
+/* Table, under neg_lock */
+static neg_entry_t* buckets[NEG_BUCKETS];
+static int entries;
+static pthread_mutex_t neg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics, under neg_lock */
+static uint64_t recorded[NEG_CLASSES];
+static uint64_t hits[NEG_CLASSES];
+static uint64_t dropped;
+
+/*
+ * neg_set_ttl: sets how long one class of failure is remembered,
+ * from class=secs with class dns, connect, 404 or 5xx. Returns -1
+ * if it is malformed.
+ */
+int neg_set_ttl(const char* spec)
+{
+	const char* eq = strchr(spec, '=');
+	char* end;
+	long secs;
+	int i;
+
+	if (eq == NULL)
+		return -1;
+	secs = strtol(eq + 1, &end, 10);
+	if (*end != 0 || end == eq + 1 || secs < 0)
+		return -1;
+	for (i = 0; i < NEG_CLASSES; i++)
+		if (strlen(class_names[i]) == (size_t)(eq - spec) &&
+			strncmp(spec, class_names[i], eq - spec) == 0)
+		{
+			ttl[i] = secs;
+			return 0;
+		}
+	return -1;
+}
+
+/* neg_origin_key: writes the key of an origin, host:port lowercased */
+void neg_origin_key(char* out, size_t len, const char* host, int port)
+{
+	size_t i;
+
+	snprintf(out, len, "%s:%d", host, port);
+	for (i = 0; out[i]; i++)
+		out[i] = tolower((unsigned char)out[i]);
+}
+
+/* Unlinks and frees an entry. Must hold neg_lock. */
+static void drop(neg_entry_t** pp)
+{
+	neg_entry_t* e = *pp;
+
+	*pp = e->next;
+	Free(e->key);
+	Free(e);
+	entries--;
+}
+
+/* Drops every expired entry. Must hold neg_lock. */
+static void sweep(time_t now)
+{
+	neg_entry_t** pp;
+	int i;
+
+	for (i = 0; i < NEG_BUCKETS; i++)
+		for (pp = &buckets[i]; *pp != NULL; )
+		{
+			if ((*pp)->expires <= now)
+				drop(pp);
+			else
+				pp = &(*pp)->next;
+		}
+}
+
+/*
+ * neg_record: remembers a failure of class cls for key, with the
+ * status and reason phrase to answer with. Returns 1 if it was
+ * recorded, 0 if the class is off or the table is full.
+ */
+int neg_record(const char* key, int cls, int status, const char* reason)
+{
+	uint64_t hash = hash_bytes(key, strlen(key));
+	time_t now = time(NULL);
+	neg_entry_t** pp;
+	neg_entry_t* e;
+
+	if (ttl[cls] == 0)
+		return 0;
+
+	pthread_mutex_lock(&neg_lock);
+
+	/* A newer failure replaces the one there */
+	for (pp = &buckets[hash & (NEG_BUCKETS - 1)]; *pp != NULL; 
+		 pp = &(*pp)->next)
+		if ((*pp)->hash == hash && strcmp((*pp)->key, key) == 0)
+		{
+			drop(pp);
+			break;
+		}
+
+	if (entries >= NEG_MAX_ENTRIES)
+		sweep(now);
+	if (entries >= NEG_MAX_ENTRIES)
+	{
+		dropped++;
+		pthread_mutex_unlock(&neg_lock);
+		return 0;
+	}
+
+	e = Malloc(sizeof(neg_entry_t));
+	e->hash = hash;
+	e->key = Malloc(strlen(key) + 1);
+	strcpy(e->key, key);
+	e->cls = cls;
+	e->status = status;
+	snprintf(e->reason, NEG_REASON_LEN, "%s", reason ? reason : "");
+	e->expires = now + ttl[cls];
+	pp = &buckets[hash & (NEG_BUCKETS - 1)];
+	e->next = *pp;
+	*pp = e;
+	entries++;
+	recorded[cls]++;
+	pthread_mutex_unlock(&neg_lock);
+	return 1;
+}
+
+/*
+ * neg_response: remembers an upstream response for key if it is a
+ * 404 or a server error that may be stored. Returns 1 if it was.
+ */
+int neg_response(const char* key, http_response_t* resp)
+{
+	char line[MAXLINE];
+	char reason[NEG_REASON_LEN];
+	size_t n;
+
+	if (resp->no_store || (resp->status != 404 && 
+		(resp->status < 500 || resp->status > 599)))
+		return 0;
+
+	/* The reason phrase follows the status code */
+	n = resp->hdr.head->len < sizeof(line) - 1 ? resp->hdr.head->len :
+		sizeof(line) - 1;
+	memcpy(line, resp->hdr.head->data, n);
+	line[n] = 0;
+	if (sscanf(line, "%*s %*d %63[^\r\n]", reason) != 1)
+		strcpy(reason, "Upstream Error");
+	return neg_record(key, resp->status == 404 ? NEG_404 : NEG_5XX,
+		              resp->status, reason);
+}
+
+/*
+ * neg_lookup: finds a remembered failure for key. Returns its
+ * class, with its status and reason phrase (NEG_REASON_LEN bytes)
+ * if asked for, or -1 if there is none.
+ */
+int neg_lookup(const char* key, int* status, char* reason)
+{
+	uint64_t hash = hash_bytes(key, strlen(key));
+	time_t now = time(NULL);
+	neg_entry_t** pp;
+	int cls = -1;
+
+	pthread_mutex_lock(&neg_lock);
+	for (pp = &buckets[hash & (NEG_BUCKETS - 1)]; *pp != NULL; )
+	{
+		neg_entry_t* e = *pp;
+		if (e->expires <= now)
+		{
+			drop(pp);
+			continue;
+		}
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+		{
+			cls = e->cls;
+			if (status != NULL)
+				*status = e->status;
+			if (reason != NULL)
+				strcpy(reason, e->reason);
+			hits[cls]++;
+			break;
+		}
+		pp = &e->next;
+	}
+	pthread_mutex_unlock(&neg_lock);
+	return cls;
+}
+
+/* neg_report: writes negative cache statistics into out */
+size_t neg_report(char* out, size_t len)
+{
+	size_t n;
+	int i;
+
+	pthread_mutex_lock(&neg_lock);
+	n = snprintf(out, len, "negative: entries=%d dropped=%lu", entries,
+		         (unsigned long)dropped);
+	for (i = 0; i < NEG_CLASSES && n < len; i++)
+		n += snprintf(out + n, len - n, " %s_recorded=%lu %s_hits=%lu "
+			          "%s_ttl=%d", class_names[i], (unsigned long)recorded[i],
+			          class_names[i], (unsigned long)hits[i], class_names[i],
+			          ttl[i]);
+	if (n < len)
+		n += snprintf(out + n, len - n, "\r\n");
+	pthread_mutex_unlock(&neg_lock);
+	return n < len ? n : len;
+}
@@ -0,0 +1,46 @@
+/*
+ * neg.h - Negative cache. Origins that recently failed to resolve
+ *         or accept a connection, and URLs that recently answered
+ *         404 or 5xx, are remembered for a short time per class of
+ *         failure, so requests get a canned error at once instead
+ *         of trying again.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __NEG_H__
+#define __NEG_H__
+
+#include "http.h"
+
+/* Classes of failure */
+#define NEG_DNS     0  /* host name did not resolve */
+#define NEG_CONNECT 1  /* no connection to the origin */
+#define NEG_404     2  /* Not Found */
+#define NEG_5XX     3  /* server errors */
+#define NEG_CLASSES 4
+
+/* Default seconds a failure is remembered */
+#define NEG_DNS_TTL     30
+#define NEG_CONNECT_TTL 5
+#define NEG_404_TTL     30
+#define NEG_5XX_TTL     5
+
+/* Buckets of the table (a power of two) and most entries kept */
+#define NEG_BUCKETS 1024
+#define NEG_MAX_ENTRIES 4096
+
+/* Longest reason phrase kept for a canned error */
+#define NEG_REASON_LEN 64
+
+int neg_set_ttl(const char* spec);
+void neg_origin_key(char* out, size_t len, const char* host, int port);
+int neg_record(const char* key, int cls, int status, const char* reason);
+int neg_response(const char* key, http_response_t* resp);
+int neg_lookup(const char* key, int* status, char* reason);
+size_t neg_report(char* out, size_t len);
+
+#endif /* __NEG_H__ */
@@ -0,0 +1,276 @@
+/*
+ * parsetest - Checks the parsers the proxy relies on without a
+ *             network: cache key canonicalisation, Range parsing
+ *             and merging, conditional request matching, Vary
+ *             normalisation and variants, and the framing of
+ *             response bodies, chunked or by Content-Length.
+ *             Prints each failed check and exits non-zero if there
+ *             was one.
+ *
+ *             usage: make check
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "cachekey.h"
+#include "range.h"
+#include "cond.h"
+#include "vary.h"
+#include "http.h"
+
+static int checks;
+static int failed;
+
+/* Counts a check, printing it if it failed */
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char* what, int line)
+{
+	checks++;
+	if (ok)
+		return;
+	failed++;
+	printf("parsetest.c:%d: failed: %s\n", line, what);
+}
+
+/* Whether path on host:port has the key want */
+static int key_is(const char* host, int port, const char* path,
+	              const char* want)
+{
+	cache_key_t key;
+
+	if (make_cache_key(&key, "http", host, port, path) < 0)
+		return 0;
+	if (strcmp(key.str, want) != 0)
+	{
+		printf("  key of %s is %s, not %s\n", path, key.str, want);
+		return 0;
+	}
+	return key.len == strlen(want) &&
+		   key.hash == hash_bytes(want, strlen(want));
+}
+
+static void test_cachekey()
+{
+	CHECK(key_is("Example.COM.", 80, "/a/./b/../c?x=1#frag",
+		         "http://example.com/a/c?x=1"));
+	CHECK(key_is("example.com", 8080, "", "http://example.com:8080/"));
+	CHECK(key_is("h", 80, "/%7euser/%2f%41", "http://h/~user/%2FA"));
+	CHECK(key_is("h", 80, "/a/b/../../../c", "http://h/c"));
+	CHECK(key_is("h", 80, "/a?", "http://h/a"));
+
+	cachekey_strip_param("utm");
+	cachekey_sort_query(1);
+	CHECK(key_is("h", 80, "/p?b=2&utm=x&a=1", "http://h/p?a=1&b=2"));
+	CHECK(key_is("h", 80, "/p?utm", "http://h/p"));
+	cachekey_sort_query(0);
+	CHECK(key_is("h", 80, "/p?b=2&a=1", "http://h/p?b=2&a=1"));
+}
+
+/* Whether value parses for total bytes into rc and the given ranges,
+   given as first, last pairs */
+static int ranges_are(const char* value, long total, int rc, int n, ...)
+{
+	range_set_t rs;
+	va_list ap;
+	int i, ok;
+
+	if (range_parse(value, total, &rs) != rc || (rc >= 0 && rs.n != n))
+		return 0;
+	va_start(ap, n);
+	for (i = 0, ok = 1; i < n; i++)
+	{
+		long first = va_arg(ap, long), last = va_arg(ap, long);
+		ok &= rs.r[i].first == first && rs.r[i].last == last;
+	}
+	va_end(ap);
+	return ok;
+}
+
+static void test_range()
+{
+	CHECK(ranges_are("bytes=0-9", 100, 1, 1, 0L, 9L));
+	CHECK(ranges_are("bytes=-10", 100, 1, 1, 90L, 99L));
+	CHECK(ranges_are("bytes=90-", 100, 1, 1, 90L, 99L));
+	CHECK(ranges_are("bytes=95-200", 100, 1, 1, 95L, 99L));
+	CHECK(ranges_are("bytes=-500", 100, 1, 1, 0L, 99L));
+	CHECK(ranges_are("bytes=50-, 0-9,5-20", 100, 1, 2, 0L, 20L,
+		             50L, 99L));
+	CHECK(ranges_are("bytes=0-9,10-19", 100, 1, 1, 0L, 19L));
+	CHECK(ranges_are("bytes=200-", 100, 0, 0));
+	CHECK(ranges_are("bytes=9-3", 100, -1, 0));
+	CHECK(ranges_are("items=0-1", 100, -1, 0));
+	CHECK(ranges_are("bytes=0-9,x", 100, -1, 0));
+	CHECK(ranges_are("bytes=-", 100, -1, 0));
+}
+
+/* Whether a request with these validators matches the stored hdr */
+static int cond_is(const char* inm, const char* ims, bufchain_t* hdr)
+{
+	http_request_t req;
+	int rc;
+
+	http_request_init(&req, METHOD_GET);
+	snprintf(req.if_none_match, HTTP_RANGE_LEN, "%s", inm);
+	snprintf(req.if_modified_since, HTTP_TYPE_LEN, "%s", ims);
+	rc = cond_match(&req, hdr);
+	http_request_release(&req);
+	return rc;
+}
+
+static void test_cond()
+{
+	const char* stored = "HTTP/1.0 200 OK\r\nETag: \"abc\"\r\n"
+		"Last-Modified: Tue, 15 Nov 1994 08:12:31 GMT\r\n\r\n";
+	bufchain_t hdr;
+
+	bufchain_init(&hdr);
+	bufchain_append(&hdr, stored, strlen(stored));
+
+	CHECK(cond_is("\"abc\"", "", &hdr) == 1);
+	CHECK(cond_is("W/\"abc\"", "", &hdr) == 1);
+	CHECK(cond_is("\"x\", \"abc\"", "", &hdr) == 1);
+	CHECK(cond_is("*", "", &hdr) == 1);
+	CHECK(cond_is("\"abcd\"", "", &hdr) == 0);
+	CHECK(cond_is("\"ab\"", "", &hdr) == 0);
+
+	/* If-None-Match wins over If-Modified-Since */
+	CHECK(cond_is("\"x\"", "Tue, 15 Nov 1994 08:12:31 GMT", &hdr) == 0);
+
+	CHECK(cond_is("", "Tue, 15 Nov 1994 08:12:31 GMT", &hdr) == 1);
+	CHECK(cond_is("", "Wed, 16 Nov 1994 00:00:00 GMT", &hdr) == 1);
+	CHECK(cond_is("", "Mon, 14 Nov 1994 08:12:31 GMT", &hdr) == 0);
+	CHECK(cond_is("", "yesterday", &hdr) == 0);
+	CHECK(cond_is("", "Tue, 15 Nov 1994 08:12:31 GMT junk", &hdr) == 0);
+	CHECK(cond_is("", "", &hdr) == 0);
+	bufchain_release(&hdr);
+}
+
+static void test_vary()
+{
+	char names[MAXLINE];
+
+	CHECK(vary_names("Accept-Language, cookie,Accept-Language", 0,
+		             names, sizeof(names)) == 2 &&
+		  strcmp(names, "accept-language,cookie") == 0);
+	CHECK(vary_names("Accept-Encoding, Cookie", 1, names,
+		             sizeof(names)) == 1 && strcmp(names, "cookie") == 0);
+	CHECK(vary_names("*", 0, names, sizeof(names)) < 0);
+
+	/* Header order, name case and other headers do not matter */
+	CHECK(vary_variant("accept-language,cookie",
+		               "Cookie: a=1\r\nHost: h\r\nAccept-Language: en\r\n") ==
+		  vary_variant("accept-language,cookie",
+		               "accept-language: en\r\ncookie: a=1\r\n"));
+	CHECK(vary_variant("accept-language", "Accept-Language: en\r\n") !=
+		  vary_variant("accept-language", "Accept-Language: de\r\n"));
+	CHECK(vary_variant("accept-language", "Accept-Language: en\r\n") !=
+		  vary_variant("accept-language", "Host: h\r\n"));
+	CHECK(vary_match("cookie", vary_variant("cookie", "Cookie: a\r\n"),
+		             "Host: h\r\nCookie: a\r\n"));
+}
+
+/*
+ * Reads the response in wire through http_read_response and
+ * http_read_body into body. Returns the body length, or -1 if the
+ * header or the body was rejected.
+ */
+static long decode(const char* wire, char* body, size_t len)
+{
+	http_response_t resp;
+	rio_t rp;
+	int fds[2];
+	long total = 0;
+	ssize_t n;
+
+	if (pipe(fds) < 0)
+	{
+		printf("pipe failed\n");
+		exit(1);
+	}
+	if (write(fds[1], wire, strlen(wire)) != (ssize_t)strlen(wire))
+	{
+		printf("write failed\n");
+		exit(1);
+	}
+	close(fds[1]);
+
+	rio_readinitb(&rp, fds[0]);
+	if (http_read_response(&rp, &resp) < 0)
+		total = -1;
+	else
+	{
+		while ((n = http_read_body(&rp, &resp, body + total,
+			                       len - 1 - total)) > 0)
+			total += n;
+		if (n < 0)
+			total = -1;
+		http_response_release(&resp);
+	}
+	if (total >= 0)
+		body[total] = 0;
+	rio_releaseb(&rp);
+	close(fds[0]);
+	return total;
+}
+
+static void test_framing()
+{
+	char body[MAXLINE];
+
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "5;ext=1\r\nhello\r\n6 \r\n world\r\n0\r\n"
+		         "Trailer: x\r\n\r\n", body, sizeof(body)) == 11 &&
+		  strcmp(body, "hello world") == 0);
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "A\r\n0123456789\r\n0\r\n\r\n", body, sizeof(body)) == 10);
+
+	/* Malformed sizes, a missing CRLF after the data, a cut body */
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "5\r\nhello\r\nzz\r\n\r\n", body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "5x\r\nhello\r\n0\r\n\r\n", body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "\r\nhello\r\n0\r\n\r\n", body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "5\r\nhelloXX\r\n0\r\n\r\n", body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		         "5\r\nhello\r\n", body, sizeof(body)) == -1);
+
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+		         body, sizeof(body)) == 5 && strcmp(body, "hello") == 0);
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: 5\r\n"
+		         "Content-Length: 5\r\n\r\nhello", body, sizeof(body)) == 5);
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: 9\r\n\r\nhello",
+		         body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: abc\r\n\r\nhello",
+		         body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: 5x\r\n\r\nhello",
+		         body, sizeof(body)) == -1);
+	CHECK(decode("HTTP/1.0 200 OK\r\nContent-Length: 5\r\n"
+		         "Content-Length: 3\r\n\r\nhello", body, sizeof(body)) == -1);
+
+	/* Until close, and no body at all */
+	CHECK(decode("HTTP/1.0 200 OK\r\n\r\nhello", body, sizeof(body)) == 5);
+	CHECK(decode("HTTP/1.0 304 Not Modified\r\nContent-Length: 5\r\n\r\n",
+		         body, sizeof(body)) == 0);
+	CHECK(decode("garbage\r\n\r\n", body, sizeof(body)) == -1);
+}
+
+int main()
+{
+	test_cachekey();
+	test_range();
+	test_cond();
+	test_vary();
+	test_framing();
+
+	printf("%d checks, %d failed\n", checks, failed);
+	return failed != 0;
+}
@@ -0,0 +1,445 @@
+/*
+ * percore - Per-core listeners, pinned workers and key shards.
+ *           Workers accept straight from their CPU's listener, and
+ *           serve what they accept unless the key belongs to another
+ *           CPU, in which case the request is put on the ring from
+ *           their CPU to that one and its workers are woken through
+ *           an eventfd. The workers of a CPU take turns on its ends
+ *           of the rings with locks of its own, so the only lines
+ *           two CPUs share are the ring between them.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include "percore.h"
+#include "cache.h"
+#include "hot.h"
+#include "bufpool.h"
+#include "relay.h"
+#include "epoch.h"
+
+/* A request on its way to the CPU owning its key */
+typedef struct handoff
+{
+	rio_t rp;          /* its connection and what was read ahead */
+	char* request;     /* its first line, pooled */
+} handoff_t;
+
+/* A ring from one CPU to another; each end on a line of its own */
+typedef struct ring
+{
+	_Atomic uint32_t head;      /* next slot the consumer takes */
+	char pad1[64 - sizeof(uint32_t)];
+	_Atomic uint32_t tail;      /* next slot the producer fills */
+	char pad2[64 - sizeof(uint32_t)];
+	handoff_t* slots[PERCORE_RING];
+} __attribute__((aligned(64))) ring_t;
+
+/* A CPU, its listener and its ends of the rings, on lines of its own */
+typedef struct core
+{
+	int cpu;                    /* CPU its workers are pinned to */
+	int listenfd;
+	int wakefd;                 /* eventfd written after a handoff */
+	int next_from;              /* ring its workers look at first */
+	pthread_mutex_t send_lock;  /* its workers' turns at producing */
+	pthread_mutex_t recv_lock;  /* and at consuming */
+	_Atomic uint64_t accepted;  /* connections its workers took */
+	_Atomic uint64_t handed_out; /* requests sent to their owner */
+	_Atomic uint64_t handed_in; /* requests taken from other CPUs */
+	_Atomic uint64_t ring_full; /* requests served here for want of
+	                               room on the ring */
+} __attribute__((aligned(64))) core_t;
+
+static core_t cores[PERCORE_MAX];
+static int ncores;
+static int per_core;
+static int steered;
+static percore_serve_t serve_conn;
+static percore_resume_t resume_conn;
+static _Atomic int stopped;
+
+/* Rings, the one from CPU i to CPU j at i * ncores + j */
+static ring_t* rings;
+
+/* CPU of the calling worker, NULL outside of per-core workers */
+static __thread core_t* self;
+
+/*
+ * open_reuseport_listenfd: open_listenfd, but on a socket that may
+ * share its port with the others of the group. It does not block,
+ * since the workers of a CPU poll it together.
+ */
+static int open_reuseport_listenfd(int port)
+{
+	int listenfd, optval = 1;
+	struct sockaddr_in serveraddr;
+
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+		           (const void *)&optval, sizeof(int)) < 0 ||
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+		           (const void *)&optval, sizeof(int)) < 0 ||
+		fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0)
+	{
+		close(listenfd);
+		return -1;
+	}
+
+	bzero((char *) &serveraddr, sizeof(serveraddr));
+	serveraddr.sin_family = AF_INET;
+	serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serveraddr.sin_port = htons((unsigned short)port);
+	if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+		listen(listenfd, LISTENQ) < 0)
+	{
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+/*
+ * steer: attaches a program to the group of listenfd that picks the
+ * listener of the CPU handling the incoming connection. Listeners
+ * are indexed in the order they joined the group, the order of
+ * cores, so the program maps the CPU number to its index; a CPU
+ * without a listener gets an index past them all, which leaves the
+ * choice to the kernel's hash. Returns -1 if the kernel will not
+ * take it.
+ */
+static int steer(int listenfd)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[2 * PERCORE_MAX + 2];
+	struct sock_fprog prog;
+	int i, n = 0;
+
+	code[n++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (i = 0; i < ncores; i++)
+	{
+		code[n++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cores[i].cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ncores);
+	prog.len = n;
+	prog.filter = code;
+
+	return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		              &prog, sizeof(prog));
+#else
+	(void)listenfd;
+	return -1;
+#endif
+}
+
+/* Puts h on ring r; returns -1 if it is full. One producer at a time */
+static int ring_push(ring_t* r, handoff_t* h)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&r->head, memory_order_acquire) ==
+		PERCORE_RING)
+		return -1;
+	r->slots[tail & (PERCORE_RING - 1)] = h;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+/* Takes the oldest request off ring r, NULL if none. One consumer
+   at a time */
+static handoff_t* ring_pop(ring_t* r)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	handoff_t* h;
+
+	if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+		return NULL;
+	h = r->slots[head & (PERCORE_RING - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return h;
+}
+
+/* Serves the requests other CPUs handed to c, one at a time */
+static void drain(core_t* c)
+{
+	int me = c - cores, i;
+	handoff_t* h;
+
+	while (1)
+	{
+		h = NULL;
+		pthread_mutex_lock(&c->recv_lock);
+		for (i = 0; i < ncores && h == NULL; i++)
+			h = ring_pop(&rings[((c->next_from + i) % ncores) * ncores +
+				                me]);
+		c->next_from = (c->next_from + 1) % ncores;
+		pthread_mutex_unlock(&c->recv_lock);
+		if (h == NULL)
+			return;
+
+		atomic_fetch_add_explicit(&c->handed_in, 1, memory_order_relaxed);
+		resume_conn(&h->rp, h->request);
+		pool_free(h->request);
+		pool_free(h);
+	}
+}
+
+/*
+ * A worker: pinned to its CPU, serves what its listener accepts and
+ * what other CPUs hand over
+ */
+static void* core_worker(void* vargp)
+{
+	core_t* c = vargp;
+	cpu_set_t set;
+	struct pollfd pfd[2];
+	uint64_t n;
+	int connfd;
+
+	Pthread_detach(pthread_self());
+	CPU_ZERO(&set);
+	CPU_SET(c->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		printf("Could not pin a worker to CPU %d.\n", c->cpu);
+	hot_enable();
+	self = c;
+
+	pfd[0].fd = c->listenfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = c->wakefd;
+	pfd[1].events = POLLIN;
+	while (!atomic_load(&stopped))
+	{
+		if (poll(pfd, 2, -1) < 0)
+			continue;
+
+		/* Reset the eventfd before draining, so that a request
+		   handed over meanwhile wakes it again */
+		if (pfd[1].revents & POLLIN)
+		{
+			if (read(c->wakefd, &n, sizeof(n)) < 0)
+				n = 0;
+			drain(c);
+		}
+		if (pfd[0].revents == 0)
+			continue;
+
+		if ((connfd = accept(c->listenfd, NULL, NULL)) < 0)
+		{
+			/* Out of descriptors: the connection stays queued and
+			   poll reports it again at once, so wait for some to be
+			   closed. Anything else, like another worker having
+			   taken it, just means going back to poll */
+			if (errno == EMFILE || errno == ENFILE ||
+				errno == ENOBUFS || errno == ENOMEM)
+				usleep(PERCORE_BACKOFF_US);
+			continue;
+		}
+		atomic_fetch_add_explicit(&c->accepted, 1, memory_order_relaxed);
+		serve_conn(connfd);
+	}
+
+	/* Serve what was handed over already, then hand back the hot
+	   cache, buffers and epoch slot */
+	drain(c);
+	self = NULL;
+	hot_thread_release();
+	pool_thread_release();
+	relay_thread_release();
+	epoch_thread_release();
+	return NULL;
+}
+
+/*
+ * percore_open: opens a listener on port for every CPU the proxy may
+ * run on. With steer_cpu, connections go to the listener of the CPU
+ * that received them. Returns the number of CPUs, or -1 if there is
+ * none or a listener could not be opened.
+ */
+int percore_open(int port, int steer_cpu)
+{
+	cpu_set_t allowed;
+	int cpu, i, failed = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE && ncores < PERCORE_MAX; cpu++)
+	{
+		core_t* c = &cores[ncores];
+
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if ((c->listenfd = open_reuseport_listenfd(port)) < 0)
+		{
+			failed = 1;
+			break;
+		}
+		if ((c->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		{
+			close(c->listenfd);
+			failed = 1;
+			break;
+		}
+		if (pthread_mutex_init(&c->send_lock, NULL) ||
+			pthread_mutex_init(&c->recv_lock, NULL))
+		{
+			printf("Failed to initialize a per-core lock.\n");
+			exit(0);
+		}
+		c->cpu = cpu;
+		ncores++;
+	}
+
+	/* All or nothing */
+	if (ncores == 0 || failed)
+	{
+		for (i = 0; i < ncores; i++)
+		{
+			close(cores[i].listenfd);
+			close(cores[i].wakefd);
+		}
+		ncores = 0;
+		return -1;
+	}
+
+	if (posix_memalign((void**)&rings, 64,
+		               ncores * ncores * sizeof(ring_t)))
+	{
+		printf("Failed to allocate the per-core rings.\n");
+		exit(0);
+	}
+	memset(rings, 0, ncores * ncores * sizeof(ring_t));
+
+	if (steer_cpu)
+	{
+		if (steer(cores[0].listenfd) == 0)
+			steered = 1;
+		else
+			printf("Could not attach the steering program, "
+				   "the kernel spreads connections by hash.\n");
+	}
+	return ncores;
+}
+
+/*
+ * percore_start: starts threads workers pinned to each CPU, which
+ * pass the connections they accept to serve and the requests other
+ * CPUs hand over to resume
+ */
+void percore_start(int threads, percore_serve_t serve,
+	               percore_resume_t resume)
+{
+	pthread_t tid;
+	int i, t;
+
+	serve_conn = serve;
+	resume_conn = resume;
+	per_core = threads;
+	for (i = 0; i < ncores; i++)
+		for (t = 0; t < threads; t++)
+			Pthread_create(&tid, NULL, core_worker, &cores[i]);
+}
+
+/*
+ * percore_handoff: hands a request for the key with this hash to the
+ * CPU that owns the key, if that is not the calling worker's. rp and
+ * the first line of the request, read from it, go along; on success
+ * the caller must leave both alone. Returns 0 if the caller is to
+ * serve it itself: outside of per-core workers, for its own keys and
+ * when the ring is full.
+ */
+int percore_handoff(uint64_t hash, rio_t* rp, char* request)
+{
+	int from, to, full;
+	uint64_t one = 1;
+	handoff_t* h;
+	size_t len;
+
+	if (self == NULL || ncores < 2)
+		return 0;
+	from = self - cores;
+	to = cache_shard_of(hash);
+	if (to == from)
+		return 0;
+
+	len = strlen(request) + 1;
+	h = pool_alloc(sizeof(handoff_t));
+	h->rp = *rp;
+	h->request = pool_alloc(len);
+	memcpy(h->request, request, len);
+
+	pthread_mutex_lock(&self->send_lock);
+	full = ring_push(&rings[from * ncores + to], h) < 0;
+	pthread_mutex_unlock(&self->send_lock);
+	if (full)
+	{
+		pool_free(h->request);
+		pool_free(h);
+		atomic_fetch_add_explicit(&self->ring_full, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	atomic_fetch_add_explicit(&self->handed_out, 1, memory_order_relaxed);
+	if (write(cores[to].wakefd, &one, sizeof(one)) < 0)
+		printf("Could not wake the workers of CPU %d.\n", cores[to].cpu);
+	return 1;
+}
+
+/*
+ * percore_stop: stops accepting; workers finish the connection they
+ * are serving and what was handed to them, and exit
+ */
+void percore_stop()
+{
+	uint64_t one = 1;
+	int i;
+
+	atomic_store(&stopped, 1);
+	for (i = 0; i < ncores; i++)
+	{
+		shutdown(cores[i].listenfd, SHUT_RDWR);
+		if (write(cores[i].wakefd, &one, sizeof(one)) < 0)
+			continue;
+	}
+}
+
+/* percore_report: writes per-core statistics into out, returns length */
+size_t percore_report(char* out, size_t len)
+{
+	uint64_t out_n = 0, in_n = 0, full = 0;
+	size_t n;
+	int i;
+
+	if (ncores == 0)
+		return 0;
+	for (i = 0; i < ncores; i++)
+	{
+		out_n += atomic_load(&cores[i].handed_out);
+		in_n += atomic_load(&cores[i].handed_in);
+		full += atomic_load(&cores[i].ring_full);
+	}
+	n = snprintf(out, len, "percore: cores=%d threads_per_core=%d "
+		         "steering=%s handed_out=%lu handed_in=%lu ring_full=%lu "
+		         "accepted=", ncores, per_core,
+		         steered ? "cbpf" : "hash", (unsigned long)out_n,
+		         (unsigned long)in_n, (unsigned long)full);
+	for (i = 0; i < ncores && n < len; i++)
+		n += snprintf(out + n, len - n, "%s%lu", i ? "," : "",
+			(unsigned long)atomic_load(&cores[i].accepted));
+	if (n < len)
+		n += snprintf(out + n, len - n, "\r\n");
+	return n < len ? n : len;
+}
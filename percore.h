@@ -0,0 +1,54 @@
+/*
+ * percore.h - Per-core serving. Every allowed CPU gets a listening
+ *             socket of its own on the proxy's port, bound with
+ *             SO_REUSEPORT so the kernel spreads connections over
+ *             them with no shared accept queue, and a group of
+ *             workers pinned to it, each with its own hot cache.
+ *             Optionally a classic BPF program hands each connection
+ *             to the listener of the CPU that received it.
+ *
+ *             Each CPU owns a shard of the cache (see cache.h): the
+ *             keys whose hash picks it, with an index, policy lists,
+ *             hosts, capacity share and reclaimer of their own, and
+ *             only its workers look up, fetch and store them. A
+ *             request for a key another CPU owns is handed to it
+ *             through a lock-free single-producer single-consumer
+ *             ring for that pair of CPUs, so a block, its shard and
+ *             its hot cache entries stay with one CPU. A request
+ *             that finds the ring full is served where it is, under
+ *             the owner shard's locks.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __PERCORE_H__
+#define __PERCORE_H__
+
+#include "csapp.h"
+
+/* Most CPUs served */
+#define PERCORE_MAX 256
+
+/* Requests a ring between two CPUs holds (a power of two) */
+#define PERCORE_RING 32
+
+/* Microseconds a worker waits when it is out of descriptors */
+#define PERCORE_BACKOFF_US 10000
+
+/* Serves one accepted connection and closes it */
+typedef void (*percore_serve_t)(int connfd);
+
+/* Serves a handed over request whose first line was read from rp */
+typedef void (*percore_resume_t)(rio_t* rp, char* request);
+
+int percore_open(int port, int steer_cpu);
+void percore_start(int threads, percore_serve_t serve,
+	               percore_resume_t resume);
+int percore_handoff(uint64_t hash, rio_t* rp, char* request);
+void percore_stop();
+size_t percore_report(char* out, size_t len);
+
+#endif /* __PERCORE_H__ */
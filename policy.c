@@ -0,0 +1,752 @@
+/*
+ * policy - Built-in eviction policies: LRU, SLRU, ARC, S3-FIFO
+ *          and GDSF. Blocks are kept on doubly linked lists through
+ *          their prev/next fields, with cb->list naming the list they
+ *          are on; GDSF keeps them in a heap instead. ARC and
+ *          S3-FIFO also remember recently evicted keys in ghost
+ *          lists, which hold only a hash and a size.
+ *          Sizes are in bytes, since objects vary a lot in size.
+ *
+ *          Hits may come with no lock held, so they only mark the
+ *          block through its freq, writing it only when the mark
+ *          changes. Blocks are moved for their hits, the CLOCK way,
+ *          when they come up as victims.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "policy.h"
+
+/* Lists a block can be on */
+#define LIST_NONE      0
+#define LIST_LRU       1
+#define LIST_PROBATION 2
+#define LIST_PROTECTED 3
+#define LIST_T1        4
+#define LIST_T2        5
+#define LIST_SMALL     6
+#define LIST_MAIN      7
+
+/* Buckets of the ghost index (a power of two) */
+#define GHOST_BUCKETS 16384
+
+/* Max frequency S3-FIFO counts up to */
+#define S3_MAX_FREQ 3
+
+/* Max frequency GDSF counts up to */
+#define GDSF_MAX_FREQ 255
+
+/* Initial slots of the GDSF heap */
+#define GDSF_HEAP_INIT 1024
+
+/* Used blocks a victim search moves at most; past that the one it
+   is on goes, used or not, since hits keep marking blocks */
+#define VICTIM_MAX_SCAN 4096
+
+/* A list of blocks, most recently added at the head */
+typedef struct block_list
+{
+	cb_t* head;
+	cb_t* tail;
+	long bytes;
+} blist_t;
+
+/* A remembered eviction */
+typedef struct ghost
+{
+	uint64_t hash;
+	uint32_t size;
+	int list;               /* ghost list it is on */
+	struct ghost* prev;
+	struct ghost* next;
+	struct ghost* hnext;    /* next in ghost bucket */
+} ghost_t;
+
+/* A list of ghosts, most recent at the head */
+typedef struct ghost_list
+{
+	ghost_t* head;
+	ghost_t* tail;
+	long bytes;
+} glist_t;
+
+/* A policy's state over one cache shard; only the lists of the
+   policy that runs are used */
+struct policy_state
+{
+	long capacity;                  /* bytes of the shard */
+	ghost_t* ghosts[GHOST_BUCKETS]; /* ghost index of ARC and S3-FIFO */
+
+	blist_t lru;                    /* LRU */
+	blist_t probation;              /* SLRU */
+	blist_t protect;
+	blist_t t1;                     /* ARC */
+	blist_t t2;
+	glist_t b1;
+	glist_t b2;
+	long arc_p;
+	blist_t small;                  /* S3-FIFO */
+	blist_t main_fifo;
+	glist_t s3_ghost;
+	cb_t** heap;                    /* GDSF */
+	int heap_len;
+	int heap_cap;
+	double gdsf_clock;
+};
+
+/* Pushes a block at the head of a list */
+static void list_push(blist_t* l, cb_t* cb, int id)
+{
+	cb->prev = NULL;
+	cb->next = l->head;
+	if (l->head != NULL)
+		l->head->prev = cb;
+	else
+		l->tail = cb;
+	l->head = cb;
+	l->bytes += cb->size;
+	cb->list = id;
+}
+
+/* Unlinks a block from a list */
+static void list_unlink(blist_t* l, cb_t* cb)
+{
+	if (cb->prev != NULL)
+		cb->prev->next = cb->next;
+	else
+		l->head = cb->next;
+	if (cb->next != NULL)
+		cb->next->prev = cb->prev;
+	else
+		l->tail = cb->prev;
+	l->bytes -= cb->size;
+	cb->prev = cb->next = NULL;
+	cb->list = LIST_NONE;
+}
+
+/* Marks a block used; a block marked already is not written */
+static void mark_used(cb_t* cb)
+{
+	if (atomic_load_explicit(&cb->freq, memory_order_relaxed) == 0)
+		atomic_store_explicit(&cb->freq, 1, memory_order_relaxed);
+}
+
+/* Returns whether a block was used since last asked, and unmarks it */
+static int take_used(cb_t* cb)
+{
+	if (atomic_load_explicit(&cb->freq, memory_order_relaxed) == 0)
+		return 0;
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	return 1;
+}
+
+/* Looks up a ghost by hash, NULL if there is none */
+static ghost_t* ghost_find(policy_state_t* s, uint64_t hash)
+{
+	ghost_t* g;
+
+	for (g = s->ghosts[hash & (GHOST_BUCKETS - 1)]; g != NULL; g = g->hnext)
+		if (g->hash == hash)
+			return g;
+	return NULL;
+}
+
+/* Remembers an evicted block at the head of a ghost list */
+static void ghost_add(policy_state_t* s, glist_t* l, cb_t* cb, int id)
+{
+	ghost_t* g = pool_alloc(sizeof(ghost_t));
+	ghost_t** bucket = &s->ghosts[cb->hash & (GHOST_BUCKETS - 1)];
+
+	g->hash = cb->hash;
+	g->size = cb->size;
+	g->list = id;
+	g->hnext = *bucket;
+	*bucket = g;
+
+	g->prev = NULL;
+	g->next = l->head;
+	if (l->head != NULL)
+		l->head->prev = g;
+	else
+		l->tail = g;
+	l->head = g;
+	l->bytes += g->size;
+}
+
+/* Forgets a ghost */
+static void ghost_remove(policy_state_t* s, glist_t* l, ghost_t* g)
+{
+	ghost_t** pp = &s->ghosts[g->hash & (GHOST_BUCKETS - 1)];
+	while (*pp != g)
+		pp = &(*pp)->hnext;
+	*pp = g->hnext;
+
+	if (g->prev != NULL)
+		g->prev->next = g->next;
+	else
+		l->head = g->next;
+	if (g->next != NULL)
+		g->next->prev = g->prev;
+	else
+		l->tail = g->prev;
+	l->bytes -= g->size;
+	pool_free(g);
+}
+
+/* Drops the oldest ghosts until a list is within max bytes */
+static void ghost_trim(policy_state_t* s, glist_t* l, long max)
+{
+	while (l->tail != NULL && l->bytes > max)
+		ghost_remove(s, l, l->tail);
+}
+
+/* Forgets every ghost on a list */
+static void ghost_clear(policy_state_t* s, glist_t* l)
+{
+	ghost_trim(s, l, -1);
+}
+
+/*
+ * LRU, as CLOCK: a single recency list. A hit marks the block, and
+ * a marked block that reaches the tail goes back to the head
+ * instead of being evicted.
+ */
+static void lru_init(policy_state_t* s, long cap)
+{
+	s->capacity = cap;
+	memset(&s->lru, 0, sizeof(s->lru));
+}
+
+static void lru_insert(policy_state_t* s, cb_t* cb)
+{
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	list_push(&s->lru, cb, LIST_LRU);
+}
+
+static void lru_hit(cb_t* cb)
+{
+	mark_used(cb);
+}
+
+static cb_t* lru_victim(policy_state_t* s)
+{
+	int n;
+
+	for (n = 0; n < VICTIM_MAX_SCAN && s->lru.tail != NULL && 
+		 take_used(s->lru.tail); n++)
+	{
+		cb_t* cb = s->lru.tail;
+		list_unlink(&s->lru, cb);
+		list_push(&s->lru, cb, LIST_LRU);
+	}
+	return s->lru.tail;
+}
+
+static void lru_remove(policy_state_t* s, cb_t* cb, int evicted)
+{
+	(void)evicted;
+	list_unlink(&s->lru, cb);
+}
+
+policy_t lru_policy =
+{
+	.name = "lru",
+	.init = lru_init,
+	.on_insert = lru_insert,
+	.on_hit = lru_hit,
+	.choose_victim = lru_victim,
+	.on_remove = lru_remove,
+};
+
+/*
+ * SLRU: new blocks enter a probation segment and move to a
+ * protected segment on their second use. The protected segment
+ * holds at most 80% of the bytes; its overflow is demoted back to
+ * probation. Victims come from probation first, so one-time scans
+ * cannot flush the protected blocks.
+ */
+static void slru_init(policy_state_t* s, long cap)
+{
+	s->capacity = cap;
+	memset(&s->probation, 0, sizeof(s->probation));
+	memset(&s->protect, 0, sizeof(s->protect));
+}
+
+static void slru_insert(policy_state_t* s, cb_t* cb)
+{
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	list_push(&s->probation, cb, LIST_PROBATION);
+}
+
+static void slru_hit(cb_t* cb)
+{
+	mark_used(cb);
+}
+
+/* 
+ * slru_demote: demotes the least recent protected blocks that do not
+ * fit, short of cb; used ones get another lap in protected instead
+ */
+static void slru_demote(policy_state_t* s, cb_t* cb, int* scanned)
+{
+	while (s->protect.bytes > s->capacity * 8 / 10 && s->protect.tail != cb)
+	{
+		cb_t* demoted = s->protect.tail;
+		list_unlink(&s->protect, demoted);
+		if (*scanned < VICTIM_MAX_SCAN && take_used(demoted))
+		{
+			(*scanned)++;
+			list_push(&s->protect, demoted, LIST_PROTECTED);
+		}
+		else
+			list_push(&s->probation, demoted, LIST_PROBATION);
+	}
+}
+
+/*
+ * slru_victim: promotes probation blocks used since they came in as
+ * they reach its tail, and returns the first unused one. Once
+ * probation is empty, used protected blocks get another lap.
+ */
+static cb_t* slru_victim(policy_state_t* s)
+{
+	cb_t* cb;
+	int n = 0;
+
+	while ((cb = s->probation.tail) != NULL && n < VICTIM_MAX_SCAN && 
+		   take_used(cb))
+	{
+		n++;
+		list_unlink(&s->probation, cb);
+		list_push(&s->protect, cb, LIST_PROTECTED);
+		slru_demote(s, cb, &n);
+	}
+	if (s->probation.tail != NULL)
+		return s->probation.tail;
+
+	while ((cb = s->protect.tail) != NULL && n < VICTIM_MAX_SCAN && 
+		   take_used(cb))
+	{
+		n++;
+		list_unlink(&s->protect, cb);
+		list_push(&s->protect, cb, LIST_PROTECTED);
+	}
+	return s->protect.tail;
+}
+
+static void slru_remove(policy_state_t* s, cb_t* cb, int evicted)
+{
+	(void)evicted;
+	list_unlink(cb->list == LIST_PROBATION ? &s->probation : &s->protect, cb);
+}
+
+policy_t slru_policy =
+{
+	.name = "slru",
+	.init = slru_init,
+	.on_insert = slru_insert,
+	.on_hit = slru_hit,
+	.choose_victim = slru_victim,
+	.on_remove = slru_remove,
+};
+
+/*
+ * ARC: T1 holds blocks seen once recently, T2 blocks seen at least
+ * twice. Ghost lists B1 and B2 remember what was evicted from each.
+ * A miss that hits a ghost in B1 means T1 was too small, so the
+ * target size p of T1 grows; one in B2 shrinks it. Victims come
+ * from T1 while it is over its target.
+ */
+static void arc_init(policy_state_t* s, long cap)
+{
+	s->capacity = cap;
+	s->arc_p = 0;
+	memset(&s->t1, 0, sizeof(s->t1));
+	memset(&s->t2, 0, sizeof(s->t2));
+	ghost_clear(s, &s->b1);
+	ghost_clear(s, &s->b2);
+}
+
+static void arc_insert(policy_state_t* s, cb_t* cb)
+{
+	ghost_t* g = ghost_find(s, cb->hash);
+	long delta;
+
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	if (g == NULL)
+	{
+		list_push(&s->t1, cb, LIST_T1);
+		return;
+	}
+
+	/* Adapt the target by the ratio of the ghost lists */
+	if (g->list == LIST_T1)
+	{
+		delta = s->b1.bytes >= s->b2.bytes ? (long)cb->size :
+			    (long)cb->size * s->b2.bytes / s->b1.bytes;
+		s->arc_p = s->arc_p + delta < s->capacity ? s->arc_p + delta :
+			       s->capacity;
+		ghost_remove(s, &s->b1, g);
+	}
+	else
+	{
+		delta = s->b2.bytes >= s->b1.bytes ? (long)cb->size :
+			    (long)cb->size * s->b1.bytes / s->b2.bytes;
+		s->arc_p = s->arc_p > delta ? s->arc_p - delta : 0;
+		ghost_remove(s, &s->b2, g);
+	}
+	list_push(&s->t2, cb, LIST_T2);
+}
+
+static void arc_hit(cb_t* cb)
+{
+	mark_used(cb);
+}
+
+/* The list victims come from now */
+static blist_t* arc_side(policy_state_t* s)
+{
+	return s->t1.tail != NULL && 
+		   (s->t1.bytes > s->arc_p || s->t2.tail == NULL) ? &s->t1 : &s->t2;
+}
+
+/*
+ * arc_victim: moves used blocks at the tail of the list victims
+ * come from to the head of T2, where their second use puts them,
+ * and returns the first unused one
+ */
+static cb_t* arc_victim(policy_state_t* s)
+{
+	blist_t* l;
+	cb_t* cb;
+	int n;
+
+	for (n = 0; n < VICTIM_MAX_SCAN; n++)
+	{
+		l = arc_side(s);
+		if ((cb = l->tail) == NULL || !take_used(cb))
+			return cb;
+		list_unlink(l, cb);
+		list_push(&s->t2, cb, LIST_T2);
+	}
+	return arc_side(s)->tail;
+}
+
+static void arc_remove(policy_state_t* s, cb_t* cb, int evicted)
+{
+	int from = cb->list;
+
+	list_unlink(from == LIST_T1 ? &s->t1 : &s->t2, cb);
+	if (!evicted)
+		return;
+
+	/* Remember it, keeping T1+B1 and the whole directory bounded */
+	ghost_add(s, from == LIST_T1 ? &s->b1 : &s->b2, cb, from);
+	ghost_trim(s, &s->b1, s->capacity - s->t1.bytes);
+	ghost_trim(s, &s->b2, 
+		       2 * s->capacity - s->t1.bytes - s->t2.bytes - s->b1.bytes);
+}
+
+policy_t arc_policy =
+{
+	.name = "arc",
+	.init = arc_init,
+	.on_insert = arc_insert,
+	.on_hit = arc_hit,
+	.choose_victim = arc_victim,
+	.on_remove = arc_remove,
+};
+
+/*
+ * S3-FIFO: new blocks enter a small FIFO of 10% of the bytes.
+ * Blocks used again by the time they reach its tail move to the
+ * main FIFO; the rest are evicted and remembered in a ghost FIFO,
+ * and a ghost that comes back goes straight to main. Main blocks
+ * that were used get another lap with their count decremented.
+ * Hits only bump a saturating counter.
+ */
+static void s3fifo_init(policy_state_t* s, long cap)
+{
+	s->capacity = cap;
+	memset(&s->small, 0, sizeof(s->small));
+	memset(&s->main_fifo, 0, sizeof(s->main_fifo));
+	ghost_clear(s, &s->s3_ghost);
+}
+
+static void s3fifo_insert(policy_state_t* s, cb_t* cb)
+{
+	ghost_t* g = ghost_find(s, cb->hash);
+
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	if (g != NULL)
+	{
+		ghost_remove(s, &s->s3_ghost, g);
+		list_push(&s->main_fifo, cb, LIST_MAIN);
+	}
+	else
+		list_push(&s->small, cb, LIST_SMALL);
+}
+
+static void s3fifo_hit(cb_t* cb)
+{
+	uint8_t f = atomic_load_explicit(&cb->freq, memory_order_relaxed);
+
+	/* Lost updates are harmless; the count is only a hint */
+	if (f < S3_MAX_FREQ)
+		atomic_store_explicit(&cb->freq, f + 1, memory_order_relaxed);
+}
+
+/*
+ * s3fifo_victim: moves blocks between the queues until the tail of
+ * one of them is unused, and returns it. Every lap through main
+ * lowers a count, so this ends.
+ */
+static cb_t* s3fifo_victim(policy_state_t* s)
+{
+	while (s->small.tail != NULL || s->main_fifo.tail != NULL)
+	{
+		cb_t* cb;
+
+		if (s->small.tail != NULL &&
+			(s->small.bytes >= s->capacity / 10 || s->main_fifo.tail == NULL))
+		{
+			cb = s->small.tail;
+			if (atomic_load_explicit(&cb->freq, memory_order_relaxed) == 0)
+				return cb;
+			list_unlink(&s->small, cb);
+			atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+			list_push(&s->main_fifo, cb, LIST_MAIN);
+		}
+		else
+		{
+			cb = s->main_fifo.tail;
+			uint8_t f = atomic_load_explicit(&cb->freq, memory_order_relaxed);
+			if (f == 0)
+				return cb;
+			list_unlink(&s->main_fifo, cb);
+			atomic_store_explicit(&cb->freq, f - 1, memory_order_relaxed);
+			list_push(&s->main_fifo, cb, LIST_MAIN);
+		}
+	}
+	return NULL;
+}
+
+static void s3fifo_remove(policy_state_t* s, cb_t* cb, int evicted)
+{
+	int from = cb->list;
+
+	list_unlink(from == LIST_SMALL ? &s->small : &s->main_fifo, cb);
+	if (evicted && from == LIST_SMALL)
+	{
+		ghost_add(s, &s->s3_ghost, cb, LIST_SMALL);
+		ghost_trim(s, &s->s3_ghost, s->capacity - s->capacity / 10);
+	}
+}
+
+policy_t s3fifo_policy =
+{
+	.name = "s3fifo",
+	.init = s3fifo_init,
+	.on_insert = s3fifo_insert,
+	.on_hit = s3fifo_hit,
+	.choose_victim = s3fifo_victim,
+	.on_remove = s3fifo_remove,
+};
+
+/*
+ * GDSF: Greedy-Dual-Size-Frequency. A block is worth
+ * L + freq * cost / size, where cost is its upstream fetch time,
+ * so small objects from slow origins that are used often stay and
+ * large, cheap, cold ones go first. L is raised to the worth of
+ * each victim, which ages blocks that stopped being used. Blocks
+ * sit in a binary min-heap on their worth, so operations are
+ * O(log n) rather than O(1). Hits only count; a block's worth is
+ * raised for them when it comes to the top of the heap.
+ */
+/* Puts a block in a heap slot */
+static void heap_set(policy_state_t* s, int i, cb_t* cb)
+{
+	s->heap[i] = cb;
+	cb->heap_index = i;
+}
+
+/* Moves the block at slot i up to its place */
+static void heap_up(policy_state_t* s, int i)
+{
+	cb_t* cb = s->heap[i];
+
+	while (i > 0 && s->heap[(i - 1) / 2]->priority > cb->priority)
+	{
+		heap_set(s, i, s->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(s, i, cb);
+}
+
+/* Moves the block at slot i down to its place */
+static void heap_down(policy_state_t* s, int i)
+{
+	cb_t* cb = s->heap[i];
+
+	while (2 * i + 1 < s->heap_len)
+	{
+		int c = 2 * i + 1;
+		if (c + 1 < s->heap_len && 
+			s->heap[c + 1]->priority < s->heap[c]->priority)
+			c++;
+		if (s->heap[c]->priority >= cb->priority)
+			break;
+		heap_set(s, i, s->heap[c]);
+		i = c;
+	}
+	heap_set(s, i, cb);
+}
+
+/* Worth of a block at the current clock */
+static double gdsf_priority(policy_state_t* s, cb_t* cb)
+{
+	/* A block that took no measurable time still costs a little */
+	double cost = cb->cost > 0 ? cb->cost : 1;
+
+	return s->gdsf_clock + cb->counted * cost / cb->size;
+}
+
+static void gdsf_init(policy_state_t* s, long cap)
+{
+	s->capacity = cap;
+	s->gdsf_clock = 0;
+	s->heap_len = 0;
+	s->heap_cap = GDSF_HEAP_INIT;
+	s->heap = Malloc(s->heap_cap * sizeof(cb_t*));
+}
+
+static void gdsf_insert(policy_state_t* s, cb_t* cb)
+{
+	if (s->heap_len == s->heap_cap)
+	{
+		s->heap_cap *= 2;
+		s->heap = Realloc(s->heap, s->heap_cap * sizeof(cb_t*));
+	}
+	atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+	cb->counted = 1;
+	cb->priority = gdsf_priority(s, cb);
+	heap_set(s, s->heap_len++, cb);
+	heap_up(s, cb->heap_index);
+}
+
+/* Counts a hit not yet added to the block's worth */
+static void gdsf_hit(cb_t* cb)
+{
+	uint8_t f = atomic_load_explicit(&cb->freq, memory_order_relaxed);
+
+	if (f < GDSF_MAX_FREQ)
+		atomic_store_explicit(&cb->freq, f + 1, memory_order_relaxed);
+}
+
+/*
+ * gdsf_victim: returns the least worth block, first raising the
+ * worth of those at the top that were used since it was last set
+ */
+static cb_t* gdsf_victim(policy_state_t* s)
+{
+	int n;
+
+	for (n = 0; n < VICTIM_MAX_SCAN && s->heap_len > 0; n++)
+	{
+		cb_t* cb = s->heap[0];
+		int f = atomic_load_explicit(&cb->freq, memory_order_relaxed);
+
+		if (f == 0)
+			break;
+
+		/* Its worth only grows */
+		atomic_store_explicit(&cb->freq, 0, memory_order_relaxed);
+		cb->counted = cb->counted + f < GDSF_MAX_FREQ ? 
+			          cb->counted + f : GDSF_MAX_FREQ;
+		cb->priority = gdsf_priority(s, cb);
+		heap_down(s, 0);
+	}
+	return s->heap_len > 0 ? s->heap[0] : NULL;
+}
+
+static void gdsf_remove(policy_state_t* s, cb_t* cb, int evicted)
+{
+	int i = cb->heap_index;
+
+	if (evicted)
+		s->gdsf_clock = cb->priority;
+
+	/* Fill the hole with the last block and restore the order */
+	s->heap_len--;
+	if (i < s->heap_len)
+	{
+		cb_t* last = s->heap[s->heap_len];
+		heap_set(s, i, last);
+		heap_up(s, i);
+		heap_down(s, last->heap_index);
+	}
+}
+
+policy_t gdsf_policy =
+{
+	.name = "gdsf",
+	.init = gdsf_init,
+	.on_insert = gdsf_insert,
+	.on_hit = gdsf_hit,
+	.choose_victim = gdsf_victim,
+	.on_remove = gdsf_remove,
+};
+
+/* All built-in policies */
+static policy_t* policies[] =
+{
+	&lru_policy, &slru_policy, &arc_policy, &s3fifo_policy, &gdsf_policy,
+	NULL
+};
+
+/* 
+ * policy_new: returns the state of policy p over a cache shard of
+ * capacity bytes
+ */
+policy_state_t* policy_new(policy_t* p, long capacity)
+{
+	policy_state_t* s = Calloc(1, sizeof(policy_state_t));
+
+	p->init(s, capacity);
+	return s;
+}
+
+/* Looks up a built-in policy by name, NULL if there is none */
+policy_t* find_policy(const char* name)
+{
+	int i;
+
+	for (i = 0; policies[i] != NULL; i++)
+		if (strcmp(policies[i]->name, name) == 0)
+			return policies[i];
+	return NULL;
+}
+
+/* 
+ * policy_report: writes the counters of a policy into out, with the
+ * h hits, m misses, i inserts and e evictions the cache counted 
+ * under it
+ */
+size_t policy_report(policy_t* p, uint64_t h, uint64_t m, uint64_t i,
+	                 uint64_t e, char* out, size_t len)
+{
+	int n;
+
+	n = snprintf(out, len,
+		"policy: name=%s hits=%lu misses=%lu hit_rate=%.2f%% "
+		"inserts=%lu evictions=%lu eviction_rate=%.2f%%\r\n",
+		p->name, (unsigned long)h, (unsigned long)m,
+		h + m ? 100.0 * h / (h + m) : 0.0, (unsigned long)i,
+		(unsigned long)e, i ? 100.0 * e / i : 0.0);
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,56 @@
+/*
+ * policy.h - Pluggable eviction policies. The cache owns the hash
+ *            index and the blocks; a policy only orders them through
+ *            the prev/next links of each block and picks victims.
+ *            The built-in policies do O(1) work per operation,
+ *            except GDSF, which keeps a heap.
+ *
+ *            A policy keeps its lists in a policy_state_t, one per
+ *            cache shard. All calls on a state are made with the
+ *            write lock of its shard held, except on_hit, which
+ *            needs no state and takes no lock: the cache passes on
+ *            the hits lookups held back from whichever thread
+ *            drains them, racing with the other calls. It may only
+ *            update cb->freq; reordering on hits is put off until
+ *            choose_victim, which finds the marks the hits left.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cache.h"
+
+/* A policy's lists over one cache shard */
+typedef struct policy_state policy_state_t;
+
+/* An eviction policy */
+typedef struct eviction_policy
+{
+	const char* name;
+	void (*init)(policy_state_t* s, long capacity); /* capacity in bytes */
+	void (*on_insert)(policy_state_t* s, cb_t* cb); /* block entered */
+	void (*on_hit)(cb_t* cb);                       /* block was found */
+	cb_t* (*choose_victim)(policy_state_t* s);      /* next to evict */
+	void (*on_remove)(policy_state_t* s, cb_t* cb, int evicted);
+	                                                /* block left */
+} policy_t;
+
+extern policy_t lru_policy;
+extern policy_t slru_policy;
+extern policy_t arc_policy;
+extern policy_t s3fifo_policy;
+extern policy_t gdsf_policy;
+
+policy_state_t* policy_new(policy_t* p, long capacity);
+policy_t* find_policy(const char* name);
+size_t policy_report(policy_t* p, uint64_t h, uint64_t m, uint64_t i,
+	                 uint64_t e, char* out, size_t len);
+
+#endif /* __POLICY_H__ */
@@ -15,13 +15,47 @@
 #include <sys/socket.h>
 #include "csapp.h"
 #include "cache.h"
+#include "http.h"
+#include "relay.h"
+#include "quota.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "warm.h"
+#include "compress.h"
+#include "vary.h"
+#include "range.h"
+#include "cond.h"
+#include "neg.h"
+#include "epoch.h"
+#include "hot.h"
+#include "sbuf.h"
+#include "percore.h"
 
 #define DEFAULT_HTTP_PORT 80
 
+/* Ports CONNECT may tunnel to; -p replaces the default list */
+#define MAX_CONNECT_PORTS 16
+static int connect_ports[MAX_CONNECT_PORTS] = { 443 };
+static int num_connect_ports = 1;
+
+/* Accepted connections waiting for a worker of the pool */
+#define SBUF_SIZE 64
+
+/* Set by SIGTERM or SIGINT to stop accepting and shut down */
+static volatile sig_atomic_t stopping = 0;
+static int listen_socket_fd;
+
+/* Connections for the worker pool, with -T */
+static sbuf_t conns;
+
+/* Directory of the lists local clients may warm from, with -L */
+static char* warm_dir = NULL;
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *accept_gzip_hdr = "Accept-Encoding: gzip\r\n";
+static const char *accept_identity_hdr = "Accept-Encoding: identity\r\n";
 static const char* connection_hdr = "Connection: close\r\n";
 static const char* proxy_connection_hdr = "Proxy-Connection: close\r\n";
 
@@ -33,74 +67,252 @@ static const char* user_agent_tag = "User-Agent: ";
 static const char* connection_tag = "Connection: ";
 static const char* proxy_connection_tag = "Proxy-Connection: ";
 
+/* reply to a CONNECT once the tunnel is up */
+static const char* established_hdr = "HTTP/1.1 200 Connection established\r\n\r\n";
+
+/* interim reply to Expect: 100-continue */
+static const char* continue_hdr = "HTTP/1.1 100 Continue\r\n\r\n";
+
 /* footer strings */
 static const char* http_ftr = " HTTP/1.0\r\n";
+static const char* http11_ftr = " HTTP/1.1\r\n";
+
+void clienterror(int fd, char *cause, char *errnum, 
+		 char *shortmsg, char *longmsg);
 
-/* Opens a socket to the server */
+/* 
+ * open_connection_to_server: opens a socket to the server. Returns
+ * -1 if it cannot be reached and -2 if its name does not resolve;
+ * a failure is remembered for a while, and the server not tried
+ * again until then.
+ */
 int open_connection_to_server(char* server_name, int server_port)
 {
-	int server_socket_fd = open_clientfd_r(server_name, server_port);
+	char origin[MAXLINE];
+	int server_socket_fd;
+	int cls;
+
+	neg_origin_key(origin, sizeof(origin), server_name, server_port);
+	if ((cls = neg_lookup(origin, NULL, NULL)) >= 0)
+		return cls == NEG_DNS ? -2 : -1;
+
+	server_socket_fd = open_clientfd_r(server_name, server_port);
+	if (server_socket_fd < 0)
+		neg_record(origin, server_socket_fd == -2 ? NEG_DNS : NEG_CONNECT,
+			       0, NULL);
 	return server_socket_fd;
 }
 
+/* Microseconds since start */
+static uint32_t elapsed_us(struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		   (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
 /* 
  * send_response_to_client:
- * Sends the server response back to the client 
+ * Sends the server response back to the client. The header is
+ * parsed first so the body can be read exactly and the decision
+ * to cache it is made before anything is buffered. Only GET
+ * responses are cached, along with how long the fetch took from
+ * here on. client_socket_fd is -1 and req NULL when warming the
+ * cache, and then nothing is sent. A client that takes gzip may get
+ * the response gzipped on the fly. Returns the response status, or
+ * -1 if no valid response arrived.
  */
-void send_response_to_client(char* servername, char* path, 
-	           int client_socket_fd, int server_socket_fd)
+int send_response_to_client(cache_key_t* key, int method, 
+	           http_request_t* req, int client_socket_fd, 
+	           int server_socket_fd)
 {
 	/* Setup vars */
 	rio_t rp;
-	char response[MAXLINE];
-	char buffer[MAX_OBJECT_SIZE];
-	int overflow = 0;
-	size_t buf_size = 1; //Null terminator
+	http_response_t resp;
+	char* relay;
+	bufchain_t buffer;
+	char names[HTTP_VARY_LEN];
+	range_set_t ranges;
+	range_writer_t rw;
+	int answered;
+	int ranging;
+	int cacheable;
 	ssize_t nread;
+	long max_object = get_max_object_size();
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	rio_readinitb(&rp, server_socket_fd);
 	
-	buffer[0] = 0;
 	/* Read header of response */
-	while (rio_readlineb(&rp, response, MAXLINE) > 0)
+	if (http_read_response(&rp, &resp) < 0)
 	{
-		size_t resp_len = strlen(response);
-		Rio_writen(client_socket_fd, response, resp_len);
+		clienterror(client_socket_fd, key->host, "502", 
+			"Bad Gateway", "Malformed response from server");
+		rio_releaseb(&rp);
+		return -1;
+	}
+
+	/* A response to HEAD never has a body */
+	if (method == METHOD_HEAD)
+		resp.framing = BODY_NONE;
+
+	/* Decide from the header alone whether this can be cached */
+	cacheable = method == METHOD_GET && 
+		        http_cacheable(&resp, max_object);
+
+	/* A 404 or server error is remembered for a short while; one
+	   with no freshness of its own is left to that entry */
+	if (method == METHOD_GET && !(cacheable && resp.max_age > 0) &&
+		neg_response(key->str, &resp))
+		cacheable = 0;
 
-		/* Add content to buffer */
-		if(!overflow && resp_len + buf_size < MAX_OBJECT_SIZE)
+	/* A response that varies is cached as the variant the request 
+	   headers select. Accept-Encoding only matters if the body is
+	   encoded at the origin; a plain one suits every client */
+	key->vary = NULL;
+	if (cacheable && resp.vary[0] != 0)
+	{
+		if (vary_names(resp.vary, !resp.encoded, names, 
+			           sizeof(names)) < 0)
+		{
+			/* Vary: * matches no later request */
+			vary_uncacheable();
+			cacheable = 0;
+		}
+		else if (names[0] != 0 && key->headers != NULL)
 		{
-			buf_size += resp_len;
-			strcat(buffer, response);
+			key->vary = names;
+			key->variant = vary_variant(names, key->headers);
 		}
-		else /* Check if buffer exceeds max allowed buffer size */
-			overflow = 1;
-		if (strcmp(response, "\r\n")==0)
-			  break;
 	}
-	
-	/* Send the body of the response */
-	while ((nread = rio_readnb(&rp, response, MAXLINE)) > 0)
+
+	/* A client whose validators match gets a 304, and a range
+	   request only its ranges, cut out as the body arrives; either 
+	   way the whole object is fetched, so it can be cached */
+	answered = cond_begin(req, &resp, client_socket_fd);
+	ranging = !answered && 
+		      range_begin(req, &resp, client_socket_fd, &ranges);
+	if (ranging)
+		range_writer_init(&rw, &ranges, client_socket_fd, 
+			              resp.content_type);
+
+	/* Plain text for a client that takes gzip is compressed on the
+	   way; the gzip form is what gets cached */
+	if (!answered && !ranging && req != NULL && 
+		compress_wanted(&resp, method, req->accept_gzip))
 	{
-		size_t resp_len = strlen(response);
-		/* Add to buffer */
-		if(!overflow && resp_len + buf_size < MAX_OBJECT_SIZE)
+		bufchain_t hdr;
+		long raw;
+
+		/* Chunked if both ends speak HTTP/1.1, else until close */
+		int chunked = req->http11 && 
+			          strncmp(resp.hdr.head->data, "HTTP/1.1", 8) == 0;
+
+		bufchain_init(&hdr);
+		compress_header(&resp.hdr, &hdr, -1, chunked);
+		bufchain_append(&hdr, "\r\n", 2);
+		bufchain_write(client_socket_fd, &hdr);
+		bufchain_release(&hdr);
+
+		bufchain_init(&buffer);
+		raw = compress_relay(&rp, &resp, client_socket_fd, chunked, 
+			                 &buffer, cacheable ? 
+			                 max_object - (long)resp.hdr.len : 0);
+		if (cacheable && raw >= 0 && raw <= UINT32_MAX && buffer.len > 0)
 		{
-			buf_size += resp_len;
-			strcat(buffer, response);
+			uint32_t cost = elapsed_us(&start);
+			bufchain_init(&hdr);
+			compress_header(&resp.hdr, &hdr, buffer.len, 0);
+			bufchain_append(&hdr, "\r\n", 2);
+			add_elem(key, &hdr, &buffer, 
+				resp.max_age > 0 ? time(NULL) + resp.max_age : 0,
+				cost, raw);
+			bufchain_release(&hdr);
 		}
-		else
-			overflow = 1;
+		key->vary = NULL;
+		bufchain_release(&buffer);
+		http_response_release(&resp);
+		rio_releaseb(&rp);
+		return resp.status;
+	}
+	if (client_socket_fd >= 0 && !answered && !ranging)
+	{
+		bufchain_write(client_socket_fd, &resp.hdr);
+		Rio_writen(client_socket_fd, "\r\n", strlen("\r\n"));
+	}
 
-		/* Write to client */
-		Rio_writen(client_socket_fd, response, nread);
+	/* Responses that will never be cached are spliced straight
+	   through without being copied into user space; with no client
+	   there is nothing left to do */
+	if (!cacheable && !ranging && (client_socket_fd < 0 || answered ||
+		               resp.framing == BODY_LENGTH || 
+		               resp.framing == BODY_EOF))
+	{
+		if (client_socket_fd >= 0 && !answered)
+			relay_body(&rp, client_socket_fd, 
+				       resp.framing == BODY_LENGTH ? resp.remaining : -1);
+		http_response_release(&resp);
+		rio_releaseb(&rp);
+		return resp.status;
 	}
 
-	if(!overflow)
+	/* Send the body of the response; cacheable bodies are read
+	   straight into the chunks they will be cached in */
+	relay = pool_alloc(POOL_LARGE_SIZE);
+	bufchain_init(&buffer);
+	while (1)
 	{
-		/* If the buffer fits with max buffer size, 
-		   we add it to the cache */
-		add_elem(servername, path, buffer);
+		char* dst = relay;
+		size_t room = POOL_LARGE_SIZE;
+
+		if (cacheable)
+			dst = bufchain_reserve(&buffer, &room);
+		if ((nread = http_read_body(&rp, &resp, dst, room)) <= 0)
+			break;
+
+		/* Write to client, or the parts of it in its ranges */
+		if (ranging)
+			range_write(&rw, dst, nread);
+		else if (client_socket_fd >= 0 && !answered)
+			Rio_writen(client_socket_fd, dst, nread);
+
+		/* Keep it in the buffer */
+		if(cacheable && 
+		   resp.hdr.len + buffer.len + nread < (size_t)max_object)
+			bufchain_commit(&buffer, nread);
+		else if(cacheable)
+		{
+			/* Hand the chunks back as soon as we know */
+			cacheable = 0;
+			bufchain_release(&buffer);
+		}
+
+		/* Nothing more to send or keep */
+		if (!cacheable && (answered || (ranging && range_done(&rw))))
+			break;
 	}
+	if (ranging)
+		range_finish(&rw);
+
+	/* A truncated body is never cached */
+	if(cacheable && nread == 0)
+	{
+		/* If the response fits with max object size, 
+		   we add it to the cache, text gzipped if asked to */
+		uint32_t cost = elapsed_us(&start);
+		uint32_t raw_len = compress_body(&resp, &buffer);
+		http_end_header(&resp, buffer.len);
+		add_elem(key, &resp.hdr, &buffer, 
+			resp.max_age > 0 ? time(NULL) + resp.max_age : 0,
+			cost, raw_len);
+	}
+	key->vary = NULL;
+	bufchain_release(&buffer);
+	http_response_release(&resp);
+	pool_free(relay);
+	rio_releaseb(&rp);
+	return resp.status;
 }
 
 /* 
@@ -110,6 +322,10 @@ void clienterror(int fd, char *cause, char *errnum,
 {
     char buf[MAXLINE], body[MAXBUF];
 
+    /* No client to tell, e.g. while warming the cache */
+    if (fd < 0)
+        return;
+
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Proxy Error</title>");
     sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
@@ -263,78 +479,448 @@ int is_default(char* request)
 	return 0;
 }
 
-/* Handle the client connection through client socket */
-void handle_client_connection(int client_socket_fd)
+/* Returns 1 if CONNECT may tunnel to port */
+int connect_port_allowed(int port)
+{
+	int i;
+
+	for (i = 0; i < num_connect_ports; i++)
+		if (connect_ports[i] == port)
+			return 1;
+	return 0;
+}
+
+/* 
+ * handle_connect: opens a tunnel for CONNECT host:port. Only the
+ * allowed ports are tunneled to, and the port has to be given. Once
+ * the server is reached the client gets a 200, and bytes are relayed
+ * both ways until either side closes or the tunnel goes idle.
+ */
+void handle_connect(int client_socket_fd, rio_t* rp, char* request, 
+	                char* connect_prefix)
+{
+	char server_name[MAXLINE];
+	char path[MAXLINE];
+	char line[MAXLINE];
+	int server_port;
+	int server_socket_fd;
+	char* target = request + strlen(connect_prefix);
+
+	/* There is no default port to fall back to */
+	if (target[strcspn(target, ": ")] != ':')
+	{
+		clienterror(client_socket_fd, "Parser Error", "400", 
+			"CONNECT needs host:port.", "");
+		return;
+	}
+	if(parse_get_request(client_socket_fd, request, connect_prefix, 
+		server_name, &server_port, path) < 0)
+		return;
+	if (!connect_port_allowed(server_port))
+	{
+		clienterror(client_socket_fd, "Tunnel Error", "403", 
+			"CONNECT to this port is not allowed.", "");
+		return;
+	}
+
+	/* Skip the rest of the request header */
+	while (rio_readlineb(rp, line, MAXLINE) > 0 && 
+		   strcmp(line, "\r\n") != 0)
+		;
+
+	server_socket_fd = open_connection_to_server(server_name, server_port);
+	if(server_socket_fd < 0)
+	{
+		clienterror(client_socket_fd, "Server Connection Error", 
+			"502", "Error opening connection to server.", "");
+		return;
+	}
+
+	Rio_writen(client_socket_fd, (void*)established_hdr, 
+		       strlen(established_hdr));
+	relay_tunnel(rp, server_socket_fd, TUNNEL_IDLE_SECS);
+
+	/* close connection to server */
+	Close(server_socket_fd);
+}
+
+/* 
+ * handle_admin_request: answers requests addressed to the proxy
+ * itself, e.g. GET /__proxy/stats, GET /__proxy/hosts or
+ * GET /__proxy/warm?list
+ */
+/* Checks that the client on fd connects from this machine */
+int from_loopback(int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	if (getpeername(fd, (SA *)&addr, &len) < 0 || 
+		addr.sin_family != AF_INET)
+		return 0;
+	return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+void handle_admin_request(int client_socket_fd, char* command)
+{
+	char body[MAXBUF * 4];
+	char hdr[MAXLINE];
+	size_t len = 0;
+
+	if (strncmp(command, "stats ", strlen("stats ")) == 0)
+	{
+		len += cache_report(body + len, sizeof(body) - len);
+		len += pool_report(body + len, sizeof(body) - len);
+		len += relay_report(body + len, sizeof(body) - len);
+		len += disk_report(body + len, sizeof(body) - len);
+		len += snapshot_report(body + len, sizeof(body) - len);
+		len += warm_report(body + len, sizeof(body) - len);
+		len += compress_report(body + len, sizeof(body) - len);
+		len += range_report(body + len, sizeof(body) - len);
+		len += cond_report(body + len, sizeof(body) - len);
+		len += neg_report(body + len, sizeof(body) - len);
+		len += hot_report(body + len, sizeof(body) - len);
+		len += percore_report(body + len, sizeof(body) - len);
+	}
+	else if (strncmp(command, "hosts ", strlen("hosts ")) == 0)
+		len += cache_host_report(body, sizeof(body));
+	else if (strncmp(command, "warm?", strlen("warm?")) == 0)
+	{
+		/* warm?name starts warming from the list name in the -L
+		   directory. Each list has the proxy fetch every URL in it,
+		   so only clients on this machine may, and only lists put
+		   there for the purpose */
+		char* name = command + strlen("warm?");
+		char path[MAXLINE];
+
+		name[strcspn(name, " ")] = 0;
+		if (warm_dir == NULL || !from_loopback(client_socket_fd) ||
+			name[0] == 0 || name[0] == '.' || strchr(name, '/') != NULL)
+		{
+			clienterror(client_socket_fd, "warm", "403", 
+				"Forbidden", "Warming on demand is not allowed");
+			return;
+		}
+		snprintf(path, sizeof(path), "%s/%s", warm_dir, name);
+		if (warm_start(path) < 0)
+		{
+			clienterror(client_socket_fd, "warm", "409", 
+				"Cannot warm the cache", 
+				"Unreadable list, or another one is running");
+			return;
+		}
+		len += warm_report(body, sizeof(body));
+	}
+	else if (strncmp(command, "warm ", strlen("warm ")) == 0)
+		len += warm_report(body, sizeof(body));
+	else
+	{
+		clienterror(client_socket_fd, command, "404", 
+			"Unknown admin command", "");
+		return;
+	}
+
+	sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-type: text/plain\r\n"
+		         "Content-length: %d\r\n\r\n", (int)len);
+	Rio_writen(client_socket_fd, hdr, strlen(hdr));
+	Rio_writen(client_socket_fd, body, len);
+}
+
+/* 
+ * add_default_headers: appends the header lines the proxy always
+ * sends to arg, and a Host line for server_name unless it is NULL.
+ * gzip is asked for only if the client takes it, so an origin that
+ * varies on Accept-Encoding hands back what the client can use.
+ */
+void add_default_headers(char* arg, char* server_name, int accept_gzip)
+{
+	strcat(arg, user_agent_hdr);
+	strcat(arg, accept_hdr);
+	strcat(arg, accept_gzip ? accept_gzip_hdr : accept_identity_hdr);
+	strcat(arg, connection_hdr);
+	strcat(arg, proxy_connection_hdr);
+
+	/* If host tag is not specified, write it */
+	if(server_name != NULL)
+	{
+		strcat(arg, host_tag);
+		strcat(arg, server_name);
+		strcat(arg, "\r\n");
+	}
+}
+
+/* 
+ * read_request: reads the remaining header lines of the client
+ * request, keeping those to forward in req. Returns 1 if the
+ * client gave a Host line.
+ */
+int read_request(rio_t* rp, http_request_t* req)
+{
+	char request[MAXLINE]; /* read buffer */
+	int hostseen = 0;
+
+	/* collect the remainder lines of the request */
+	while (rio_readlineb(rp, request, MAXLINE) > 0)
+	{
+		if (strcmp(request, "\r\n")==0)
+			break;
+
+		/* If it isn't a default request we send ourselves; the 
+		   ones we replace are still looked at */
+		if(http_request_header(req, request) && is_default(request) != 1)
+		{
+			/* Special for host - we always return a host request
+			   but if it is already there, we return that */
+			if(is_default(request) == 2)
+				hostseen = 1;
+			bufchain_append(&req->hdr, request, strlen(request));
+		}
+	}
+	return hostseen;
+}
+
+/* 
+ * upstream_headers: flattens the header lines forward_request sends
+ * for req into buf, for picking among cached variants. Lines past
+ * the end of buf are left out.
+ */
+void upstream_headers(char* buf, size_t len, http_request_t* req, 
+	                  char* server_name)
+{
+	chunk_t* c;
+	size_t used;
+
+	buf[0] = 0;
+	add_default_headers(buf, server_name, req->accept_gzip);
+	used = strlen(buf);
+	for (c = req->hdr.head; c != NULL && used + 1 < len; c = c->next)
+	{
+		size_t n = c->len < len - 1 - used ? c->len : len - 1 - used;
+		memcpy(buf + used, c->data, n);
+		used += n;
+	}
+	buf[used] = 0;
+}
+
+/* 
+ * forward_request: sends the request line, the headers kept by
+ * read_request and any body to the server. The body is streamed,
+ * never buffered whole. Returns 0 once it is through, -1 if the
+ * server could not take it and -2 if the client's body was
+ * malformed or cut short, or its length could not be told.
+ */
+int forward_request(rio_t* rp, http_request_t* req, char* server_name,
+	                char* path, int hostseen, int client_socket_fd, 
+	                int server_socket_fd)
+{
+	char arg[MAXLINE * 2]; /* request line and default headers */
+
+	/* Nothing is sent for a body whose end is unknown */
+	if (req->malformed)
+		return -2;
+
+	/* Request line; a chunked body needs HTTP/1.1 */
+	sprintf(arg, "%s %s%s", http_method_name(req->method), path, 
+		    req->chunked ? http11_ftr : http_ftr);
+
+	/* Default header lines */
+	add_default_headers(arg, hostseen ? NULL : server_name, 
+		                req->accept_gzip);
+
+	/* Send the header in as few writes as possible */
+	Rio_writen(server_socket_fd, arg, strlen(arg));
+	bufchain_write(server_socket_fd, &req->hdr);
+	Rio_writen(server_socket_fd, "\r\n", strlen("\r\n"));
+
+	/* The client holds the body back until told to go on */
+	if (req->expect_continue)
+		Rio_writen(client_socket_fd, (void*)continue_hdr, 
+			       strlen(continue_hdr));
+
+	/* Stream the body, if any */
+	if (req->chunked)
+		return http_forward_chunked(rp, server_socket_fd);
+	if (req->content_length > 0)
+	{
+		ssize_t sent = relay_body(rp, server_socket_fd, 
+			                      req->content_length);
+		if (sent != req->content_length)
+			return sent < 0 ? -1 : -2;
+	}
+	return 0;
+}
+
+/* 
+ * warm_fetch: fetches url into the cache the way a client's GET
+ * would be, unless a fresh copy is cached already. Used by the
+ * warming threads, so there is no client to answer.
+ */
+int warm_fetch(const char* url)
+{
+	char line[MAXLINE];
+	char server_name[MAXLINE];
+	char path[MAXLINE];
+	char arg[MAXLINE * 2];
+	const char* prefix = "http://";
+	int server_port;
+	int server_socket_fd;
+	int status;
+	cache_key_t key;
+
+	/* Parse it as the target of a request line */
+	if (strncasecmp(url, prefix, strlen(prefix)) != 0 || 
+		strlen(url) + strlen(http_ftr) >= MAXLINE)
+		return WARM_FAILED;
+	sprintf(line, "%s%s", url, http_ftr);
+	if (parse_get_request(-1, line, (char*)prefix, server_name, 
+		                  &server_port, path) < 0 ||
+		make_cache_key(&key, "http", server_name, server_port, path) < 0)
+		return WARM_FAILED;
+
+	/* Warmed copies are the ones any client can take */
+	sprintf(arg, "GET %s%s", path, http_ftr);
+	key.headers = arg + strlen(arg);
+	add_default_headers(arg, server_name, 0);
+	if (cache_contains(&key))
+		return WARM_PRESENT;
+
+	server_socket_fd = open_connection_to_server(server_name, server_port);
+	if (server_socket_fd < 0)
+		return WARM_FAILED;
+
+	strcat(arg, "\r\n");
+	Rio_writen(server_socket_fd, arg, strlen(arg));
+	status = send_response_to_client(&key, METHOD_GET, NULL, -1, 
+		                             server_socket_fd);
+	Close(server_socket_fd);
+	return status >= 200 && status < 300 ? WARM_CACHED : WARM_FAILED;
+}
+
+/* 
+ * serve_client: serves the request whose first line, n bytes long,
+ * was read from rp and closes the connection. handed is set if the
+ * request was handed over by another core already.
+ */
+void serve_client(rio_t* rp, char* request, ssize_t n, int handed)
 {
 	/* Create local vars */
-    char request[MAXLINE]; /* read buffer */
+    int client_socket_fd = rp->rio_fd;
     char server_name[MAXLINE]; /* server name */
     char path[MAXLINE]; /* uri */
     char arg[MAXLINE]; /* temp buffer */
+    char sent[MAXLINE * 2]; /* header lines sent upstream */
+    char reason[NEG_REASON_LEN]; /* of a remembered error */
+    int hostseen;
+    cache_key_t key; /* canonical cache key */
+    char method_name[MAXLINE]; /* request method */
+    char request_prefix[32]; /* "<method> http://" */
     
     int server_port;
     int server_socket_fd;
+    int method = -1;
+    int status;
     
-    char* request_prefix = "GET http://";
-    char* request_prefix_s = "GET https://";
-    const char* method = "GET ";
-    rio_t rp;
-    ssize_t n;
-
-    /* read request from client */
-    rio_readinitb(&rp, client_socket_fd);
+    char* connect_prefix = "CONNECT ";
+    char* admin_prefix = "GET /__proxy/";
+    http_request_t req;
 
-    /* read the first line of the request */
-    n = rio_readlineb(&rp, request, MAXLINE);
+    /* Work out the method */
+    if (n > 0 && sscanf(request, "%s", method_name) == 1)
+    {
+    	/* Only a known method, whose name is short, makes a prefix */
+    	method = http_method(method_name);
+    	if (method >= 0)
+    		snprintf(request_prefix, sizeof(request_prefix), "%s http://",
+    			     http_method_name(method));
+    }
 
     /* If the http prefix is present */
-    if (n > 0 && ((strncmp(request, request_prefix, 
-    	strlen(request_prefix)) == 0) || (strncmp(request, request_prefix_s, 
-    	strlen(request_prefix_s)) == 0)))
+    if (method >= 0 && strncmp(request, request_prefix, 
+    	strlen(request_prefix)) == 0)
     {
   	    /* Extract the method, server name and server port from the 
   	       first line */
+  	    if(parse_get_request(client_socket_fd, request, request_prefix, 
+  	    	server_name, &server_port, path) < 0)
+  	    {
+  	    	/* Some parse error has occurred 
+  	    	   This is sent as HTML back to client */
+	  	    /* close connection to client*/
+	  	    rio_releaseb(rp);
+	  	    Close(client_socket_fd);
+  	  	    return;
+  	    }
+  	    http_request_init(&req, method);
+  	    req.http11 = strstr(request, " HTTP/1.1") != NULL;
+  	    if (make_cache_key(&key, "http", server_name, server_port, path) < 0)
+  	    {
+  	    	clienterror(client_socket_fd, "Parser Error", "414", 
+  	    		"URI too long.", "");
+  	    	rio_releaseb(rp);
+  	    	Close(client_socket_fd);
+  	    	return;
+  	    }
+
+  	    /* In per-core mode the core that owns the key serves it */
+  	    if (!handed && percore_handoff(key.hash, rp, request))
+  	    	return;
+
+	    /* The whole request header first, since what the client
+	       accepts decides how a hit is sent */
+	    hostseen = read_request(rp, &req);
+
+	    /* They also pick the variant of a response that varies */
+	    upstream_headers(sent, sizeof(sent), &req, 
+	    	             hostseen ? NULL : server_name);
+	    key.headers = sent;
 
-    	/* This handles http and https requests */
-    	if(strncmp(request, request_prefix, strlen(request_prefix))==0)
-    	{
-	  	    if(parse_get_request(client_socket_fd, request, request_prefix, 
-	  	    	server_name, &server_port, path) < 0)
-	  	    {
-	  	    	/* Some parse error has occurred 
-	  	    	   This is sent as HTML back to client */
-		  	    /* close connection to client*/
-		  	    Close(client_socket_fd);
-	  	  	    return;
-	  	    }
-  		}
-  		else
-  		{   /* HTTPS */
-  			if(parse_get_request(client_socket_fd, request, request_prefix_s, 
-	  	    	server_name, &server_port, path) < 0)
-	  	    {
-	  	    	/* Some parse error has occurred 
-	  	    	   This is sent as HTML back to client */
-		  	    /* close connection to client*/
-		  	    Close(client_socket_fd);
-	  	  	    return;
-	  	    }
-  		}
 	    /* Check if request is in cache */
-		struct cache_block* cb = find(server_name, path);
-		if(cb != NULL)
+		struct cache_block* cb = NULL;
+		if (http_method_safe(method))
 		{
-			/* Update the LRU index */
-			update(cb);
+			cb = find(&key);
 
-			/* Write to client */
-			Rio_writen(client_socket_fd, cb->data, strlen(cb->data));
+			/* Not loaded from the snapshot yet, pull it in now */
+			if (cb == NULL && snapshot_restore(&key))
+				cb = find(&key);
+		}
+		if(cb != NULL)
+		{
+			/* Write to client in one go, inflated if it cannot take
+			   gzip; HEAD gets the stored header only, a client that
+			   has it already a 304 and a range request its ranges */
+			if (!cond_serve(client_socket_fd, cb, &req) &&
+				!range_serve(client_socket_fd, cb, &req))
+				compress_send(client_socket_fd, cb, 
+					          method == METHOD_HEAD, req.accept_gzip);
+			release_cb(cb);
+		}
 
+		/* Then in the disk tier, which sends it itself */
+		if(cb != NULL || (http_method_safe(method) && 
+		   disk_serve(&key, client_socket_fd, method == METHOD_HEAD,
+		              req.accept_gzip)))
+		{
 			/* close connection to client*/
+			http_request_release(&req);
+			rio_releaseb(rp);
 			Close(client_socket_fd);
 			return;
 		}
 
+	    /* An error the server gave recently is answered from memory */
+	    if (http_method_safe(method) && 
+	    	neg_lookup(key.str, &status, reason) >= 0)
+	    {
+	    	sprintf(arg, "%d", status);
+	    	clienterror(client_socket_fd, key.str, arg, reason, 
+	    		"Recent upstream error");
+	    	http_request_release(&req);
+	    	rio_releaseb(rp);
+	    	Close(client_socket_fd);
+	    	return;
+	    }
+
 	    /* open a connection to end server */
 	    server_socket_fd = open_connection_to_server(server_name, 
 	    	                                         server_port);
@@ -342,74 +928,64 @@ void handle_client_connection(int client_socket_fd)
 	    {
 	    	/* Socket error */
 	    	clienterror(client_socket_fd, "Server Connection Error", 
-	    		"404", "Error opening connection to server.", "");
+	    		"404", server_socket_fd == -2 ? 
+	    		"Server name did not resolve." :
+	    		"Error opening connection to server.", "");
 	    	
 	    	/* close connection to client*/
+	    	http_request_release(&req);
+	    	rio_releaseb(rp);
 	    	Close(client_socket_fd);
 	   		return; 	
 	    }
 	    
 	    /* forward request to server */
-	    
-	    /* send the GET method */
-	    Rio_writen(server_socket_fd, (void *)method, strlen(method));
-	    /* send the url path */
-	    Rio_writen(server_socket_fd, (void*)path, strlen(path));
-	    Rio_writen(server_socket_fd, (void*)http_ftr, strlen(http_ftr));
-	    
-	    int hostseen = 0;
-	    
-	    /* Send header lines */
-	    arg[0] = 0;
-	    strcpy(arg, user_agent_hdr);
-	    Rio_writen(server_socket_fd, arg, strlen(arg));
-	    strcpy(arg, accept_hdr);
-	    Rio_writen(server_socket_fd, arg, strlen(arg));
-	    strcpy(arg, accept_encoding_hdr);
-	    Rio_writen(server_socket_fd, arg, strlen(arg));
-	    strcpy(arg, connection_hdr);
-	    Rio_writen(server_socket_fd, arg, strlen(arg));
-	    strcpy(arg, proxy_connection_hdr);
-	    Rio_writen(server_socket_fd, arg, strlen(arg));
-
-	    /* send the remainder lines of the request */
-	    while (rio_readlineb(&rp, request, MAXLINE) > 0)
+	    status = forward_request(rp, &req, server_name, path, hostseen,
+	    	                     client_socket_fd, server_socket_fd);
+	    if (status == -2)
+	    	clienterror(client_socket_fd, "Request Body Error", "400", 
+	    		"Malformed or incomplete request body.", "");
+	    else if (status < 0)
+	    	clienterror(client_socket_fd, "Server Connection Error", "502", 
+	    		"Error sending the request to the server.", "");
+	    else
 	    {
-	    	/* If it isn't a default request we have already sent */
-	    	if(is_default(request) != 1)
-	    	{
-	    		/* Special for host - we always return a host request
-	    		   but if it is already there, we return that */
-	    		if(is_default(request) == 2)
-			 		hostseen = 1;
+		    /* send server's response to client */
+		    status = send_response_to_client(&key, method, &req,
+		    	client_socket_fd, server_socket_fd);
 
-			 	if (strcmp(request, "\r\n")==0)
-			 		break;
-
-			 	/* Write to server */
-			    Rio_writen(server_socket_fd, request, strlen(request));
-		 	}
+		    /* A successful unsafe request makes stored copies stale */
+		    if (!http_method_safe(method) && status >= 200 && status < 400)
+		    	remove_elem(&key);
 	    }
-
-	    /* If host tag is not specified, write it */
-	    if(!hostseen)
-	    {
-	    	strcat(arg, host_tag);
-	    	strcat(arg, server_name);
-	    	strcat(arg, "\r\n");
-	    	Rio_writen(server_socket_fd, arg, strlen(arg));
-	    }
-
-	    /* Write newline */
-	    Rio_writen(server_socket_fd, "\r\n", strlen("\r\n"));
-	    
-	    /* send server's response to client */
-	    send_response_to_client(server_name, path, client_socket_fd, 
-	    	server_socket_fd);
+	    http_request_release(&req);
 
 	    /* close connection to server */
 	    Close(server_socket_fd);
 	    /* close connection to client*/
+	    rio_releaseb(rp);
+	    Close(client_socket_fd);
+    }
+    else if (n > 0 && strncmp(request, connect_prefix, 
+    	strlen(connect_prefix)) == 0)
+    {
+    	/* HTTPS and other tunneled traffic */
+    	handle_connect(client_socket_fd, rp, request, connect_prefix);
+
+    	rio_releaseb(rp);
+	    Close(client_socket_fd);
+    }
+    else if (n > 0 && strncmp(request, admin_prefix, 
+    	strlen(admin_prefix)) == 0)
+    {
+    	/* Request for the proxy itself; drain its headers first */
+    	while (rio_readlineb(rp, arg, MAXLINE) > 0 && 
+    		   strcmp(arg, "\r\n") != 0)
+    		;
+    	handle_admin_request(client_socket_fd, 
+    		                 request + strlen(admin_prefix));
+
+    	rio_releaseb(rp);
 	    Close(client_socket_fd);
     }
     else
@@ -419,10 +995,30 @@ void handle_client_connection(int client_socket_fd)
     		"404", "Invalid command or malformed http://", "");
 
     	/* Close client connection */
+    	rio_releaseb(rp);
 	    Close(client_socket_fd);
     }
 }
 
+/* Handle the client connection through client socket */
+void handle_client_connection(int client_socket_fd)
+{
+    char request[MAXLINE]; /* read buffer */
+    rio_t rp;
+    ssize_t n;
+
+    /* read the first line of the request from client */
+    rio_readinitb(&rp, client_socket_fd);
+    n = rio_readlineb(&rp, request, MAXLINE);
+    serve_client(&rp, request, n, 0);
+}
+
+/* Serves a request another core handed over, see percore.h */
+void resume_client_connection(rio_t* rp, char* request)
+{
+	serve_client(rp, request, strlen(request), 1);
+}
+
 /* Thread routine */
 void *thread(void *vargp)
 {
@@ -431,32 +1027,279 @@ void *thread(void *vargp)
 	
 	/* detach thread */
 	Pthread_detach(pthread_self());
-	Free(vargp);
+	pool_free(vargp);
 	
 	/* open up connection */
 	handle_client_connection(connfd);
+
+	/* The thread ends with its connection: park its buffers for the
+	   next one and hand its pipe and epoch slot back */
+	pool_thread_release();
+	relay_thread_release();
+	epoch_thread_release();
 	return NULL;
 }
 
+/* 
+ * Worker routine of the pool: serves connections until it is handed
+ * -1 at shutdown, keeping its buffers, pipe, epoch slot and hot cache
+ * from one to the next
+ */
+void *worker(void *vargp)
+{
+	int connfd;
+
+	(void)vargp;
+	Pthread_detach(pthread_self());
+	hot_enable();
+	while ((connfd = sbuf_remove(&conns)) >= 0)
+		handle_client_connection(connfd);
+
+	/* Hand back the hot cache, buffers, pipe and epoch slot */
+	hot_thread_release();
+	pool_thread_release();
+	relay_thread_release();
+	epoch_thread_release();
+	return NULL;
+}
+
+/* Prints the command line usage and exits */
+void usage(char* prog)
+{
+	printf("Usage:%s [options] <port number>\n"
+		   "  -q param   strip query parameter param from cache keys\n"
+		   "  -Q         sort query parameters in cache keys\n"
+		   "  -A policy  admission policy: tinylfu (default) or all\n"
+		   "  -e policy  eviction policy: lru (default), slru, arc, "
+		   "s3fifo or gdsf\n"
+		   "  -H rule    per-host quota, pattern=quota[:reserve] with "
+		   "K/M/G sizes\n"
+		   "  -c size    cache capacity (default %d)\n"
+		   "  -m size    largest cached object (default %d)\n"
+		   "  -d path    keep evicted objects in a disk tier at path\n"
+		   "  -D size    disk tier size (default %ld)\n"
+		   "  -W rate    disk tier write limit in bytes per second\n"
+		   "  -s path    save the cache to path at shutdown and load "
+		   "it at start\n"
+		   "  -S secs    also save it every secs seconds\n"
+		   "  -w path    warm the cache from the URLs listed in path\n"
+		   "  -L dir     let local clients warm from lists in dir with"
+		   " GET /__proxy/warm?list\n"
+		   "  -P n       fetch at most n URLs at once when warming "
+		   "(default %d)\n"
+		   "  -z         store text responses gzipped\n"
+		   "  -g         gzip text responses for clients that take it\n"
+		   "  -N class=secs  remember failures of class dns (default %d),"
+		   " connect (%d),\n"
+		   "             404 (%d) or 5xx (%d) for secs seconds, 0 for "
+		   "not at all\n"
+		   "  -R low:high  evict in the background between these "
+		   "percentages of\n"
+		   "             the capacity (default %d:%d), or off\n"
+		   "  -T n       serve from a pool of n threads, each with a hot "
+		   "cache of\n"
+		   "             the objects it serves most (default: a thread "
+		   "per connection)\n"
+		   "  -C n       per-core mode: a listener and n pinned pool "
+		   "threads on each CPU\n"
+		   "  -B         with -C, keep each connection on the CPU that "
+		   "received it\n"
+		   "  -p ports   comma-separated ports CONNECT may tunnel to "
+		   "(default 443)\n", 
+		   prog, MAX_CACHE_SIZE, MAX_OBJECT_SIZE, DISK_DEFAULT_SIZE, 
+		   WARM_DEFAULT_WORKERS, NEG_DNS_TTL, NEG_CONNECT_TTL, NEG_404_TTL,
+		   NEG_5XX_TTL, RECLAIM_LOW_PCT, RECLAIM_HIGH_PCT);
+	exit(0);
+}
+
+/* Parses a size option, exiting if it is not a positive size */
+long size_option(char* arg)
+{
+	char* end;
+	long n = parse_bytes(arg, &end);
+
+	if (n <= 0 || *end != 0)
+	{
+		printf("Bad size: %s\n", arg);
+		exit(0);
+	}
+	return n;
+}
+
+/* Parses the -p list of CONNECT ports, exiting if it is bad */
+void connect_ports_option(char* list)
+{
+	char* arg = list;
+	char* end;
+	long port;
+
+	num_connect_ports = 0;
+	do
+	{
+		port = strtol(arg, &end, 10);
+		if (end == arg || port <= 0 || port > 65535 || 
+			(*end != ',' && *end != 0) || 
+			num_connect_ports == MAX_CONNECT_PORTS)
+		{
+			printf("Bad CONNECT ports: %s\n", list);
+			exit(0);
+		}
+		connect_ports[num_connect_ports++] = (int)port;
+		arg = end + 1;
+	} while (*end == ',');
+}
+
+/* Stops the accept loop; shutdown wakes the blocked accept */
+void handle_stop(int sig)
+{
+	(void)sig;
+	stopping = 1;
+	if (listen_socket_fd >= 0)
+		shutdown(listen_socket_fd, SHUT_RDWR);
+}
+
 /* Main function: parses input and starts proxy */
 int main(int argc, char* argv[])
 {
 	int portnum;
-	int listen_socket_fd;
+	int opt;
+	struct sigaction action;
+	long cache_size = MAX_CACHE_SIZE;
+	long object_size = MAX_OBJECT_SIZE;
+	char* disk_path = NULL;
+	long disk_size = DISK_DEFAULT_SIZE;
+	long disk_rate = 0;
+	char* snap_path = NULL;
+	int snap_secs = 0;
+	char* warm_path = NULL;
+	int warm_workers = WARM_DEFAULT_WORKERS;
+	int reclaim = 1;
+	int low, high;
+	int workers = 0, i;
+	int per_core = 0, steer = 0;
 
-	if (argc != 2)
+	/* Parse options */
+	while ((opt = getopt(argc, argv, "q:QA:e:H:c:m:d:D:W:s:S:w:L:P:zgN:R:T:C:Bp:")) != -1)
 	{
-		printf("Invalid number of arguments. Usage:%s <port number>\n", 
-			   argv[0]);
-		exit(0);
+		switch (opt)
+		{
+		case 'q':
+			if (cachekey_strip_param(optarg) < 0)
+			{
+				printf("Too many -q parameters.\n");
+				exit(0);
+			}
+			break;
+		case 'Q':
+			cachekey_sort_query(1);
+			break;
+		case 'A':
+			if (strcmp(optarg, "tinylfu") == 0)
+				set_admission(ADMIT_TINYLFU);
+			else if (strcmp(optarg, "all") == 0)
+				set_admission(ADMIT_ALL);
+			else
+				usage(argv[0]);
+			break;
+		case 'e':
+			if (set_eviction(optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'H':
+			if (quota_add_rule(optarg) < 0)
+			{
+				printf("Bad or too many -H rules: %s\n", optarg);
+				exit(0);
+			}
+			break;
+		case 'c':
+			cache_size = size_option(optarg);
+			break;
+		case 'm':
+			object_size = size_option(optarg);
+			if (object_size > OBJECT_SIZE_LIMIT)
+			{
+				printf("Largest object size is %ld.\n", OBJECT_SIZE_LIMIT);
+				exit(0);
+			}
+			break;
+		case 'd':
+			disk_path = optarg;
+			break;
+		case 'D':
+			disk_size = size_option(optarg);
+			break;
+		case 'W':
+			disk_rate = size_option(optarg);
+			break;
+		case 's':
+			snap_path = optarg;
+			break;
+		case 'S':
+			if ((snap_secs = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'w':
+			warm_path = optarg;
+			break;
+		case 'L':
+			warm_dir = optarg;
+			break;
+		case 'P':
+			if ((warm_workers = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'z':
+			compress_enable(1);
+			break;
+		case 'g':
+			compress_on_the_fly(1);
+			break;
+		case 'N':
+			if (neg_set_ttl(optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'R':
+			if (strcmp(optarg, "off") == 0)
+				reclaim = 0;
+			else if (sscanf(optarg, "%d:%d", &low, &high) != 2 ||
+				     set_reclaim(low, high) < 0)
+				usage(argv[0]);
+			break;
+		case 'T':
+			if ((workers = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'C':
+			if ((per_core = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'B':
+			steer = 1;
+			break;
+		case 'p':
+			connect_ports_option(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if ((per_core > 0 && workers > 0) || (steer && per_core == 0))
+		usage(argv[0]);
+
+	if (argc - optind != 1)
+	{
+		printf("Invalid number of arguments. ");
+		usage(argv[0]);
 	}
 
 	/* Get portnum */
-	portnum = atoi(argv[1]);
+	portnum = atoi(argv[optind]);
 
 	if (portnum == 0)
 	{
-		printf("Invalid port number:%s\n", argv[1]);
+		printf("Invalid port number:%s\n", argv[optind]);
 		exit(0);
 	}
 
@@ -465,24 +1308,92 @@ int main(int argc, char* argv[])
         exit(0);
     }
 
-	/* open a listening socket on the specified port */
-	listen_socket_fd = open_listenfd(portnum);
+	/* open a listening socket on the specified port, or one per 
+	   CPU, each CPU with a cache shard of its own */
+	if (per_core > 0)
+	{
+		int ncores = percore_open(portnum, steer);
 
-	if (listen_socket_fd == -1)
+		listen_socket_fd = -1;
+		if (ncores < 0)
+		{
+			printf("Could not open per-CPU listening sockets at "
+				   "portnum: %d.\n", portnum);
+			exit(0);
+		}
+		set_cache_shards(ncores);
+	}
+	else if ((listen_socket_fd = open_listenfd(portnum)) == -1)
 	{
         printf("Could not open a listening socket at portnum: %d.\n", 
         	   portnum);
         exit(0);
 	}
 
-	/* init proxy cache */
+	/* init buffer pool and proxy cache */
+	if (object_size > cache_size)
+		object_size = cache_size;
+	set_cache_limits(cache_size, object_size);
+	pool_init();
 	init_cache();
+	if (reclaim)
+		start_reclaimer();
+	if (disk_path != NULL && disk_init(disk_path, disk_size, disk_rate) < 0)
+	{
+		printf("Could not set up the disk tier at %s.\n", disk_path);
+		exit(0);
+	}
+
+	/* Warm the cache from the last snapshot; it loads in the
+	   background, so connections are accepted right away */
+	if (snap_path != NULL)
+	{
+		int n = snapshot_load(snap_path);
+		if (n >= 0)
+			printf("Loading %d objects from %s.\n", n, snap_path);
+		if (snap_secs > 0)
+			snapshot_periodic(snap_path, snap_secs);
+	}
 
 	/* Install SIGPIPE handler */
 	Signal(SIGPIPE, SIG_IGN);  
 
+	/* Fetch the warm list alongside the first clients */
+	warm_init(warm_fetch, warm_workers);
+	if (warm_path != NULL && warm_start(warm_path) < 0)
+		printf("Could not read the warm list %s.\n", warm_path);
+
+	/* Stop cleanly on SIGTERM and SIGINT. No SA_RESTART, so that
+	   accept returns */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	/* In per-core mode the workers accept for themselves; wait
+	   for the signal to stop */
+	if (per_core > 0)
+	{
+		percore_start(per_core, handle_client_connection, 
+		              resume_client_connection);
+		while (!stopping)
+			sleep(1);
+		percore_stop();
+	}
+
+	/* Prethread the pool */
+	if (workers > 0)
+	{
+		pthread_t tid;
+
+		sbuf_init(&conns, SBUF_SIZE);
+		for (i = 0; i < workers; i++)
+			Pthread_create(&tid, NULL, worker, NULL);
+	}
+
 	/* accept connections from clients by listening to listening socket */
-	while (1)
+	while (!stopping)
 	{
 		pthread_t tid;
 		int *client_socket_fd;
@@ -490,26 +1401,41 @@ int main(int argc, char* argv[])
 		socklen_t client_socket_addr_len = sizeof(client_socket_addr);
 		
 		/* Get client socket file descriptor */
-		client_socket_fd = Malloc(sizeof(int));
-		*client_socket_fd = Accept(listen_socket_fd, &client_socket_addr, 
+		client_socket_fd = pool_alloc(sizeof(int));
+		*client_socket_fd = accept(listen_socket_fd, &client_socket_addr, 
 			                       &client_socket_addr_len);
-		if (*client_socket_fd >= 0)
+		if (*client_socket_fd < 0)
+			pool_free(client_socket_fd);
+		else if (workers > 0)
+		{
+			/* Hand it to the pool */
+			sbuf_insert(&conns, *client_socket_fd);
+			pool_free(client_socket_fd);
+		}
+		else
 		{
 			/* Create new thread for client */
 			Pthread_create(&tid, NULL, thread, client_socket_fd);
 		}
 	}
 
-	/* Free cache */
-	while(get_total_size() > 0)
-		remove_LRU();
+	/* Stop the pool; each worker takes one -1 and exits */
+	for (i = 0; i < workers; i++)
+		sbuf_insert(&conns, -1);
 
-	/* Destroy lock */
-	if (pthread_rwlock_destroy(get_cache_lock()))
+	/* Save the cache for the next start */
+	if (snap_path != NULL)
 	{
-	    printf("Failed to destroy rw lock.\n");
-	    exit(0);
+		int n = snapshot_save(snap_path);
+		if (n < 0)
+			printf("Could not save the cache to %s.\n", snap_path);
+		else
+			printf("Saved %d objects to %s.\n", n, snap_path);
 	}
 
+	/* Free cache; connections still being served keep the lock
+	   and their blocks, so neither is destroyed */
+	clear_cache();
+
     return 0;
 }
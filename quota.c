@@ -0,0 +1,210 @@
+/*
+ * quota - Per-host cache partitions. Host entries live in a hash
+ *         table and are never freed, so their statistics survive
+ *         their objects. Each entry keeps its blocks in insertion
+ *         order, which is where a host over its quota evicts from.
+ *         Rules are matched against host names with fnmatch in the
+ *         order given, e.g. "*.example.com=256K:64K".
+ *
+ *         Entries are created and changed under the cache write
+ *         lock; lookups and hit counting happen under the read lock.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include "quota.h"
+
+/* A configured rule */
+typedef struct quota_rule
+{
+	char pattern[MAXLINE];
+	long quota;
+	long reserve;
+} rule_t;
+
+static rule_t rules[QUOTA_MAX_RULES];
+static int num_rules;
+
+/* The hosts of one cache shard */
+struct quota
+{
+	int id;                         /* shard */
+	int shares;                     /* shards the rules are split over */
+	host_t* hosts[QUOTA_BUCKETS];
+	int num_hosts;
+	host_t other;                   /* hosts beyond QUOTA_MAX_HOSTS */
+};
+
+/*
+ * quota_add_rule: adds a rule of the form pattern=quota[:reserve],
+ * where a quota of 0 means unlimited. Returns -1 if it is malformed
+ * or there are too many.
+ */
+int quota_add_rule(const char* spec)
+{
+	const char* eq = strrchr(spec, '=');
+	rule_t* r;
+	char* end;
+	int i;
+
+	if (eq == NULL || eq == spec || num_rules == QUOTA_MAX_RULES ||
+		eq - spec >= MAXLINE)
+		return -1;
+
+	/* Host names are lowercased in keys, so patterns are too */
+	r = &rules[num_rules];
+	for (i = 0; i < eq - spec; i++)
+		r->pattern[i] = tolower((unsigned char)spec[i]);
+	r->pattern[i] = 0;
+	r->quota = parse_bytes(eq + 1, &end);
+	r->reserve = 0;
+	if (*end == ':')
+		r->reserve = parse_bytes(end + 1, &end);
+	if (*end != 0 || r->quota < 0 || r->reserve < 0 ||
+		(r->quota > 0 && r->reserve > r->quota))
+		return -1;
+
+	num_rules++;
+	return 0;
+}
+
+/*
+ * quota_new: returns an empty host table for cache shard id, one of
+ * shares shards; each gets that share of every quota and reservation
+ */
+quota_t* quota_new(int id, int shares)
+{
+	quota_t* q = Calloc(1, sizeof(quota_t));
+
+	q->id = id;
+	q->shares = shares;
+	q->other.name = "(other)";
+	return q;
+}
+
+/* Applies the first rule matching a host, split over the shards */
+static void apply_rules(quota_t* q, host_t* h)
+{
+	int i;
+
+	for (i = 0; i < num_rules; i++)
+		if (fnmatch(rules[i].pattern, h->name, 0) == 0)
+		{
+			/* Rounded up, so a quota stays a quota */
+			h->quota = (rules[i].quota + q->shares - 1) / q->shares;
+			h->reserve = rules[i].reserve / q->shares;
+			return;
+		}
+}
+
+/*
+ * quota_host: looks up the entry of a host in q, creating it if
+ * asked to. Without create it returns NULL for unknown hosts.
+ */
+host_t* quota_host(quota_t* q, const char* name, int create)
+{
+	uint64_t hash = hash_bytes(name, strlen(name));
+	host_t** bucket = &q->hosts[hash & (QUOTA_BUCKETS - 1)];
+	host_t* h;
+
+	/* Lookups run without the cache lock, so entries are published
+	   with a release store and never change or go away after */
+	for (h = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); h != NULL; 
+		 h = h->next)
+		if (h->hash == hash && strcmp(h->name, name) == 0)
+			return h;
+
+	if (!create)
+		return NULL;
+	if (q->num_hosts == QUOTA_MAX_HOSTS)
+		return &q->other;
+
+	h = Malloc(sizeof(host_t));
+	memset(h, 0, sizeof(host_t));
+	h->name = Malloc(strlen(name) + 1);
+	strcpy(h->name, name);
+	h->hash = hash;
+	apply_rules(q, h);
+
+	h->next = *bucket;
+	__atomic_store_n(bucket, h, __ATOMIC_RELEASE);
+	q->num_hosts++;
+	return h;
+}
+
+/* quota_attach: charges a new block to its host */
+void quota_attach(host_t* h, cb_t* cb)
+{
+	cb->host = h;
+	cb->host_next = NULL;
+	cb->host_prev = h->newest;
+	if (h->newest != NULL)
+		h->newest->host_next = cb;
+	else
+		h->oldest = cb;
+	h->newest = cb;
+	h->bytes += cb->size;
+	h->objects++;
+}
+
+/* quota_detach: takes a block off its host's books */
+void quota_detach(cb_t* cb)
+{
+	host_t* h = cb->host;
+
+	if (cb->host_prev != NULL)
+		cb->host_prev->host_next = cb->host_next;
+	else
+		h->oldest = cb->host_next;
+	if (cb->host_next != NULL)
+		cb->host_next->host_prev = cb->host_prev;
+	else
+		h->newest = cb->host_prev;
+	h->bytes -= cb->size;
+	h->objects--;
+}
+
+/* Writes the line of one host of q, returns its length */
+static size_t host_line(quota_t* q, host_t* h, char* out, size_t len)
+{
+	uint64_t hi = atomic_load(&h->hits);
+	uint64_t m = atomic_load(&h->misses);
+	char shard[32] = "";
+	int n;
+
+	if (q->shares > 1)
+		snprintf(shard, sizeof(shard), " shard=%d", q->id);
+	n = snprintf(out, len,
+		"host: name=%s%s objects=%d bytes=%ld quota=%ld reserve=%ld "
+		"hits=%lu misses=%lu hit_rate=%.2f%% evictions=%lu "
+		"rejected=%lu\r\n",
+		h->name, shard, h->objects, h->bytes, h->quota, h->reserve,
+		(unsigned long)hi, (unsigned long)m,
+		hi + m ? 100.0 * hi / (hi + m) : 0.0,
+		(unsigned long)h->evictions, (unsigned long)h->rejections);
+	return (size_t)n < len ? (size_t)n : len;
+}
+
+/* 
+ * quota_report: writes a line per host of q into out, returns 
+ * length. Must be called with the read lock of q's shard held.
+ */
+size_t quota_report(quota_t* q, char* out, size_t len)
+{
+	size_t n = 0;
+	host_t* h;
+	int i;
+
+	for (i = 0; i < QUOTA_BUCKETS && n < len; i++)
+		for (h = q->hosts[i]; h != NULL && n < len; h = h->next)
+			n += host_line(q, h, out + n, len - n);
+	if (q->other.objects > 0 && n < len)
+		n += host_line(q, &q->other, out + n, len - n);
+	return n;
+}
@@ -0,0 +1,62 @@
+/*
+ * quota.h - Per-host cache partitions. Every host with cached
+ *           objects has an entry tracking its occupancy and hit
+ *           rate. Rules matching host patterns give hosts a byte
+ *           quota they may not exceed, and a reservation that
+ *           eviction on behalf of other hosts leaves alone.
+ *           Every cache shard keeps its own hosts, each with its
+ *           share of the quota and the reservation.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __QUOTA_H__
+#define __QUOTA_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cache.h"
+
+/* Max rules and tracked hosts per shard; hosts beyond that share
+   one entry */
+#define QUOTA_MAX_RULES 32
+#define QUOTA_MAX_HOSTS 4096
+
+/* Buckets of the host table (a power of two) */
+#define QUOTA_BUCKETS 1024
+
+/* Victims of reserved hosts spared per insert before giving up */
+#define QUOTA_SPARE_TRIES 8
+
+/* A host partition */
+typedef struct host_entry
+{
+	char* name;
+	uint64_t hash;         /* hash of name */
+	long quota;            /* max bytes, 0 if unlimited */
+	long reserve;          /* bytes kept from other hosts' evictions */
+	long bytes;            /* bytes cached */
+	int objects;           /* blocks cached */
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+	uint64_t evictions;    /* evicted to stay within quota */
+	uint64_t rejections;   /* objects larger than the quota */
+	cb_t* oldest;          /* its blocks, oldest first */
+	cb_t* newest;
+	struct host_entry* next; /* next in bucket */
+} host_t;
+
+/* The hosts of one cache shard */
+typedef struct quota quota_t;
+
+int quota_add_rule(const char* spec);
+quota_t* quota_new(int id, int shares);
+host_t* quota_host(quota_t* q, const char* name, int create);
+void quota_attach(host_t* h, cb_t* cb);
+void quota_detach(cb_t* cb);
+size_t quota_report(quota_t* q, char* out, size_t len);
+
+#endif /* __QUOTA_H__ */
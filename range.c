@@ -0,0 +1,396 @@
+/*
+ * range - Byte ranges cut from full copies of objects. A Range
+ *         header is parsed against the object's length; its ranges
+ *         are sorted and overlapping or adjacent ones merged, so a
+ *         body can be passed through once, front to back, and the
+ *         ranges written out as it goes by. The same pass serves a
+ *         cached object chunk by chunk and a response still
+ *         arriving from the origin, which is fetched whole (and
+ *         cached) while the client gets only what it asked for.
+ *
+ *         A Range that cannot be parsed, or lists more than
+ *         RANGE_MAX ranges, is ignored and the whole object sent,
+ *         as HTTP allows.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include "range.h"
+
+/* Stored lines replaced in a 206; a multipart one drops the type */
+static const char* single_drop[] = {
+	"HTTP/", "Content-Length:", "Content-Range:", NULL
+};
+static const char* multi_drop[] = {
+	"HTTP/", "Content-Length:", "Content-Range:", "Content-Type:", NULL
+};
+
+/* Statistics */
+static _Atomic uint64_t requests;
+static _Atomic uint64_t partial;
+static _Atomic uint64_t multipart;
+static _Atomic uint64_t unsatisfiable;
+static _Atomic uint64_t ignored;
+static _Atomic uint64_t from_cache;
+
+static int compare_ranges(const void* a, const void* b)
+{
+	long x = ((const byte_range_t*)a)->first;
+	long y = ((const byte_range_t*)b)->first;
+	return x < y ? -1 : x > y;
+}
+
+/* Parses a non-negative decimal number, leaving p behind it */
+static int parse_number(const char** p, long* n)
+{
+	char* end;
+
+	if (!isdigit((unsigned char)**p))
+		return -1;
+	*n = strtol(*p, &end, 10);
+	*p = end;
+	return 0;
+}
+
+/*
+ * range_parse: parses a Range value for an object of total bytes
+ * into rs. Returns 1 if some range can be served, 0 if none can
+ * (a 416), and -1 if the header is to be ignored.
+ */
+int range_parse(const char* value, long total, range_set_t* rs)
+{
+	const char* p = value;
+	int specs = 0, i, n = 0;
+
+	rs->n = 0;
+	rs->total = total;
+	if (strncasecmp(p, "bytes=", strlen("bytes=")) != 0)
+		return -1;
+	p += strlen("bytes=");
+
+	while (1)
+	{
+		long first = -1, last = -1;
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p != '-' && parse_number(&p, &first) < 0)
+			return -1;
+		if (*p++ != '-')
+			return -1;
+		if (isdigit((unsigned char)*p) && parse_number(&p, &last) < 0)
+			return -1;
+		if (++specs > RANGE_MAX || (first < 0 && last < 0) ||
+			(first >= 0 && last >= 0 && last < first))
+			return -1;
+
+		/* -n is the last n bytes; a range past the end is dropped */
+		if (first < 0)
+		{
+			first = last >= total ? 0 : total - last;
+			last = total - 1;
+		}
+		else if (last < 0 || last >= total)
+			last = total - 1;
+		if (first < total && first <= last)
+		{
+			rs->r[n].first = first;
+			rs->r[n].last = last;
+			n++;
+		}
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == 0)
+			break;
+		if (*p++ != ',')
+			return -1;
+	}
+
+	/* One pass front to back: sorted, and overlaps merged */
+	qsort(rs->r, n, sizeof(byte_range_t), compare_ranges);
+	for (i = 0; i < n; i++)
+	{
+		if (rs->n > 0 && rs->r[i].first <= rs->r[rs->n - 1].last + 1)
+		{
+			if (rs->r[i].last > rs->r[rs->n - 1].last)
+				rs->r[rs->n - 1].last = rs->r[i].last;
+		}
+		else
+			rs->r[rs->n++] = rs->r[i];
+	}
+	return rs->n > 0;
+}
+
+/*
+ * range_if_match: whether the If-Range value allows ranges of the
+ * object with the stored header hdr: a strong ETag or the
+ * Last-Modified date, compared exactly
+ */
+int range_if_match(bufchain_t* hdr, const char* if_range)
+{
+	char v[MAXLINE];
+
+	if (if_range[0] == 0)
+		return 1;
+	if (if_range[0] == '"')
+		return http_header_value(hdr, "ETag:", v, sizeof(v)) &&
+			   strcmp(v, if_range) == 0;
+	return http_header_value(hdr, "Last-Modified:", v, sizeof(v)) &&
+		   strcmp(v, if_range) == 0;
+}
+
+/* Writes the header of part i of a multipart body into buf */
+static size_t part_header(range_set_t* rs, int i, const char* type, 
+	                      char* buf, size_t len)
+{
+	return snprintf(buf, len, "\r\n--" RANGE_BOUNDARY "\r\n%s%s%s"
+		            "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+		            type[0] ? "Content-Type: " : "", type, 
+		            type[0] ? "\r\n" : "", rs->r[i].first, rs->r[i].last, 
+		            rs->total);
+}
+
+/*
+ * range_header: builds the 206 header for rs from the stored or
+ * received header from, whose body has the Content-Type type
+ */
+void range_header(bufchain_t* from, range_set_t* rs, const char* type,
+	              bufchain_t* to)
+{
+	char line[MAXLINE];
+	long len = 0;
+	int i;
+
+	/* Keep the version the header came with */
+	if (from->head != NULL && from->head->len >= 8 &&
+		strncmp(from->head->data, "HTTP/1.", 7) == 0)
+		sprintf(line, "%.8s 206 Partial Content\r\n", from->head->data);
+	else
+		strcpy(line, "HTTP/1.0 206 Partial Content\r\n");
+	bufchain_append(to, line, strlen(line));
+
+	if (rs->n == 1)
+	{
+		http_copy_header(from, to, single_drop);
+		sprintf(line, "Content-Range: bytes %ld-%ld/%ld\r\n"
+			    "Content-Length: %ld\r\n\r\n", rs->r[0].first,
+			    rs->r[0].last, rs->total, rs->r[0].last - rs->r[0].first + 1);
+		bufchain_append(to, line, strlen(line));
+		return;
+	}
+
+	/* Several ranges: each part has its own header */
+	http_copy_header(from, to, multi_drop);
+	for (i = 0; i < rs->n; i++)
+		len += part_header(rs, i, type, line, sizeof(line)) +
+			   rs->r[i].last - rs->r[i].first + 1;
+	len += strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+	sprintf(line, "Content-Type: multipart/byteranges; boundary="
+		    RANGE_BOUNDARY "\r\nContent-Length: %ld\r\n\r\n", len);
+	bufchain_append(to, line, strlen(line));
+}
+
+/* range_unsatisfiable: answers fd with a 416 for an object of total */
+void range_unsatisfiable(int fd, long total)
+{
+	char buf[MAXLINE];
+
+	sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+		    "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", 
+		    total);
+	rio_writen(fd, buf, strlen(buf));
+}
+
+/* range_writer_init: starts cutting rs out of a body sent to fd */
+void range_writer_init(range_writer_t* rw, range_set_t* rs, int fd,
+	                   const char* type)
+{
+	rw->rs = rs;
+	rw->fd = fd;
+	rw->pos = 0;
+	rw->part = 0;
+	rw->type = type;
+	rw->failed = 0;
+}
+
+/* Writes to the client until a write fails */
+static void put(range_writer_t* rw, const char* buf, size_t n)
+{
+	if (!rw->failed && rio_writen(rw->fd, (void*)buf, n) < 0)
+		rw->failed = 1;
+}
+
+/*
+ * range_write: passes the next n bytes of the body, writing the
+ * parts of them that fall in a range
+ */
+void range_write(range_writer_t* rw, const char* buf, size_t n)
+{
+	range_set_t* rs = rw->rs;
+	char line[MAXLINE];
+
+	while (n > 0 && rw->part < rs->n)
+	{
+		byte_range_t* r = &rs->r[rw->part];
+		size_t take;
+
+		/* Up to the start of the range */
+		if (rw->pos + (long)n <= r->first)
+			break;
+		if (rw->pos < r->first)
+		{
+			buf += r->first - rw->pos;
+			n -= r->first - rw->pos;
+			rw->pos = r->first;
+		}
+
+		if (rw->pos == r->first && rs->n > 1)
+			put(rw, line, part_header(rs, rw->part, rw->type, line, 
+				                      sizeof(line)));
+		take = r->last - rw->pos + 1;
+		if (take > n)
+			take = n;
+		put(rw, buf, take);
+		rw->pos += take;
+		buf += take;
+		n -= take;
+		if (rw->pos > r->last)
+			rw->part++;
+	}
+	rw->pos += n;
+}
+
+/* range_done: whether every range has been written */
+int range_done(range_writer_t* rw)
+{
+	return rw->part == rw->rs->n;
+}
+
+/*
+ * range_finish: closes a multipart body once every range is out.
+ * Returns -1 if the body ended early or writing failed.
+ */
+int range_finish(range_writer_t* rw)
+{
+	if (!range_done(rw))
+		return -1;
+	if (rw->rs->n > 1)
+		put(rw, "\r\n--" RANGE_BOUNDARY "--\r\n", 
+			strlen("\r\n--" RANGE_BOUNDARY "--\r\n"));
+	return rw->failed ? -1 : 0;
+}
+
+/*
+ * range_serve: answers a GET with a Range from a cached block.
+ * Returns 1 if it did (with a 206 or a 416), and 0 if the range is
+ * ignored and the whole object should be sent. A gzipped body is
+ * only cut for clients that take gzip; ranges are of the stored
+ * form.
+ */
+int range_serve(int fd, cb_t* cb, http_request_t* req)
+{
+	char type[HTTP_TYPE_LEN];
+	range_set_t rs;
+	range_writer_t rw;
+	bufchain_t hdr;
+	chunk_t* c;
+	int rc;
+
+	if (req->range[0] == 0 || req->method != METHOD_GET)
+		return 0;
+	atomic_fetch_add(&requests, 1);
+	if ((cb->raw_len > 0 && !req->accept_gzip) ||
+		!range_if_match(&cb->hdr, req->if_range) ||
+		(rc = range_parse(req->range, cb->data.len, &rs)) < 0)
+	{
+		atomic_fetch_add(&ignored, 1);
+		return 0;
+	}
+	atomic_fetch_add(&from_cache, 1);
+	if (rc == 0)
+	{
+		atomic_fetch_add(&unsatisfiable, 1);
+		range_unsatisfiable(fd, rs.total);
+		return 1;
+	}
+	atomic_fetch_add(rs.n > 1 ? &multipart : &partial, 1);
+
+	if (!http_header_value(&cb->hdr, "Content-Type:", type, sizeof(type)))
+		type[0] = 0;
+	bufchain_init(&hdr);
+	range_header(&cb->hdr, &rs, type, &hdr);
+	rc = bufchain_write(fd, &hdr);
+	bufchain_release(&hdr);
+	if (rc < 0)
+		return 1;
+
+	range_writer_init(&rw, &rs, fd, type);
+	for (c = cb->data.head; c != NULL && !range_done(&rw); c = c->next)
+		range_write(&rw, c->data, c->len);
+	range_finish(&rw);
+	return 1;
+}
+
+/*
+ * range_begin: decides whether a response being fetched for req
+ * is cut into ranges, and if so sends the client the 206 or 416
+ * header. The body has to come with a length. Returns 1 if the
+ * body is then to be passed through a range_writer, 0 if the
+ * whole response goes to the client.
+ */
+int range_begin(http_request_t* req, http_response_t* resp, int fd,
+	            range_set_t* rs)
+{
+	bufchain_t hdr;
+	int rc;
+
+	if (req == NULL || req->range[0] == 0 || req->method != METHOD_GET ||
+		fd < 0)
+		return 0;
+	atomic_fetch_add(&requests, 1);
+	if (resp->status != 200 || resp->framing != BODY_LENGTH ||
+		!range_if_match(&resp->hdr, req->if_range) ||
+		(rc = range_parse(req->range, resp->content_length, rs)) < 0)
+	{
+		atomic_fetch_add(&ignored, 1);
+		return 0;
+	}
+
+	/* The body is still read in full, to be cached */
+	if (rc == 0)
+	{
+		atomic_fetch_add(&unsatisfiable, 1);
+		range_unsatisfiable(fd, rs->total);
+		return 1;
+	}
+	atomic_fetch_add(rs->n > 1 ? &multipart : &partial, 1);
+
+	bufchain_init(&hdr);
+	range_header(&resp->hdr, rs, resp->content_type, &hdr);
+	bufchain_write(fd, &hdr);
+	bufchain_release(&hdr);
+	return 1;
+}
+
+/* range_report: writes range statistics into out */
+size_t range_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"range: requests=%lu partial=%lu multipart=%lu unsatisfiable=%lu "
+		"ignored=%lu from_cache=%lu\r\n",
+		(unsigned long)atomic_load(&requests),
+		(unsigned long)atomic_load(&partial),
+		(unsigned long)atomic_load(&multipart),
+		(unsigned long)atomic_load(&unsatisfiable),
+		(unsigned long)atomic_load(&ignored),
+		(unsigned long)atomic_load(&from_cache));
+	return (size_t)n < len ? (size_t)n : len;
+}
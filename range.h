@@ -0,0 +1,66 @@
+/*
+ * range.h - Byte-range requests answered by the proxy. Ranges are
+ *           cut from a full copy of the object, cached or being
+ *           fetched, and sent as a 206 with one range or as a
+ *           multipart/byteranges body with several.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "cache.h"
+#include "http.h"
+
+/* Most ranges honored in one request; a longer list is ignored */
+#define RANGE_MAX 16
+
+/* Separates the parts of a multipart/byteranges body */
+#define RANGE_BOUNDARY "3d6b6a416f9b5e1c"
+
+/* One range, both ends included */
+typedef struct byte_range
+{
+	long first;
+	long last;
+} byte_range_t;
+
+/* The ranges of a request, sorted and coalesced */
+typedef struct range_set
+{
+	int n;
+	byte_range_t r[RANGE_MAX];
+	long total;                  /* length of the whole object */
+} range_set_t;
+
+/* Cuts ranges out of a body passed through it in order */
+typedef struct range_writer
+{
+	range_set_t* rs;
+	int fd;
+	long pos;                    /* offset of the next byte passed */
+	int part;                    /* range being written */
+	const char* type;            /* Content-Type of the parts */
+	int failed;
+} range_writer_t;
+
+int range_parse(const char* value, long total, range_set_t* rs);
+int range_if_match(bufchain_t* hdr, const char* if_range);
+void range_header(bufchain_t* from, range_set_t* rs, const char* type,
+	              bufchain_t* to);
+void range_unsatisfiable(int fd, long total);
+void range_writer_init(range_writer_t* rw, range_set_t* rs, int fd,
+	                   const char* type);
+void range_write(range_writer_t* rw, const char* buf, size_t n);
+int range_finish(range_writer_t* rw);
+int range_done(range_writer_t* rw);
+int range_serve(int fd, cb_t* cb, http_request_t* req);
+int range_begin(http_request_t* req, http_response_t* resp, int fd,
+	            range_set_t* rs);
+size_t range_report(char* out, size_t len);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,303 @@
+/*
+ * relay - Zero-copy relaying of bytes between sockets. Data is
+ *         spliced from the source socket into a pipe and from the
+ *         pipe into the destination, so it never enters user space.
+ *         Each thread keeps one pipe for all of its relays.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "relay.h"
+#include "bufpool.h"
+
+/* Per-thread splice pipe, -1 until first used */
+static __thread int relay_pipe[2] = {-1, -1};
+
+/* Returned by tunnel_step when nothing could be moved yet */
+#define TUNNEL_AGAIN -2
+
+/* Tunnel statistics */
+static _Atomic uint64_t tunnels;
+static _Atomic int64_t tunnels_active;
+static _Atomic uint64_t tunnel_timeouts;
+static _Atomic uint64_t tunnel_bytes_up;
+static _Atomic uint64_t tunnel_bytes_down;
+
+/* Copies with read and write when splice is not available */
+static ssize_t relay_copy(int from_fd, int to_fd, long len)
+{
+	char* buf = pool_alloc(POOL_LARGE_SIZE);
+	ssize_t total = 0, nread;
+
+	while (len != 0)
+	{
+		size_t want = POOL_LARGE_SIZE;
+		if (len > 0 && len < (long)want)
+			want = len;
+		if ((nread = read(from_fd, buf, want)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (nread == 0)
+			break;
+		if (rio_writen(to_fd, buf, nread) != nread)
+		{
+			total = -1;
+			break;
+		}
+		total += nread;
+		if (len > 0)
+			len -= nread;
+	}
+	pool_free(buf);
+	return total;
+}
+
+/*
+ * relay_body: sends len bytes (or everything until EOF if len is
+ * -1) from the connection behind rp to to_fd. Bytes already read
+ * into rp's buffer go first, the rest is spliced. Returns the
+ * number of bytes relayed or -1 if writing to to_fd failed.
+ */
+ssize_t relay_body(rio_t* rp, int to_fd, long len)
+{
+	ssize_t total = 0, nin, nout, rc;
+
+	/* Flush what rio has buffered already */
+	if (rp->rio_cnt > 0)
+	{
+		long cnt = rp->rio_cnt;
+		if (len >= 0 && len < cnt)
+			cnt = len;
+		if (rio_writen(to_fd, rp->rio_bufptr, cnt) != cnt)
+			return -1;
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		total += cnt;
+		if (len > 0)
+			len -= cnt;
+	}
+
+	if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0)
+	{
+		rc = relay_copy(rp->rio_fd, to_fd, len);
+		return rc < 0 ? -1 : total + rc;
+	}
+
+	while (len != 0)
+	{
+		size_t want = RELAY_CHUNK;
+		if (len > 0 && len < (long)want)
+			want = len;
+
+		nin = splice(rp->rio_fd, NULL, relay_pipe[1], NULL, want,
+			         SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nin < 0 && errno == EINTR)
+			continue;
+		if (nin < 0 && total == 0 && errno == EINVAL)
+		{
+			/* Descriptor type does not support splice */
+			rc = relay_copy(rp->rio_fd, to_fd, len);
+			return rc < 0 ? -1 : total + rc;
+		}
+		if (nin <= 0)
+			break;
+
+		/* Drain the pipe into the destination */
+		while (nin > 0)
+		{
+			nout = splice(relay_pipe[0], NULL, to_fd, NULL, nin,
+				          SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (nout < 0 && errno == EINTR)
+				continue;
+			if (nout <= 0)
+			{
+				/* Pipe holds stale data now; start over next time */
+				relay_thread_release();
+				return -1;
+			}
+			nin -= nout;
+			total += nout;
+			if (len > 0)
+				len -= nout;
+		}
+	}
+	return total;
+}
+
+/* relay_thread_release: closes the calling thread's pipe */
+void relay_thread_release()
+{
+	if (relay_pipe[0] >= 0)
+	{
+		close(relay_pipe[0]);
+		close(relay_pipe[1]);
+		relay_pipe[0] = relay_pipe[1] = -1;
+	}
+}
+
+/*
+ * tunnel_step: moves whatever is readable on from_fd to to_fd
+ * through the pipe p. Returns the number of bytes moved, 0 when
+ * from_fd reached EOF, -1 on error or TUNNEL_AGAIN.
+ */
+static ssize_t tunnel_step(int from_fd, int to_fd, int p[2])
+{
+	ssize_t nin, nout, total = 0;
+	char buf[MAXBUF];
+
+	nin = splice(from_fd, NULL, p[1], NULL, RELAY_CHUNK,
+		         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (nin < 0 && (errno == EAGAIN || errno == EINTR))
+		return TUNNEL_AGAIN;
+	if (nin < 0 && errno == EINVAL)
+	{
+		/* Descriptor type does not support splice */
+		if ((nin = read(from_fd, buf, sizeof(buf))) < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 
+			       TUNNEL_AGAIN : -1;
+		if (nin > 0 && rio_writen(to_fd, buf, nin) != nin)
+			return -1;
+		return nin;
+	}
+	if (nin <= 0)
+		return nin;
+
+	while (total < nin)
+	{
+		nout = splice(p[0], NULL, to_fd, NULL, nin - total,
+			          SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nout < 0 && errno == EINTR)
+			continue;
+		if (nout <= 0)
+			return -1;
+		total += nout;
+	}
+	return total;
+}
+
+/*
+ * relay_tunnel: relays bytes in both directions between the client
+ * behind client_rp and server_fd until both sides have closed, an
+ * error occurs or nothing moves for idle_secs. Anything the client
+ * sent after its request header goes to the server first. Returns
+ * 0 on a clean close and -1 otherwise.
+ */
+int relay_tunnel(rio_t* client_rp, int server_fd, int idle_secs)
+{
+	int client_fd = client_rp->rio_fd;
+	int up[2], down[2];
+	int up_open = 1, down_open = 1, rc = 0;
+	struct pollfd pfd[2];
+	ssize_t n;
+
+	atomic_fetch_add(&tunnels, 1);
+	atomic_fetch_add(&tunnels_active, 1);
+
+	/* Bytes rio already pulled in belong to the server */
+	if (client_rp->rio_cnt > 0)
+	{
+		if (rio_writen(server_fd, client_rp->rio_bufptr, 
+			           client_rp->rio_cnt) != client_rp->rio_cnt)
+			rc = -1;
+		atomic_fetch_add(&tunnel_bytes_up, client_rp->rio_cnt);
+		client_rp->rio_cnt = 0;
+	}
+
+	if (pipe2(up, O_CLOEXEC) < 0)
+	{
+		atomic_fetch_sub(&tunnels_active, 1);
+		return -1;
+	}
+	if (pipe2(down, O_CLOEXEC) < 0)
+	{
+		close(up[0]);
+		close(up[1]);
+		atomic_fetch_sub(&tunnels_active, 1);
+		return -1;
+	}
+
+	while (rc == 0 && (up_open || down_open))
+	{
+		pfd[0].fd = up_open ? client_fd : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = down_open ? server_fd : -1;
+		pfd[1].events = POLLIN;
+
+		n = poll(pfd, 2, idle_secs * 1000);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			/* Idle for too long, or poll failed */
+			if (n == 0)
+				atomic_fetch_add(&tunnel_timeouts, 1);
+			rc = -1;
+			break;
+		}
+
+		/* Client to server */
+		if (pfd[0].revents)
+		{
+			n = tunnel_step(client_fd, server_fd, up);
+			if (n == 0)
+			{
+				/* Pass the half-close along */
+				shutdown(server_fd, SHUT_WR);
+				up_open = 0;
+			}
+			else if (n == -1)
+				rc = -1;
+			else if (n > 0)
+				atomic_fetch_add(&tunnel_bytes_up, n);
+		}
+
+		/* Server to client */
+		if (rc == 0 && pfd[1].revents)
+		{
+			n = tunnel_step(server_fd, client_fd, down);
+			if (n == 0)
+			{
+				shutdown(client_fd, SHUT_WR);
+				down_open = 0;
+			}
+			else if (n == -1)
+				rc = -1;
+			else if (n > 0)
+				atomic_fetch_add(&tunnel_bytes_down, n);
+		}
+	}
+
+	close(up[0]);
+	close(up[1]);
+	close(down[0]);
+	close(down[1]);
+	atomic_fetch_sub(&tunnels_active, 1);
+	return rc;
+}
+
+/* relay_report: writes tunnel statistics into out, returns length */
+size_t relay_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"tunnel: opened=%lu active=%ld idle_timeouts=%lu "
+		"bytes_up=%lu bytes_down=%lu\r\n",
+		(unsigned long)atomic_load(&tunnels),
+		(long)atomic_load(&tunnels_active),
+		(unsigned long)atomic_load(&tunnel_timeouts),
+		(unsigned long)atomic_load(&tunnel_bytes_up),
+		(unsigned long)atomic_load(&tunnel_bytes_down));
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,28 @@
+/*
+ * relay.h - Zero-copy relaying of bytes between sockets with
+ *           splice(2), for responses that are never cached and
+ *           for CONNECT tunnels.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+
+/* Bytes moved through the pipe per splice call */
+#define RELAY_CHUNK 65536
+
+/* Seconds a CONNECT tunnel may sit idle before it is closed */
+#define TUNNEL_IDLE_SECS 120
+
+ssize_t relay_body(rio_t* rp, int to_fd, long len);
+int relay_tunnel(rio_t* client_rp, int server_fd, int idle_secs);
+void relay_thread_release();
+size_t relay_report(char* out, size_t len);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,54 @@
+/*
+ * sbuf - A bounded buffer of connected descriptors, after the one
+ *        in CS:APP. Waits are retried when a signal interrupts them,
+ *        since the proxy stops on signals without SA_RESTART.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include "sbuf.h"
+
+/* Waits on a semaphore, retrying if a signal interrupts the wait */
+static void wait_sem(sem_t* s)
+{
+	while (sem_wait(s) < 0)
+		if (errno != EINTR)
+			unix_error("sem_wait error");
+}
+
+/* sbuf_init: creates an empty buffer with n slots */
+void sbuf_init(sbuf_t* sp, int n)
+{
+	sp->buf = Calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+}
+
+/* sbuf_insert: adds item at the rear, waiting for a free slot */
+void sbuf_insert(sbuf_t* sp, int item)
+{
+	wait_sem(&sp->slots);
+	wait_sem(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+}
+
+/* sbuf_remove: takes the first item, waiting for one */
+int sbuf_remove(sbuf_t* sp)
+{
+	int item;
+
+	wait_sem(&sp->items);
+	wait_sem(&sp->mutex);
+	item = sp->buf[(++sp->front) % (sp->n)];
+	V(&sp->mutex);
+	V(&sp->slots);
+	return item;
+}
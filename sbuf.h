@@ -0,0 +1,33 @@
+/*
+ * sbuf.h - A bounded buffer of connected descriptors, after the one
+ *          in CS:APP. The accepting thread inserts connections and a
+ *          fixed pool of worker threads removes and serves them.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* A bounded FIFO of descriptors */
+typedef struct sbuf
+{
+	int* buf;     /* slots */
+	int n;        /* number of slots */
+	int front;    /* buf[(front+1)%n] is the first item */
+	int rear;     /* buf[rear%n] is the last item */
+	sem_t mutex;  /* protects accesses to buf */
+	sem_t slots;  /* counts free slots */
+	sem_t items;  /* counts items */
+} sbuf_t;
+
+void sbuf_init(sbuf_t* sp, int n);
+void sbuf_insert(sbuf_t* sp, int item);
+int sbuf_remove(sbuf_t* sp);
+
+#endif /* __SBUF_H__ */
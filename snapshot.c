@@ -0,0 +1,395 @@
+/*
+ * snapshot - Saves the cache to a file and loads it back at start.
+ *            Saving pins every block, writes the records to a
+ *            temporary file and renames it over the old snapshot,
+ *            so a crash mid-save never leaves a torn file.
+ *
+ *            Loading maps the file and returns at once; a loader
+ *            thread then adds the records to the cache in the
+ *            background. A request for a key that has not been
+ *            loaded yet looks it up in the file's slot table and
+ *            loads just that record. Each slot is claimed once, by
+ *            whichever of the two gets to it first. Stale records
+ *            are skipped; the rest keep their expiry time.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "vary.h"
+
+/* Rounds n up to a multiple of 8 */
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+/* The mapped snapshot while it is being loaded */
+static char* map;
+static size_t map_size;
+static snap_header_t* snap;
+static snap_slot_t* table;
+static _Atomic uint8_t* claimed;
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* One save at a time */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics */
+static _Atomic uint64_t restored;
+static _Atomic uint64_t lazy;
+static _Atomic uint64_t skipped;
+static uint64_t saves;
+static uint64_t saved_objects;
+static long load_ms;
+
+/* Bytes a record takes in the file */
+static size_t record_size(snap_record_t* r)
+{
+	return PAD8(sizeof(snap_record_t) + r->key_len + 1 + r->host_len + 1 +
+		        r->vary_len + 1 + r->hdr_len + r->data_len);
+}
+
+/* Writes a chain to a stream, -1 on error */
+static int write_chain(FILE* f, bufchain_t* bc)
+{
+	chunk_t* c;
+
+	for (c = bc->head; c != NULL; c = c->next)
+		if (fwrite(c->data, 1, c->len, f) != c->len)
+			return -1;
+	return 0;
+}
+
+/*
+ * snapshot_save: writes every fresh cached object to path. Returns
+ * the number of objects saved, or -1 on error.
+ */
+int snapshot_save(const char* path)
+{
+	static const char zeros[8];
+	char tmp[MAXLINE];
+	snap_header_t hdr;
+	snap_slot_t* slots;
+	cb_t** blocks;
+	time_t now = time(NULL);
+	uint64_t off = sizeof(snap_header_t);
+	int n, i, saved = 0, err = 0;
+	FILE* f;
+
+	pthread_mutex_lock(&save_lock);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL)
+	{
+		pthread_mutex_unlock(&save_lock);
+		return -1;
+	}
+
+	/* Pin everything, so the cache is not locked while writing */
+	n = cache_collect(&blocks);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAP_VERSION;
+	hdr.table_size = 16;
+	while (hdr.table_size < 2 * (uint32_t)n)
+		hdr.table_size *= 2;
+	slots = Calloc(hdr.table_size, sizeof(snap_slot_t));
+	err |= fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+	for (i = 0; i < n && !err; i++)
+	{
+		cb_t* cb = blocks[i];
+		snap_record_t r;
+		uint32_t s;
+
+		if (cb->expires != 0 && cb->expires <= now)
+			continue;
+
+		r.hash = cb->hash;
+		r.expires = cb->expires;
+		r.cost = cb->cost;
+		r.key_len = strlen(cb->key);
+		r.host_len = strlen(cb->hostname);
+		r.hdr_len = cb->hdr.len;
+		r.data_len = cb->data.len;
+		r.raw_len = cb->raw_len;
+		r.vary_len = cb->vary != NULL ? strlen(cb->vary) : 0;
+		r.variant = cb->variant;
+
+		err |= fwrite(&r, sizeof(r), 1, f) != 1;
+		err |= fwrite(cb->key, 1, r.key_len + 1, f) != r.key_len + 1;
+		err |= fwrite(cb->hostname, 1, r.host_len + 1, f) !=
+			   r.host_len + 1;
+		err |= fwrite(cb->vary != NULL ? cb->vary : "", 1, 
+			          r.vary_len + 1, f) != r.vary_len + 1;
+		err |= write_chain(f, &cb->hdr) < 0;
+		err |= write_chain(f, &cb->data) < 0;
+
+		/* Pad to the next record */
+		s = record_size(&r) - (sizeof(r) + r.key_len + 1 + r.host_len +
+			                   1 + r.vary_len + 1 + r.hdr_len + r.data_len);
+		err |= fwrite(zeros, 1, s, f) != s;
+
+		/* Index it by linear probing */
+		for (s = r.hash & (hdr.table_size - 1); slots[s] != 0;
+			 s = (s + 1) & (hdr.table_size - 1))
+			;
+		slots[s] = off;
+		off += record_size(&r);
+		saved++;
+	}
+
+	for (i = 0; i < n; i++)
+		release_cb(blocks[i]);
+	Free(blocks);
+
+	/* Table at the end, then the finished header */
+	hdr.count = saved;
+	hdr.table_off = off;
+	hdr.saved = now;
+	err |= fwrite(slots, sizeof(snap_slot_t), hdr.table_size, f) !=
+		   hdr.table_size;
+	err |= fseek(f, 0, SEEK_SET) != 0;
+	err |= fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+	err |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+	err |= fclose(f) != 0;
+	Free(slots);
+
+	if (err || rename(tmp, path) < 0)
+	{
+		unlink(tmp);
+		pthread_mutex_unlock(&save_lock);
+		return -1;
+	}
+	saves++;
+	saved_objects = saved;
+	pthread_mutex_unlock(&save_lock);
+	return saved;
+}
+
+/*
+ * materialize: adds the record at off to the cache if it is sound
+ * and still fresh. Must hold map_lock. Returns 1 if it was added.
+ */
+static int materialize(uint64_t off)
+{
+	snap_record_t* r;
+	cache_key_t key;
+	bufchain_t hdr, data;
+	char* p;
+
+	/* Records were written by us, but the file may be damaged */
+	if (off < sizeof(snap_header_t) || off > snap->table_off ||
+		off + sizeof(snap_record_t) > snap->table_off)
+		return 0;
+	r = (snap_record_t*)(map + off);
+	if (r->key_len >= MAXLINE || r->host_len >= MAXLINE ||
+		r->vary_len >= MAXLINE || off + record_size(r) > snap->table_off)
+		return 0;
+
+	if (r->expires != 0 && r->expires <= time(NULL))
+	{
+		atomic_fetch_add(&skipped, 1);
+		return 0;
+	}
+
+	p = (char*)(r + 1);
+	memcpy(key.str, p, r->key_len);
+	key.str[r->key_len] = 0;
+	key.len = r->key_len;
+	key.hash = hash_bytes(key.str, key.len);
+	p += r->key_len + 1;
+	memcpy(key.host, p, r->host_len);
+	key.host[r->host_len] = 0;
+	p += r->host_len + 1;
+	if (p[r->vary_len] != 0)
+		return 0;
+	key.headers = NULL;
+	key.vary = r->vary_len > 0 ? p : NULL;
+	key.variant = r->variant;
+	p += r->vary_len + 1;
+
+	bufchain_init(&hdr);
+	bufchain_init(&data);
+	bufchain_append(&hdr, p, r->hdr_len);
+	bufchain_append(&data, p + r->hdr_len, r->data_len);
+	add_elem(&key, &hdr, &data, r->expires, r->cost, r->raw_len);
+	bufchain_release(&hdr);
+	bufchain_release(&data);
+	return 1;
+}
+
+/* Unmaps the snapshot once everything has been loaded */
+static void unmap()
+{
+	pthread_rwlock_wrlock(&map_lock);
+	Munmap(map, map_size);
+	Free((void*)claimed);
+	map = NULL;
+	pthread_rwlock_unlock(&map_lock);
+}
+
+/* The loader thread: adds every unclaimed record to the cache */
+static void* loader(void* vargp)
+{
+	struct timespec start, end;
+	uint32_t i;
+
+	(void)vargp;
+	Pthread_detach(pthread_self());
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_rwlock_rdlock(&map_lock);
+	for (i = 0; i < snap->table_size; i++)
+		if (table[i] != 0 && !atomic_exchange(&claimed[i], 1) &&
+			materialize(table[i]))
+			atomic_fetch_add(&restored, 1);
+	pthread_rwlock_unlock(&map_lock);
+	unmap();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	load_ms = (end.tv_sec - start.tv_sec) * 1000 +
+		      (end.tv_nsec - start.tv_nsec) / 1000000;
+	pool_thread_release();
+	return NULL;
+}
+
+/*
+ * snapshot_load: maps the snapshot at path and starts loading it
+ * in the background. Returns the number of records in it, or -1 if
+ * there is no usable snapshot.
+ */
+int snapshot_load(const char* path)
+{
+	struct stat st;
+	pthread_t tid;
+	int fd, count;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t))
+	{
+		close(fd);
+		return -1;
+	}
+	map_size = st.st_size;
+	map = Mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	/* Check that it is one of ours and the table is inside */
+	snap = (snap_header_t*)map;
+	if (memcmp(snap->magic, SNAP_MAGIC, sizeof(snap->magic)) != 0 ||
+		snap->version != SNAP_VERSION || snap->table_size == 0 ||
+		(snap->table_size & (snap->table_size - 1)) != 0 ||
+		snap->table_off < sizeof(snap_header_t) ||
+		snap->table_off > map_size ||
+		(uint64_t)snap->table_size * sizeof(snap_slot_t) > 
+		map_size - snap->table_off)
+	{
+		Munmap(map, map_size);
+		map = NULL;
+		return -1;
+	}
+	table = (snap_slot_t*)(map + snap->table_off);
+	claimed = Calloc(snap->table_size, sizeof(uint8_t));
+
+	/* The loader may be done and unmap it before we return */
+	count = snap->count;
+	Pthread_create(&tid, NULL, loader, NULL);
+	return count;
+}
+
+/* Checks whether request headers select the variant in a record */
+static int vary_selects(snap_record_t* r, const char* headers)
+{
+	char* names = (char*)(r + 1) + r->key_len + 1 + r->host_len + 1;
+	return names[r->vary_len] == 0 && 
+		   vary_variant(names, headers) == r->variant;
+}
+
+/*
+ * snapshot_restore: loads the record of key, or of the variant of
+ * it that key->headers select, ahead of the loader thread. Returns
+ * 1 if it is now in the cache.
+ */
+int snapshot_restore(cache_key_t* key)
+{
+	int done = 0;
+	uint32_t s, n;
+
+	pthread_rwlock_rdlock(&map_lock);
+	if (map != NULL)
+	{
+		/* A damaged table may have no empty slot to stop at */
+		for (s = key->hash & (snap->table_size - 1), n = 0; 
+			 table[s] != 0 && n < snap->table_size;
+			 s = (s + 1) & (snap->table_size - 1), n++)
+		{
+			snap_record_t* r = (snap_record_t*)(map + table[s]);
+			if (table[s] > snap->table_off ||
+				table[s] + sizeof(snap_record_t) > snap->table_off ||
+				r->hash != key->hash || r->key_len != key->len ||
+				table[s] + record_size(r) > snap->table_off ||
+				memcmp(r + 1, key->str, key->len) != 0 ||
+				(r->vary_len > 0 && key->headers != NULL &&
+				 !vary_selects(r, key->headers)))
+				continue;
+			if (!atomic_exchange(&claimed[s], 1) && materialize(table[s]))
+			{
+				atomic_fetch_add(&lazy, 1);
+				done = 1;
+			}
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&map_lock);
+	return done;
+}
+
+/* Saves to path every secs seconds */
+static void* saver(void* vargp)
+{
+	char* path = vargp;
+	int secs = atoi(path + strlen(path) + 1);
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		sleep(secs);
+		snapshot_save(path);
+		pool_thread_release();
+	}
+	return NULL;
+}
+
+/* snapshot_periodic: starts saving to path every secs seconds */
+void snapshot_periodic(const char* path, int secs)
+{
+	size_t len = strlen(path) + 1;
+	char* arg = Malloc(len + 16);
+	pthread_t tid;
+
+	/* The thread gets the path and the interval in one string */
+	memcpy(arg, path, len);
+	sprintf(arg + len, "%d", secs);
+	Pthread_create(&tid, NULL, saver, arg);
+}
+
+/* snapshot_report: writes snapshot statistics into out */
+size_t snapshot_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"snapshot: restored=%lu lazy=%lu skipped=%lu load_ms=%ld "
+		"saves=%lu last_saved=%lu\r\n",
+		(unsigned long)atomic_load(&restored),
+		(unsigned long)atomic_load(&lazy),
+		(unsigned long)atomic_load(&skipped), load_ms,
+		(unsigned long)saves, (unsigned long)saved_objects);
+	return (size_t)n < len ? (size_t)n : len;
+}
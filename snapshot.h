@@ -0,0 +1,59 @@
+/*
+ * snapshot.h - Cache snapshots for warm restarts. A snapshot file
+ *              holds a header, one record per cached object and a
+ *              hash table of record offsets, so a key can be found
+ *              in the mapped file without reading all of it.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "cache.h"
+
+#define SNAP_MAGIC   "PXYSNAP1"
+#define SNAP_VERSION 3
+
+/* Start of a snapshot file */
+typedef struct snap_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;        /* records */
+	uint64_t table_off;    /* offset of the slot table */
+	uint32_t table_size;   /* slots, a power of two */
+	uint32_t pad;
+	int64_t saved;         /* when it was taken */
+} snap_header_t;
+
+/* A record; key, host, Vary names (each NUL-terminated), header and
+   body follow, padded to 8 bytes */
+typedef struct snap_record
+{
+	uint64_t hash;         /* hash of key */
+	int64_t expires;       /* end of freshness, 0 if none */
+	uint32_t cost;         /* fetch time in microseconds */
+	uint32_t key_len;
+	uint32_t host_len;
+	uint32_t hdr_len;
+	uint64_t data_len;
+	uint32_t raw_len;      /* body length before gzip, 0 if none */
+	uint32_t vary_len;     /* 0 if it does not vary */
+	uint64_t variant;      /* which variant of key it is */
+} snap_record_t;
+
+/* Table slots are record offsets, 0 if empty */
+typedef uint64_t snap_slot_t;
+
+int snapshot_save(const char* path);
+int snapshot_load(const char* path);
+int snapshot_restore(cache_key_t* key);
+void snapshot_periodic(const char* path, int secs);
+size_t snapshot_report(char* out, size_t len);
+
+#endif /* __SNAPSHOT_H__ */
@@ -5,10 +5,17 @@
  */
 #include "csapp.h"
 
+#define MAXRANGES 16
+#define BOUNDARY "tiny_byteranges"
+
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, char *range);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, int filesize, time_t mtime, 
+		  char *range);
+int parse_range(char *range, int filesize, int *first, int *last);
+int part_header(char *part, int size, char *filetype, int first, 
+		int last, int filesize);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
@@ -45,7 +52,7 @@ void doit(int fd)
     int is_static;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE], range[MAXLINE];
     rio_t rio;
   
     /* Read request line and headers */
@@ -57,7 +64,7 @@ void doit(int fd)
                 "Tiny does not implement this method");
         return;
     }
-    read_requesthdrs(&rio);
+    read_requesthdrs(&rio, range);
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);
@@ -73,7 +80,7 @@ void doit(int fd)
 			"Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);
+	serve_static(fd, filename, sbuf.st_size, sbuf.st_mtime, range);
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
@@ -87,18 +94,22 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_requesthdrs - read and parse HTTP request headers, keeping
+ *     the value of any Range header in range
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+void read_requesthdrs(rio_t *rp, char *range) 
 {
     char buf[MAXLINE];
 
+    range[0] = '\0';
     Rio_readlineb(rp, buf, MAXLINE);
     printf("%s", buf);
     while(strcmp(buf, "\r\n")) {
 	Rio_readlineb(rp, buf, MAXLINE);
 	printf("%s", buf);
+	if (!strncasecmp(buf, "Range:", 6))
+	    sscanf(buf + 6, " %[^\r\n]", range);
     }
     return;
 }
@@ -137,30 +148,157 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, stamped with its
+ *     modification time so conditional requests can be tested
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(int fd, char *filename, int filesize, time_t mtime, 
+		  char *range) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, n, i, len, hdr;
+    int first[MAXRANGES], last[MAXRANGES];
+    char *srcp, filetype[MAXLINE], buf[MAXBUF], part[MAXLINE];
+    char modified[64];
+    struct tm tm;
  
-    /* Send response headers to client */
+    /* Work out which bytes to send; a bad Range is ignored */
+    gmtime_r(&mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
+    n = parse_range(range, filesize, first, last);
+    if (n == 0) {
+	snprintf(buf, sizeof(buf), "HTTP/1.0 416 Range Not Satisfiable\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-range: bytes */%d\r\n"
+		 "Content-length: 0\r\n\r\n", filesize);
+	Rio_writen(fd, buf, strlen(buf));
+	return;
+    }
+
+    /* Send response headers to client */
+    if (n < 0) {
+	hdr = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"
+		       "Server: Tiny Web Server\r\n"
+		       "Accept-ranges: bytes\r\n");
+	hdr += snprintf(buf + hdr, sizeof(buf) - hdr, 
+			"Content-length: %d\r\n", filesize);
+    }
+    else if (n == 1) {
+	hdr = snprintf(buf, sizeof(buf), "HTTP/1.0 206 Partial Content\r\n"
+		       "Server: Tiny Web Server\r\n");
+	hdr += snprintf(buf + hdr, sizeof(buf) - hdr, 
+			"Content-range: bytes %d-%d/%d\r\n", 
+			first[0], last[0], filesize);
+	hdr += snprintf(buf + hdr, sizeof(buf) - hdr, 
+			"Content-length: %d\r\n", last[0] - first[0] + 1);
+    }
+    else {
+	/* Each part gets its own header, counted in the length */
+	for (len = 0, i = 0; i < n; i++)
+	    len += part_header(part, sizeof(part), filetype, first[i], 
+			       last[i], filesize) + last[i] - first[i] + 1;
+	len += strlen("\r\n--" BOUNDARY "--\r\n");
+	hdr = snprintf(buf, sizeof(buf), "HTTP/1.0 206 Partial Content\r\n"
+		       "Server: Tiny Web Server\r\n");
+	hdr += snprintf(buf + hdr, sizeof(buf) - hdr, 
+			"Content-length: %d\r\n", len);
+	strcpy(filetype, "multipart/byteranges; boundary=" BOUNDARY);
+    }
+    if (hdr < (int)sizeof(buf))
+	snprintf(buf + hdr, sizeof(buf) - hdr, "Last-modified: %s\r\n"
+		 "Content-type: %s\r\n\r\n", modified, filetype);
     Rio_writen(fd, buf, strlen(buf));
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0);
     srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
     Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
+    if (n < 0)
+	Rio_writen(fd, srcp, filesize);
+    else if (n == 1)
+	Rio_writen(fd, srcp + first[0], last[0] - first[0] + 1);
+    else {
+	get_filetype(filename, filetype);
+	for (i = 0; i < n; i++) {
+	    Rio_writen(fd, part, part_header(part, sizeof(part), filetype,
+					     first[i], last[i], filesize));
+	    Rio_writen(fd, srcp + first[i], last[i] - first[i] + 1);
+	}
+	Rio_writen(fd, "\r\n--" BOUNDARY "--\r\n", 
+		   strlen("\r\n--" BOUNDARY "--\r\n"));
+    }
     Munmap(srcp, filesize);
 }
 
+/*
+ * part_header - write the header of one part of a multipart/byteranges
+ *     body into part, returning its length
+ */
+int part_header(char *part, int size, char *filetype, int first, 
+		int last, int filesize)
+{
+    int n = snprintf(part, size, "\r\n--" BOUNDARY "\r\nContent-type: %s\r\n"
+		     "Content-range: bytes %d-%d/%d\r\n\r\n", filetype, 
+		     first, last, filesize);
+    return n < size ? n : size - 1;
+}
+
+/*
+ * parse_range - parse a Range value like bytes=0-99,200-,-50 for a
+ *     file of filesize bytes. Returns the number of ranges that can
+ *     be served, 0 if there are none, or -1 if there is no usable
+ *     Range and the whole file should be sent.
+ */
+int parse_range(char *range, int filesize, int *first, int *last) 
+{
+    char *p = range, *end;
+    int n = 0, specs = 0;
+    long a, b;
+
+    if (strncasecmp(p, "bytes=", 6))
+	return -1;
+    p += 6;
+    while (*p) {
+	while (*p == ' ')
+	    p++;
+	if (++specs > MAXRANGES)
+	    return -1;
+	a = b = -1;
+	if (*p != '-') {
+	    a = strtol(p, &end, 10);
+	    if (end == p)
+		return -1;
+	    p = end;
+	}
+	if (*p++ != '-')
+	    return -1;
+	if (*p >= '0' && *p <= '9') {
+	    b = strtol(p, &end, 10);
+	    p = end;
+	}
+	if (*p == ',')
+	    p++;
+	else if (*p)
+	    return -1;
+	if ((a < 0 && b < 0) || (b >= 0 && a > b))
+	    return -1;
+
+	/* -b is the last b bytes */
+	if (a < 0) {
+	    a = b >= filesize ? 0 : filesize - b;
+	    b = filesize - 1;
+	}
+	if (b < 0 || b >= filesize)
+	    b = filesize - 1;
+	if (a < filesize && a <= b) {
+	    first[n] = a;
+	    last[n] = b;
+	    n++;
+	}
+    }
+    return specs > 0 ? n : -1;
+}
+
 /*
  * get_filetype - derive file type from file name
  */
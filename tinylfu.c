@@ -0,0 +1,157 @@
+/*
+ * tinylfu - TinyLFU admission filter. Every lookup is recorded in a
+ *           count-min sketch; a new object is only admitted if its
+ *           estimated frequency beats the one it would evict. The
+ *           first access of a key only sets its doorkeeper bits, so
+ *           one-off URLs never reach the sketch. After every
+ *           TLFU_SAMPLE_SIZE accesses all counters are halved and
+ *           the doorkeeper is cleared, so old popularity fades.
+ *
+ *           Updates race with each other on purpose: counters are
+ *           read and written with relaxed atomics, and a lost
+ *           increment only makes an estimate slightly low. Counters
+ *           and doorkeeper bits are only written when they change,
+ *           and callers may count accesses towards aging in batches
+ *           of their own, so hot keys leave the shared lines alone.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tinylfu.h"
+
+static uint8_t sketch[TLFU_DEPTH][TLFU_WIDTH];
+static uint64_t door[TLFU_DOOR_BITS / 64];
+static uint32_t samples;
+static pthread_mutex_t age_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-row seeds to derive independent indexes from one hash */
+static const uint64_t seeds[TLFU_DEPTH] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+	0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL
+};
+
+/* Index of hash in a given row */
+static uint32_t row_index(uint64_t hash, int row)
+{
+	uint64_t h = (hash ^ seeds[row]) * 0xff51afd7ed558ccdULL;
+	return (uint32_t)(h >> 32) & (TLFU_WIDTH - 1);
+}
+
+/* Doorkeeper bit positions */
+static uint32_t door_bit(uint64_t hash, int i)
+{
+	return (uint32_t)(i ? hash >> 40 : hash) & (TLFU_DOOR_BITS - 1);
+}
+
+/* Clears all state */
+void tlfu_init()
+{
+	memset(sketch, 0, sizeof(sketch));
+	memset(door, 0, sizeof(door));
+	samples = 0;
+}
+
+/* Checks, and optionally sets, the doorkeeper bits of hash */
+static int door_test(uint64_t hash, int set)
+{
+	int i, present = 1;
+
+	for (i = 0; i < 2; i++)
+	{
+		uint32_t b = door_bit(hash, i);
+		uint64_t mask = 1ULL << (b & 63);
+		if (!(__atomic_load_n(&door[b >> 6], __ATOMIC_RELAXED) & mask))
+		{
+			present = 0;
+			if (set)
+				__atomic_fetch_or(&door[b >> 6], mask, __ATOMIC_RELAXED);
+		}
+	}
+	return present;
+}
+
+/* Halves every counter and clears the doorkeeper */
+static void age()
+{
+	int r, i;
+
+	/* One thread ages; the others just carry on */
+	if (pthread_mutex_trylock(&age_lock))
+		return;
+	for (r = 0; r < TLFU_DEPTH; r++)
+		for (i = 0; i < TLFU_WIDTH; i++)
+			__atomic_store_n(&sketch[r][i], 
+				__atomic_load_n(&sketch[r][i], __ATOMIC_RELAXED) >> 1,
+				__ATOMIC_RELAXED);
+	for (i = 0; i < TLFU_DOOR_BITS / 64; i++)
+		__atomic_store_n(&door[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&samples, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&age_lock);
+}
+
+/* 
+ * tlfu_touch: records an access of the key with this hash in the
+ * sketch, without counting it towards aging; see tlfu_count
+ */
+void tlfu_touch(uint64_t hash)
+{
+	int r;
+
+	if (door_test(hash, 1))
+	{
+		for (r = 0; r < TLFU_DEPTH; r++)
+		{
+			uint8_t* c = &sketch[r][row_index(hash, r)];
+			uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+			if (v < TLFU_MAX_COUNT)
+				__atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* tlfu_count: counts n accesses touched in towards the next aging */
+void tlfu_count(uint32_t n)
+{
+	if (__atomic_add_fetch(&samples, n, __ATOMIC_RELAXED) >= 
+		TLFU_SAMPLE_SIZE)
+		age();
+}
+
+/* tlfu_record: counts one access of the key with this hash */
+void tlfu_record(uint64_t hash)
+{
+	tlfu_touch(hash);
+	tlfu_count(1);
+}
+
+/* tlfu_estimate: estimated recent access count of a key */
+int tlfu_estimate(uint64_t hash)
+{
+	int r, min = TLFU_MAX_COUNT;
+
+	for (r = 0; r < TLFU_DEPTH; r++)
+	{
+		int v = __atomic_load_n(&sketch[r][row_index(hash, r)], 
+			                    __ATOMIC_RELAXED);
+		if (v < min)
+			min = v;
+	}
+	return min + door_test(hash, 0);
+}
+
+/*
+ * tlfu_admit: decides whether a candidate may replace the victim
+ * the eviction policy picked. Ties keep the victim, which already
+ * proved itself.
+ */
+int tlfu_admit(uint64_t candidate, uint64_t victim)
+{
+	return tlfu_estimate(candidate) > tlfu_estimate(victim);
+}
@@ -0,0 +1,38 @@
+/*
+ * tinylfu.h - TinyLFU admission filter. A count-min sketch with
+ *             periodic aging estimates how often each key has been
+ *             requested lately, behind a doorkeeper bloom filter
+ *             that absorbs keys seen only once.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+
+#include <stdint.h>
+
+/* Counters per sketch row (a power of two) and number of rows */
+#define TLFU_WIDTH 16384
+#define TLFU_DEPTH 4
+
+/* Bits in the doorkeeper (a power of two) */
+#define TLFU_DOOR_BITS (TLFU_WIDTH * 8)
+
+/* Counters saturate here, as 4-bit counters would */
+#define TLFU_MAX_COUNT 15
+
+/* Accesses between agings */
+#define TLFU_SAMPLE_SIZE (TLFU_WIDTH * 10)
+
+void tlfu_init();
+void tlfu_record(uint64_t hash);
+void tlfu_touch(uint64_t hash);
+void tlfu_count(uint32_t n);
+int tlfu_estimate(uint64_t hash);
+int tlfu_admit(uint64_t candidate, uint64_t victim);
+
+#endif /* __TINYLFU_H__ */
@@ -0,0 +1,222 @@
+/*
+ * vary - Variants of a cached response. A response's Vary list is
+ *        reduced to sorted, lowercased, distinct header names, so
+ *        the same set written differently selects the same way.
+ *        The values the request sent upstream for those headers
+ *        are normalized before hashing: Accept-Encoding comes down
+ *        to whether gzip is taken, and other values are lowercased
+ *        with whitespace dropped, so trivial differences between
+ *        clients do not each make a variant of their own.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include "vary.h"
+#include "cachekey.h"
+
+/* Statistics */
+static _Atomic uint64_t checks;
+static _Atomic uint64_t mismatches;
+static _Atomic uint64_t uncacheable;
+
+/* Checks a thread holds back before adding them to the shared 
+   counts, so that lookups of variants do not all write one line */
+#define VARY_BATCH 64
+static __thread uint32_t held_checks;
+static __thread uint32_t held_mismatches;
+
+static int compare_names(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * vary_names: normalizes the value of a Vary header into out as
+ * sorted, distinct, lowercased names joined by commas. The
+ * Accept-Encoding name is left out if skip_encoding. Returns the
+ * number of names, or -1 for Vary: * (or too many names), which
+ * matches no request.
+ */
+int vary_names(const char* value, int skip_encoding, char* out, 
+	           size_t len)
+{
+	char copy[MAXLINE];
+	char* names[VARY_MAX_NAMES];
+	char* p = copy;
+	size_t used = 0;
+	int n = 0, i, distinct;
+
+	snprintf(copy, sizeof(copy), "%s", value);
+	out[0] = 0;
+	while (*p)
+	{
+		char* name;
+
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == 0)
+			break;
+		name = p;
+		while (*p && *p != ',' && *p != ' ' && *p != '\t')
+		{
+			*p = tolower((unsigned char)*p);
+			p++;
+		}
+		if (*p)
+			*p++ = 0;
+
+		if (strcmp(name, "*") == 0 || n == VARY_MAX_NAMES)
+			return -1;
+		if (skip_encoding && strcmp(name, "accept-encoding") == 0)
+			continue;
+		names[n++] = name;
+	}
+
+	qsort(names, n, sizeof(char*), compare_names);
+	for (i = 0, distinct = 0; i < n; i++)
+	{
+		size_t l = strlen(names[i]);
+		if (i > 0 && strcmp(names[i], names[i - 1]) == 0)
+			continue;
+		if (used + l + 2 > len)
+			return -1;
+		if (used > 0)
+			out[used++] = ',';
+		memcpy(out + used, names[i], l + 1);
+		used += l;
+		distinct++;
+	}
+	return distinct;
+}
+
+/* Finds the value of header name in a block of header lines */
+static const char* find_header(const char* headers, const char* name, 
+	                           size_t name_len, size_t* value_len)
+{
+	const char* line = headers;
+
+	while (*line)
+	{
+		const char* end = strchr(line, '\n');
+		if (end == NULL)
+			end = line + strlen(line);
+
+		if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+		{
+			const char* v = line + name_len + 1;
+			while (v < end && (*v == ' ' || *v == '\t'))
+				v++;
+			*value_len = end - v;
+			while (*value_len > 0 && (v[*value_len - 1] == '\r' ||
+				   v[*value_len - 1] == ' '))
+				(*value_len)--;
+			return v;
+		}
+		line = *end ? end + 1 : end;
+	}
+	return NULL;
+}
+
+/* Normalizes the value of one request header into out */
+static size_t normalize(const char* name, const char* v, size_t n, 
+	                    char* out, size_t len)
+{
+	size_t used = 0, i;
+
+	/* Only whether gzip is taken matters, see compress.c */
+	if (strcmp(name, "accept-encoding") == 0)
+	{
+		char copy[MAXLINE];
+		snprintf(copy, sizeof(copy), "%.*s", (int)n, v);
+		for (i = 0; copy[i]; i++)
+			copy[i] = tolower((unsigned char)copy[i]);
+		return snprintf(out, len, "%s", strstr(copy, "gzip") != NULL &&
+			            strstr(copy, "gzip;q=0") == NULL ? 
+			            "gzip" : "identity");
+	}
+
+	for (i = 0; i < n && used + 1 < len; i++)
+		if (v[i] != ' ' && v[i] != '\t')
+			out[used++] = tolower((unsigned char)v[i]);
+	out[used] = 0;
+	return used;
+}
+
+/*
+ * vary_variant: hashes the normalized values that headers (request
+ * header lines as sent upstream) give the names in a Vary list
+ * made by vary_names. A missing header counts as empty.
+ */
+uint64_t vary_variant(const char* names, const char* headers)
+{
+	char buf[MAXLINE];
+	char value[MAXLINE];
+	const char* name = names;
+	size_t used = 0;
+
+	while (*name)
+	{
+		const char* end = strchr(name, ',');
+		size_t name_len = end ? (size_t)(end - name) : strlen(name);
+		size_t value_len = 0;
+		const char* v = find_header(headers, name, name_len, &value_len);
+		char lname[MAXLINE];
+
+		snprintf(lname, sizeof(lname), "%.*s", (int)name_len, name);
+		if (v == NULL)
+			value[0] = 0;
+		else
+			normalize(lname, v, value_len, value, sizeof(value));
+		used += snprintf(buf + used, sizeof(buf) - used, "%s=%s\n", 
+			             lname, value);
+		if (used >= sizeof(buf))
+			used = sizeof(buf) - 1;
+		name += name_len + (end != NULL);
+	}
+	return hash_bytes(buf, used);
+}
+
+/*
+ * vary_match: whether a request whose upstream header lines are
+ * headers selects the variant stored for names. The checks are
+ * counted VARY_BATCH at a time.
+ */
+int vary_match(const char* names, uint64_t variant, const char* headers)
+{
+	int match = vary_variant(names, headers) == variant;
+
+	held_mismatches += !match;
+	if (++held_checks == VARY_BATCH)
+	{
+		atomic_fetch_add_explicit(&checks, held_checks, 
+			                      memory_order_relaxed);
+		atomic_fetch_add_explicit(&mismatches, held_mismatches, 
+			                      memory_order_relaxed);
+		held_checks = held_mismatches = 0;
+	}
+	return match;
+}
+
+/* vary_uncacheable: counts a response not cached for Vary: * */
+void vary_uncacheable()
+{
+	atomic_fetch_add_explicit(&uncacheable, 1, memory_order_relaxed);
+}
+
+/* vary_report: writes variant statistics into out */
+size_t vary_report(char* out, size_t len)
+{
+	int n = snprintf(out, len,
+		"vary: checks=%lu mismatches=%lu uncacheable=%lu\r\n",
+		(unsigned long)atomic_load(&checks),
+		(unsigned long)atomic_load(&mismatches),
+		(unsigned long)atomic_load(&uncacheable));
+	return (size_t)n < len ? (size_t)n : len;
+}
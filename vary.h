@@ -0,0 +1,33 @@
+/*
+ * vary.h - Selection among variants of a cached response. The
+ *          request headers named in a response's Vary are
+ *          normalized and hashed; that hash tells the variants of
+ *          one key apart.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __VARY_H__
+#define __VARY_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* Longest list of header names a response may vary on */
+#define VARY_MAX_NAMES 16
+
+/* Variants of one key kept in memory; past this the oldest one
+   gives way */
+#define VARY_MAX_VARIANTS 8
+
+int vary_names(const char* value, int skip_encoding, char* out, 
+	           size_t len);
+uint64_t vary_variant(const char* names, const char* headers);
+int vary_match(const char* names, uint64_t variant, const char* headers);
+void vary_uncacheable();
+size_t vary_report(char* out, size_t len);
+
+#endif /* __VARY_H__ */
@@ -0,0 +1,181 @@
+/*
+ * warm - Works through a list of URLs with a fixed number of
+ *        fetcher threads. Each thread takes the next URL from a
+ *        shared index, so the list is fetched in order with at most
+ *        workers fetches in flight. Only one list runs at a time;
+ *        its progress is kept for the stats page after it ends.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include "warm.h"
+#include "bufpool.h"
+#include "epoch.h"
+
+static warm_fetch_t fetch_url;
+static int workers = WARM_DEFAULT_WORKERS;
+
+/* The current or last list; lock guards the rest of the job */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char list_path[MAXLINE];
+static char** urls;
+static int total;
+static int running;
+static int active;
+static struct timespec started;
+static long elapsed_ms;
+static _Atomic int next;
+static _Atomic int done;
+static _Atomic int cached;
+static _Atomic int present;
+static _Atomic int failed;
+
+/* warm_init: sets how URLs are fetched and how many at once */
+void warm_init(warm_fetch_t fetch, int n)
+{
+	fetch_url = fetch;
+	if (n > 0)
+		workers = n < WARM_MAX_WORKERS ? n : WARM_MAX_WORKERS;
+}
+
+/* Milliseconds since the list was started */
+static long since_start()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - started.tv_sec) * 1000 +
+		   (now.tv_nsec - started.tv_nsec) / 1000000;
+}
+
+/* A fetcher: takes URLs until the list runs out */
+static void* fetcher(void* vargp)
+{
+	int i, r;
+
+	(void)vargp;
+	Pthread_detach(pthread_self());
+	while ((i = atomic_fetch_add(&next, 1)) < total)
+	{
+		r = fetch_url(urls[i]);
+		if (r == WARM_CACHED)
+			atomic_fetch_add(&cached, 1);
+		else if (r == WARM_PRESENT)
+			atomic_fetch_add(&present, 1);
+		else
+			atomic_fetch_add(&failed, 1);
+		atomic_fetch_add(&done, 1);
+	}
+
+	/* The last one out finishes the job */
+	pthread_mutex_lock(&lock);
+	if (--active == 0)
+	{
+		for (i = 0; i < total; i++)
+			Free(urls[i]);
+		Free(urls);
+		urls = NULL;
+		elapsed_ms = since_start();
+		running = 0;
+		printf("Warmed from %s: %d cached, %d present, %d failed "
+			   "in %ld ms.\n", list_path, atomic_load(&cached), 
+			   atomic_load(&present), atomic_load(&failed), elapsed_ms);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&lock);
+	pool_thread_release();
+	epoch_thread_release();
+	return NULL;
+}
+
+/* Reads the URLs in path; blank lines and # comments are skipped */
+static int read_list(const char* path, char*** list)
+{
+	char line[MAXLINE];
+	char *s, *e;
+	int n = 0, cap = 64;
+	FILE* f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	*list = Malloc(cap * sizeof(char*));
+	while (n < WARM_MAX_URLS && fgets(line, sizeof(line), f) != NULL)
+	{
+		for (s = line; isspace((unsigned char)*s); s++)
+			;
+		for (e = s + strlen(s); e > s && isspace((unsigned char)e[-1]); e--)
+			;
+		*e = 0;
+		if (*s == 0 || *s == '#')
+			continue;
+
+		if (n == cap)
+		{
+			cap *= 2;
+			*list = Realloc(*list, cap * sizeof(char*));
+		}
+		(*list)[n] = Malloc(e - s + 1);
+		strcpy((*list)[n++], s);
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * warm_start: starts fetching the URLs listed in path in the
+ * background. Returns the number of URLs, or -1 if the list cannot
+ * be read or another list is still running.
+ */
+int warm_start(const char* path)
+{
+	char** list;
+	pthread_t tid;
+	int n, i;
+
+	pthread_mutex_lock(&lock);
+	if (running || fetch_url == NULL || (n = read_list(path, &list)) < 0)
+	{
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	snprintf(list_path, sizeof(list_path), "%s", path);
+	urls = list;
+	total = n;
+	running = 1;
+	active = workers;
+	atomic_store(&next, 0);
+	atomic_store(&done, 0);
+	atomic_store(&cached, 0);
+	atomic_store(&present, 0);
+	atomic_store(&failed, 0);
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	for (i = 0; i < workers; i++)
+		Pthread_create(&tid, NULL, fetcher, NULL);
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+/* warm_report: writes the progress of the current or last list */
+size_t warm_report(char* out, size_t len)
+{
+	int n;
+
+	pthread_mutex_lock(&lock);
+	n = snprintf(out, len,
+		"warm: state=%s list=%s total=%d done=%d cached=%d present=%d "
+		"failed=%d workers=%d ms=%ld\r\n",
+		running ? "running" : (list_path[0] ? "done" : "idle"),
+		list_path[0] ? list_path : "-", total, atomic_load(&done),
+		atomic_load(&cached), atomic_load(&present),
+		atomic_load(&failed), workers,
+		running ? since_start() : elapsed_ms);
+	pthread_mutex_unlock(&lock);
+	return (size_t)n < len ? (size_t)n : len;
+}
@@ -0,0 +1,37 @@
+/*
+ * warm.h - Cache warming from a list of URLs, one per line. A few
+ *          worker threads fetch the URLs into the cache, so known
+ *          hot objects are there before traffic arrives without
+ *          crowding out live requests.
+ *
+ * Sunny Nahar
+ * anahar
+ *
+ * Amrith Deepak
+ * amrithd
+ */
+#ifndef __WARM_H__
+#define __WARM_H__
+
+#include "csapp.h"
+
+/* Fetchers working through a list at once, by default and at most */
+#define WARM_DEFAULT_WORKERS 2
+#define WARM_MAX_WORKERS     32
+
+/* Longest list that is read */
+#define WARM_MAX_URLS 100000
+
+/* Outcomes of fetching one URL */
+#define WARM_CACHED  0  /* fetched and offered to the cache */
+#define WARM_PRESENT 1  /* already cached, nothing fetched */
+#define WARM_FAILED  2  /* bad URL or the fetch failed */
+
+/* Fetches one URL into the cache, returning one of WARM_* */
+typedef int (*warm_fetch_t)(const char* url);
+
+void warm_init(warm_fetch_t fetch, int workers);
+int warm_start(const char* path);
+size_t warm_report(char* out, size_t len);
+
+#endif /* __WARM_H__ */